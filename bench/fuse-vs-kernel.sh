@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# fuse-vs-kernel.sh
+# Compare the kernel module and operafs's FUSE daemon on the same image.
+#
+# Usage: fuse-vs-kernel.sh <image> [threads]
+#
+# Must be run as root (loop mounting, dropping caches). Expects the module
+# to be built in the top directory and tools/operafuse to be built.
+# For each implementation it measures, with cold caches:
+#   - a metadata crawl (stat of every entry),
+#   - a sequential read of every file, one after another,
+#   - a parallel read of every file using [threads] readers.
+
+set -e
+
+IMAGE=$1
+THREADS=${2:-8}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+MNT=$(mktemp -d /tmp/opera-bench.XXXXXX)
+
+if [ -z "$IMAGE" ]; then
+	echo "Usage: $0 <image> [threads]" >&2
+	exit 1
+fi
+
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Run a command and print the elapsed wall clock time in seconds.
+timeit() {
+	start=$(date +%s.%N)
+	"$@" > /dev/null
+	end=$(date +%s.%N)
+	echo "$end - $start" | bc
+}
+
+run_suite() {
+	name=$1
+	bytes=$(find "$MNT" -type f -printf '%s\n' | awk '{ s += $1 } END { print s }')
+
+	drop_caches
+	t=$(timeit find "$MNT" -exec stat -c '%i %s' {} +)
+	printf '%-8s crawl       %8.3f s\n' "$name" "$t"
+
+	drop_caches
+	t=$(timeit sh -c "find '$MNT' -type f -exec cat {} + > /dev/null")
+	printf '%-8s seq-read    %8.3f s  %8.1f MiB/s\n' "$name" "$t" \
+			"$(echo "$bytes / 1048576 / $t" | bc -l)"
+
+	drop_caches
+	t=$(timeit sh -c "find '$MNT' -type f -print0 | \
+			xargs -0 -n 16 -P $THREADS cat > /dev/null")
+	printf '%-8s par-read    %8.3f s  %8.1f MiB/s (%d threads)\n' "$name" \
+			"$t" "$(echo "$bytes / 1048576 / $t" | bc -l)" "$THREADS"
+}
+
+if ! grep -qw opera /proc/filesystems; then
+	insmod "$TOP/operafs.ko"
+fi
+
+mount -t opera -o loop,ro "$IMAGE" "$MNT"
+run_suite kernel
+umount "$MNT"
+
+"$TOP/tools/operafuse" "$IMAGE" "$MNT" -o ro
+run_suite fuse
+fusermount3 -u "$MNT" 2>/dev/null || umount "$MNT"
+
+rmdir "$MNT"
+
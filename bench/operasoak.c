@@ -0,0 +1,557 @@
+/*
+ * operasoak.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Load generator for soak.sh: run a mix of readers over a set of mounted
+// Opera file systems and report throughput and latency per reader kind.
+//
+// Usage: operasoak [-t threads] [-d seconds] [-m mix] [-D] <mount>...
+//
+// The reader kinds are:
+//   crawl     walk a whole mount, readdir + fstatat of every entry;
+//             latency is per system call
+//   stream    read the largest file of a mount sequentially, 64 KiB at
+//             a time (like an emulator playing FMV); latency per read()
+//   extract   read random whole files; latency per file
+// The mix gives the relative number of threads of each kind, for
+// instance "crawl=2,stream=1,extract=1" (the default). Each thread
+// picks a random mount for each pass.
+//
+// The file lists are gathered before the run. With -D the page, dentry
+// and inode caches are dropped after that (needs root), so that the run
+// starts cold.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+//============================================================================
+
+
+enum soak_kind {
+	SOAK_CRAWL,
+	SOAK_STREAM,
+	SOAK_EXTRACT,
+
+	SOAK_NUM_KINDS
+};
+
+static const char *soak_kind_names[SOAK_NUM_KINDS] = {
+	"crawl", "stream", "extract",
+};
+
+// Latencies are kept in a histogram with 8 linear sub-buckets per power
+// of two of nanoseconds; that is accurate to within 12.5%.
+#define SOAK_SUB_BITS 3
+#define SOAK_SUB_BUCKETS (1 << SOAK_SUB_BITS)
+#define SOAK_NUM_BUCKETS (64 * SOAK_SUB_BUCKETS)
+
+struct soak_stats {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t max_ns;
+	uint64_t hist[SOAK_NUM_BUCKETS];
+};
+
+struct soak_file {
+	char *path;
+	off_t size;
+};
+
+struct soak_mount {
+	const char *path;
+	struct soak_file *files;
+	size_t num_files;
+	size_t max_files;
+	size_t largest;  // index into files
+};
+
+struct soak {
+	struct soak_mount *mounts;
+	int num_mounts;
+	volatile int stop;
+};
+
+struct soak_thread {
+	struct soak *soak;
+	enum soak_kind kind;
+	unsigned int seed;
+	pthread_t thread;
+	struct soak_stats stats;
+	char *buf;
+};
+
+#define SOAK_BUF_SIZE (64 * 1024)
+
+static void *soak_worker(void *data);
+
+
+//============================================================================
+
+
+static uint64_t
+soak_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+soak_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < SOAK_SUB_BUCKETS)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - SOAK_SUB_BITS + 1) << SOAK_SUB_BITS) |
+			((ns >> (msb - SOAK_SUB_BITS)) & (SOAK_SUB_BUCKETS - 1));
+}
+
+// The upper bound of a bucket, in ns.
+static uint64_t
+soak_bucket_value(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < SOAK_SUB_BUCKETS)
+		return bucket;
+	shift = (bucket >> SOAK_SUB_BITS) - 1;
+	return ((uint64_t) ((bucket & (SOAK_SUB_BUCKETS - 1)) |
+			SOAK_SUB_BUCKETS) << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+static void
+soak_record(struct soak_stats *stats, uint64_t start, size_t bytes)
+{
+	uint64_t ns = soak_now() - start;
+
+	stats->ops++;
+	stats->bytes += bytes;
+	stats->hist[soak_bucket(ns)]++;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+}
+
+static uint64_t
+soak_percentile(const struct soak_stats *stats, double pct)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	if (stats->ops == 0)
+		return 0;
+	want = (uint64_t) (stats->ops * pct / 100.0);
+	if (want >= stats->ops)
+		want = stats->ops - 1;
+	for (i = 0; i < SOAK_NUM_BUCKETS; i++) {
+		seen += stats->hist[i];
+		if (seen > want)
+			return soak_bucket_value(i);
+	}
+	return stats->max_ns;
+}
+
+
+//============================================================================
+
+
+static struct soak_mount *soak_scan_mount;
+		// The mount being scanned; nftw() has no data pointer.
+
+static int
+soak_scan_callback(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	struct soak_mount *mount = soak_scan_mount;
+	struct soak_file *file;
+
+	(void) ftw;  /* Unused variable - satisfy compiler */
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (mount->num_files == mount->max_files) {
+		size_t max = mount->max_files == 0 ? 1024 : 2 * mount->max_files;
+		file = realloc(mount->files, max * sizeof (struct soak_file));
+		if (file == NULL)
+			return -1;
+		mount->files = file;
+		mount->max_files = max;
+	}
+
+	file = &mount->files[mount->num_files];
+	file->path = strdup(path);
+	if (file->path == NULL)
+		return -1;
+	file->size = st->st_size;
+	if (mount->num_files == 0 ||
+			file->size > mount->files[mount->largest].size)
+		mount->largest = mount->num_files;
+	mount->num_files++;
+	return 0;
+}
+
+static int
+soak_scan(struct soak_mount *mount)
+{
+	soak_scan_mount = mount;
+	if (nftw(mount->path, soak_scan_callback, 64, FTW_PHYS) != 0) {
+		fprintf(stderr, "operasoak: could not scan %s: %s\n",
+				mount->path, strerror(errno));
+		return -1;
+	}
+	if (mount->num_files == 0) {
+		fprintf(stderr, "operasoak: no files in %s\n", mount->path);
+		return -1;
+	}
+	return 0;
+}
+
+// Recursive readdir + fstatat of everything below dir_fd.
+// dir_fd is closed.
+static void
+soak_crawl(struct soak_thread *th, int dir_fd)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	uint64_t start;
+	int fd;
+
+	dir = fdopendir(dir_fd);
+	if (dir == NULL) {
+		close(dir_fd);
+		th->stats.errors++;
+		return;
+	}
+
+	while (!th->soak->stop) {
+		start = soak_now();
+		errno = 0;
+		de = readdir(dir);
+		if (de == NULL) {
+			if (errno != 0)
+				th->stats.errors++;
+			break;
+		}
+		soak_record(&th->stats, start, 0);
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		start = soak_now();
+		if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW)
+				== -1) {
+			th->stats.errors++;
+			continue;
+		}
+		soak_record(&th->stats, start, 0);
+
+		if (S_ISDIR(st.st_mode)) {
+			fd = openat(dirfd(dir), de->d_name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd == -1) {
+				th->stats.errors++;
+				continue;
+			}
+			soak_crawl(th, fd);
+		}
+	}
+	closedir(dir);
+}
+
+// Read a file from start to end. If per_read is set, each read() is
+// timed, else the whole file is.
+static void
+soak_read_file(struct soak_thread *th, const struct soak_file *file,
+		int per_read)
+{
+	uint64_t start, file_start;
+	size_t total = 0;
+	ssize_t len;
+	int fd;
+
+	file_start = soak_now();
+	fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		th->stats.errors++;
+		return;
+	}
+	while (!th->soak->stop) {
+		start = soak_now();
+		len = read(fd, th->buf, SOAK_BUF_SIZE);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			th->stats.errors++;
+			break;
+		}
+		if (len == 0)
+			break;
+		if (per_read)
+			soak_record(&th->stats, start, len);
+		total += len;
+	}
+	close(fd);
+	if (!per_read && !th->soak->stop)
+		soak_record(&th->stats, file_start, total);
+}
+
+static void *
+soak_worker(void *data)
+{
+	struct soak_thread *th = (struct soak_thread *) data;
+	struct soak *soak = th->soak;
+	const struct soak_mount *mount;
+	int fd;
+
+	while (!soak->stop) {
+		mount = &soak->mounts[rand_r(&th->seed) % soak->num_mounts];
+		switch (th->kind) {
+			case SOAK_CRAWL:
+				fd = open(mount->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (fd == -1) {
+					th->stats.errors++;
+					break;
+				}
+				soak_crawl(th, fd);
+				break;
+			case SOAK_STREAM:
+				soak_read_file(th, &mount->files[mount->largest], 1);
+				break;
+			case SOAK_EXTRACT:
+				soak_read_file(th, &mount->files[
+						rand_r(&th->seed) % mount->num_files], 0);
+				break;
+			default:
+				break;
+		}
+	}
+	return NULL;
+}
+
+
+//============================================================================
+
+
+static int
+parse_mix(const char *str, unsigned int mix[SOAK_NUM_KINDS])
+{
+	char *copy, *tok, *save, *eq;
+	int kind;
+
+	memset(mix, '\0', SOAK_NUM_KINDS * sizeof (unsigned int));
+	copy = strdup(str);
+	if (copy == NULL)
+		return -1;
+	for (tok = strtok_r(copy, ",", &save); tok != NULL;
+			tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (eq != NULL)
+			*eq = '\0';
+		for (kind = 0; kind < SOAK_NUM_KINDS; kind++) {
+			if (strcmp(tok, soak_kind_names[kind]) == 0)
+				break;
+		}
+		if (kind == SOAK_NUM_KINDS) {
+			fprintf(stderr, "operasoak: unknown reader kind '%s'\n", tok);
+			free(copy);
+			return -1;
+		}
+		mix[kind] = eq == NULL ? 1 : strtoul(eq + 1, NULL, 10);
+	}
+	free(copy);
+	return 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-t threads] [-d seconds] [-m mix] [-D] "
+			"<mount>...\n"
+			"    -t threads   number of reader threads (default: 8)\n"
+			"    -d seconds   duration of the run (default: 30)\n"
+			"    -m mix       relative number of threads per reader kind\n"
+			"                 (default: crawl=2,stream=1,extract=1)\n"
+			"    -D           drop the caches before the run (needs root)\n",
+			progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct soak soak;
+	struct soak_thread *threads;
+	struct soak_stats totals[SOAK_NUM_KINDS];
+	unsigned int mix[SOAK_NUM_KINDS];
+	unsigned int mix_total, kind, j;
+	const char *mix_str = "crawl=2,stream=1,extract=1";
+	long num_threads = 8;
+	long duration = 30;
+	int drop_caches = 0;
+	uint64_t start, end;
+	double secs;
+	long i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:d:m:D")) != -1) {
+		switch (opt) {
+			case 't':
+				num_threads = strtol(optarg, NULL, 10);
+				break;
+			case 'd':
+				duration = strtol(optarg, NULL, 10);
+				break;
+			case 'm':
+				mix_str = optarg;
+				break;
+			case 'D':
+				drop_caches = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (argc - optind < 1 || num_threads < 1 || duration < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (parse_mix(mix_str, mix) < 0)
+		return 1;
+	mix_total = 0;
+	for (kind = 0; kind < SOAK_NUM_KINDS; kind++)
+		mix_total += mix[kind];
+	if (mix_total == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&soak, '\0', sizeof soak);
+	soak.num_mounts = argc - optind;
+	soak.mounts = calloc(soak.num_mounts, sizeof (struct soak_mount));
+	if (soak.mounts == NULL)
+		return 1;
+	for (i = 0; i < soak.num_mounts; i++) {
+		soak.mounts[i].path = argv[optind + i];
+		if (soak_scan(&soak.mounts[i]) < 0)
+			return 1;
+	}
+
+	if (drop_caches) {
+		FILE *f;
+
+		sync();
+		f = fopen("/proc/sys/vm/drop_caches", "w");
+		if (f == NULL || fputs("3\n", f) == EOF || fclose(f) == EOF) {
+			fprintf(stderr, "operasoak: could not drop caches: %s\n",
+					strerror(errno));
+			return 1;
+		}
+	}
+
+	threads = calloc(num_threads, sizeof (struct soak_thread));
+	if (threads == NULL)
+		return 1;
+
+	// Hand out the kinds in a repeating pattern following the mix; for
+	// the default mix that is crawl, crawl, stream, extract, crawl, ...
+	for (i = 0; i < num_threads; i++) {
+		j = i % mix_total;
+		for (kind = 0; j >= mix[kind]; kind++)
+			j -= mix[kind];
+		threads[i].kind = kind;
+	}
+
+	start = soak_now();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].soak = &soak;
+		threads[i].seed = (unsigned int) (start + i);
+		threads[i].buf = malloc(SOAK_BUF_SIZE);
+		if (threads[i].buf == NULL)
+			return 1;
+		if (pthread_create(&threads[i].thread, NULL, soak_worker,
+				&threads[i]) != 0) {
+			fprintf(stderr, "operasoak: could not start thread %ld\n", i);
+			return 1;
+		}
+	}
+
+	sleep(duration);
+	soak.stop = 1;
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	end = soak_now();
+	secs = (end - start) / 1e9;
+
+	memset(totals, '\0', sizeof totals);
+	for (i = 0; i < num_threads; i++) {
+		struct soak_stats *t = &totals[threads[i].kind];
+		const struct soak_stats *s = &threads[i].stats;
+
+		t->ops += s->ops;
+		t->bytes += s->bytes;
+		t->errors += s->errors;
+		if (s->max_ns > t->max_ns)
+			t->max_ns = s->max_ns;
+		for (j = 0; j < SOAK_NUM_BUCKETS; j++)
+			t->hist[j] += s->hist[j];
+		free(threads[i].buf);
+	}
+
+	// One line per reader kind, in a form that is easy to pick apart
+	// with awk. Latencies are in microseconds.
+	printf("%-8s %8s %12s %10s %10s %10s %10s %10s %10s %6s\n",
+			"kind", "threads", "ops", "ops/s", "MiB/s",
+			"p50", "p99", "p99.9", "max", "errors");
+	for (kind = 0; kind < SOAK_NUM_KINDS; kind++) {
+		const struct soak_stats *t = &totals[kind];
+		unsigned int n = 0;
+
+		for (i = 0; i < num_threads; i++) {
+			if (threads[i].kind == kind)
+				n++;
+		}
+		if (n == 0)
+			continue;
+		printf("%-8s %8u %12llu %10.1f %10.1f %10.1f %10.1f %10.1f "
+				"%10.1f %6llu\n", soak_kind_names[kind], n,
+				(unsigned long long) t->ops, t->ops / secs,
+				t->bytes / 1048576.0 / secs,
+				soak_percentile(t, 50.0) / 1e3,
+				soak_percentile(t, 99.0) / 1e3,
+				soak_percentile(t, 99.9) / 1e3,
+				t->max_ns / 1e3, (unsigned long long) t->errors);
+	}
+
+	free(threads);
+	return 0;
+}
+
@@ -0,0 +1,167 @@
+#!/bin/sh
+#
+# ra-adaptive.sh
+# Compare the static readahead of the block device with the adaptive
+# readahead of the driver (mount option ra_max), on a fast device and on
+# a slow one.
+#
+# Usage: ra-adaptive.sh [-D delay_ms] [-f files] [-s fmv_mib] [-r reads]
+#                       [-o options]
+#
+#   -D delay_ms   delay added to every read of the slow device (default: 10)
+#   -f files      number of small files in the image (default: 500)
+#   -s fmv_mib    size of the one large file in the image (default: 128)
+#   -r reads      number of random 4 KiB reads of the large file (default:
+#                 200)
+#   -o options    mount options for the adaptive runs (default:
+#                 ra_min=16,ra_max=4096)
+#
+# Must be run as root (loop devices, device mapper, dropping caches).
+# Expects the module to be built in the top directory and tools/mkfs.opera
+# to be built.
+#
+# The same image is put on a plain loop device (fast) and on a dm-delay
+# device on top of another loop device (slow; a stand-in for an optical
+# drive). On each, with cold caches, it measures:
+#   - stream: reading the large file sequentially,
+#   - small:  reading all small files, in directory order,
+#   - random: reading 4 KiB at random offsets of the large file,
+# and for each the time taken and how much was read from the device, as
+# a multiple of what was asked for. For the adaptive runs, the final
+# window and the decisions taken (see ra.c) follow.
+
+set -e
+
+DELAY=10
+NUM_FILES=500
+FMV_MIB=128
+RANDOM_READS=200
+RA_OPTS=ra_min=16,ra_max=4096
+
+while getopts D:f:s:r:o: opt; do
+	case $opt in
+		D) DELAY=$OPTARG ;;
+		f) NUM_FILES=$OPTARG ;;
+		s) FMV_MIB=$OPTARG ;;
+		r) RANDOM_READS=$OPTARG ;;
+		o) RA_OPTS=$OPTARG ;;
+		*) sed -n '8,17p' "$0" >&2; exit 1 ;;
+	esac
+done
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/opera-ra.XXXXXX)
+MNT=$WORK/mnt
+DM_NAME=opera-ra-slow.$$
+FAST=
+SLOW_LOOP=
+
+cleanup() {
+	umount "$MNT" 2>/dev/null || true
+	dmsetup remove "$DM_NAME" 2>/dev/null || true
+	[ -z "$SLOW_LOOP" ] || losetup -d "$SLOW_LOOP" 2>/dev/null || true
+	[ -z "$FAST" ] || losetup -d "$FAST" 2>/dev/null || true
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Bytes read from a device since it was set up.
+device_bytes() {
+	awk '{ print $3 * 512 }' "/sys/block/$1/stat"
+}
+
+# Run a workload with cold caches and print: name, seconds, MiB/s and
+# bytes read from the device per byte asked for.
+run() {
+	name=$1
+	bytes=$2
+	shift 2
+
+	drop_caches
+	before=$(device_bytes "$SID")
+	start=$(date +%s.%N)
+	"$@" > /dev/null
+	end=$(date +%s.%N)
+	after=$(device_bytes "$SID")
+	awk -v n="$name" -v s="$start" -v e="$end" -v b="$bytes" \
+			-v r="$((after - before))" 'BEGIN {
+		t = e - s
+		printf "  %-8s %8.3f s %9.1f MiB/s %7.2fx read\n", n, t,
+				b / 1048576 / t, r / b
+	}'
+}
+
+random_reads() {
+	blocks=$((FMV_MIB * 256))
+	i=0
+	while [ $i -lt "$RANDOM_READS" ]; do
+		dd if="$MNT/movie.str" bs=4096 count=1 \
+				skip=$(( $(od -An -N4 -tu4 /dev/urandom) % blocks )) \
+				2> /dev/null
+		i=$((i + 1))
+	done
+}
+
+# Mount a device and run the workloads on it.
+suite() {
+	dev=$1
+	label=$2
+	opts=$3
+
+	SID=$(basename "$(readlink -f "$dev")")
+	mount -t opera -o ro$opts "$dev" "$MNT"
+	echo "$label"
+	run stream $((FMV_MIB * 1048576)) cat "$MNT/movie.str"
+	run small "$SMALL_BYTES" \
+			sh -c "find '$MNT' -type f ! -name movie.str -exec cat {} +"
+	run random $((RANDOM_READS * 4096)) random_reads
+	if [ -n "$opts" ]; then
+		awk '$1 == "ra_window" { printf "  window %d KiB", $2 / 1024 }
+			$1 ~ /^ra_(grow|shrink|trim|hold)$/ {
+				printf ", %s %d", substr($1, 4), $2
+			}
+			END { print "" }' "/proc/fs/opera/$SID/stats"
+		echo "  last decisions (ms decision old-KiB new-KiB reads hits" \
+				"misses lat-us):"
+		tail -n 5 "/proc/fs/opera/$SID/ra" | sed 's/^/    /'
+	fi
+	umount "$MNT"
+}
+
+# Generate the image: NUM_FILES small files of 1 to 64 KiB in directories
+# of 100, and one large file for the streaming and random reads.
+echo "Generating image..." >&2
+mkdir "$WORK/src" "$MNT"
+i=0
+while [ $i -lt "$NUM_FILES" ]; do
+	d=$WORK/src/dir$((i / 100))
+	[ -d "$d" ] || mkdir "$d"
+	head -c $(( ($(od -An -N2 -tu2 /dev/urandom) % 64 + 1) * 1024 )) \
+			/dev/urandom > "$d/file$i"
+	i=$((i + 1))
+done
+head -c $((FMV_MIB * 1048576)) /dev/urandom > "$WORK/src/movie.str"
+SMALL_BYTES=$(find "$WORK/src" -type f ! -name movie.str -printf '%s\n' | \
+		awk '{ s += $1 } END { print s }')
+"$TOP/tools/mkfs.opera" "$WORK/src" "$WORK/image.iso" > /dev/null
+rm -rf "$WORK/src"
+
+if ! grep -qw opera /proc/filesystems; then
+	insmod "$TOP/operafs.ko"
+fi
+
+FAST=$(losetup -f --show -r "$WORK/image.iso")
+SLOW_LOOP=$(losetup -f --show -r "$WORK/image.iso")
+dmsetup create "$DM_NAME" --readonly --table \
+		"0 $(blockdev --getsz "$SLOW_LOOP") delay $SLOW_LOOP 0 $DELAY"
+SLOW=/dev/mapper/$DM_NAME
+
+suite "$FAST" "fast, static" ""
+suite "$FAST" "fast, adaptive ($RA_OPTS)" ",$RA_OPTS"
+suite "$SLOW" "slow (${DELAY} ms), static" ""
+suite "$SLOW" "slow (${DELAY} ms), adaptive ($RA_OPTS)" ",$RA_OPTS"
@@ -0,0 +1,135 @@
+#!/bin/sh
+#
+# soak.sh
+# Mount many generated Opera images at once and run a mix of readers
+# over them, reporting throughput, tail latency and memory per mount.
+#
+# Usage: soak.sh [-n images] [-t threads] [-d seconds] [-m mix]
+#                [-f files] [-s fmv_mib] [-o mount_options]
+#
+#   -n images     number of images to mount (default: 16)
+#   -t threads    number of reader threads (default: 8)
+#   -d seconds    duration of the run (default: 60)
+#   -m mix        reader mix for operasoak (default:
+#                 crawl=2,stream=1,extract=1)
+#   -f files      number of small files per image (default: 2000)
+#   -s fmv_mib    size of the one large file per image (default: 64)
+#   -o options    extra mount options, e.g. prepopulate=64
+#
+# Must be run as root (loop mounting, dropping caches, /proc/slabinfo).
+# Needs nothing but loop devices, so it runs in a plain VM. Expects the
+# module to be built in the top directory, and tools/mkfs.opera and
+# bench/operasoak to be built.
+#
+# Memory is taken from /proc/slabinfo (opera_inode_cache, dentry,
+# buffer_head) and the Buffers line of /proc/meminfo, with cold caches
+# before mounting, after mounting and at the end of the run. The growth
+# is divided by the number of mounts. Boot with slab_nomerge if
+# opera_inode_cache does not show up in /proc/slabinfo.
+
+set -e
+
+NUM_IMAGES=16
+THREADS=8
+DURATION=60
+MIX=crawl=2,stream=1,extract=1
+NUM_FILES=2000
+FMV_MIB=64
+MOUNT_OPTS=
+
+while getopts n:t:d:m:f:s:o: opt; do
+	case $opt in
+		n) NUM_IMAGES=$OPTARG ;;
+		t) THREADS=$OPTARG ;;
+		d) DURATION=$OPTARG ;;
+		m) MIX=$OPTARG ;;
+		f) NUM_FILES=$OPTARG ;;
+		s) FMV_MIB=$OPTARG ;;
+		o) MOUNT_OPTS=,$OPTARG ;;
+		*) sed -n '7,18p' "$0" >&2; exit 1 ;;
+	esac
+done
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/opera-soak.XXXXXX)
+MOUNTS=
+
+cleanup() {
+	for m in $MOUNTS; do
+		umount "$m" 2>/dev/null || true
+	done
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Print the bytes in use by the caches that a mount costs, one per line:
+# opera_inode_cache, dentry, buffer_head, buffers.
+memory() {
+	for cache in opera_inode_cache dentry buffer_head; do
+		awk -v c=$cache '$1 == c { n = $3 * $4 } END { print n + 0 }' \
+				/proc/slabinfo
+	done
+	awk '$1 == "Buffers:" { print $2 * 1024 }' /proc/meminfo
+}
+
+# Generate the source tree: NUM_FILES small files of 1 to 64 KiB in
+# directories of 100, and one large file for the streaming readers.
+echo "Generating source tree..." >&2
+mkdir "$WORK/src"
+i=0
+while [ $i -lt "$NUM_FILES" ]; do
+	d=$WORK/src/dir$((i / 100))
+	[ -d "$d" ] || mkdir "$d"
+	head -c $(( ($(od -An -N2 -tu2 /dev/urandom) % 64 + 1) * 1024 )) \
+			/dev/urandom > "$d/file$i"
+	i=$((i + 1))
+done
+head -c $((FMV_MIB * 1048576)) /dev/urandom > "$WORK/src/movie.str"
+
+if ! grep -qw opera /proc/filesystems; then
+	insmod "$TOP/operafs.ko"
+fi
+
+echo "Building and mounting $NUM_IMAGES images..." >&2
+i=0
+while [ $i -lt "$NUM_IMAGES" ]; do
+	"$TOP/tools/mkfs.opera" -i $(printf '%08x' $((0x50AC0000 + i))) \
+			-l "soak$i" "$WORK/src" "$WORK/image$i.iso" > /dev/null
+	mkdir "$WORK/mnt$i"
+	i=$((i + 1))
+done
+rm -rf "$WORK/src"
+
+drop_caches
+MEM_BEFORE=$(memory)
+
+i=0
+while [ $i -lt "$NUM_IMAGES" ]; do
+	mount -t opera -o loop,ro$MOUNT_OPTS "$WORK/image$i.iso" "$WORK/mnt$i"
+	MOUNTS="$MOUNTS $WORK/mnt$i"
+	i=$((i + 1))
+done
+MEM_MOUNTED=$(memory)
+
+echo "Running $THREADS threads ($MIX) for $DURATION s..." >&2
+"$TOP/bench/operasoak" -D -t "$THREADS" -d "$DURATION" -m "$MIX" $MOUNTS
+MEM_AFTER=$(memory)
+
+# Memory per mount, in KiB.
+echo
+printf '%-18s %14s %14s\n' "cache" "idle KiB/mount" "busy KiB/mount"
+echo "$MEM_BEFORE" > "$WORK/mem.before"
+echo "$MEM_MOUNTED" > "$WORK/mem.mounted"
+echo "$MEM_AFTER" > "$WORK/mem.after"
+printf '%s\n' opera_inode_cache dentry buffer_head buffers | \
+		paste - "$WORK/mem.before" "$WORK/mem.mounted" "$WORK/mem.after" | \
+		awk -v n="$NUM_IMAGES" '{
+			printf "%-18s %14.1f %14.1f\n", $1,
+					($3 - $2) / 1024 / n, ($4 - $2) / 1024 / n
+		}'
+
@@ -19,6 +19,8 @@
 #include <linux/fs.h>
 /*#include <linux/smp_lock.h>*/
 #include <linux/buffer_head.h>
+#include <linux/dcache.h>
+#include <linux/slab.h>
 
 #include "operafs.h"
 
@@ -28,7 +30,9 @@
 
 static int opera_readdir(struct file *f, void *dirent, filldir_t filldir);
 static int opera_readdir_callback(void *data, const char *name, size_t len,
-		ino_t ino, unsigned int type);
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd);
+static int opera_prepopulate(struct dentry *parent, const char *name,
+		size_t len, ino_t ino, const struct opera_disk_dirent *tdd);
 
 
 //============================================================================
@@ -38,6 +42,9 @@ struct file_operations opera_dir_operations = {
 	.read = generic_read_dir,
 	.iterate = opera_readdir,
 	//.readdir = opera_readdir,
+	.unlocked_ioctl = opera_dir_ioctl,
+	.compat_ioctl = opera_dir_ioctl,
+	.release = opera_dir_release,
 };
 
 
@@ -47,6 +54,13 @@ struct file_operations opera_dir_operations = {
 struct opera_readdir_callback_arg {
 	filldir_t filldir;
 	void *dirent;
+	struct dentry *parent;
+	size_t prepopulate;
+			// Budget in bytes for instantiating inodes and dentries of
+			// the entries passed to filldir.
+	struct opera_dir_file *df;
+			// Where the bytes spent are charged. NULL if prepopulation
+			// is disabled.
 };
 
 static int
@@ -59,6 +73,15 @@ opera_readdir(struct file *file, void *dirent, filldir_t filldir)
 
 	arg.filldir = filldir;
 	arg.dirent = dirent;
+	arg.parent = file->f_path.dentry;
+	arg.prepopulate = OPERA_SB(inode->i_sb)->options.prepopulate;
+	arg.df = NULL;
+	if (arg.prepopulate != 0) {
+		// The budget holds for everything read through this file, not
+		// per call; getdents() may be called with a small buffer.
+		// If the allocation fails, just don't prepopulate.
+		arg.df = opera_dir_file(file);
+	}
 
 	/*lock_kernel();*/
 			// XXX: What are we protecting anyhow?
@@ -102,12 +125,104 @@ out:
 
 static int
 opera_readdir_callback(void *data, const char *name, size_t len,
-		ino_t ino, unsigned int type) {
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd) {
 	struct opera_readdir_callback_arg *arg =
 			(struct opera_readdir_callback_arg *) data;
+	size_t cost;
+	int res;
 
-	return arg->filldir(arg->dirent, name, len, ino, ino, type);
+	res = arg->filldir(arg->dirent, name, len, ino, ino, type);
 			// The inode number is the position.
+	if (res != 0)
+		return res;
+
+	// Whoever reads a directory is likely to stat all its entries next.
+	// Set up the inodes and dentries now that we have the directory
+	// entry at hand, so that opera_lookup() does not need to walk the
+	// directory again for every one of them.
+	// Not for subdirectories: their link count needs a walk of the
+	// subdirectory itself, which would make readdir read the whole
+	// tree one level down. opera_lookup() will get to those.
+	if (arg->df == NULL || type == DT_DIR)
+		return 0;
+	cost = sizeof (struct opera_inode_info) + sizeof (struct dentry) +
+			4 * be32_to_cpu(tdd->last_copy);
+	if (arg->df->prepopulated + cost <= arg->prepopulate) {
+		if (opera_prepopulate(arg->parent, name, len, ino, tdd) > 0) {
+			arg->df->prepopulated += cost;
+		} else {
+			// Already present, or out of memory. Either way, it is
+			// not our problem; readdir itself succeeded.
+		}
+	}
+	return 0;
 }
 
+// Get the opera_dir_file of an open directory, allocating it if there is
+// none yet. The caller holds the lock of the directory inode.
+// Returns NULL if out of memory.
+struct opera_dir_file *
+opera_dir_file(struct file *file)
+{
+	struct opera_dir_file *df;
+
+	df = (struct opera_dir_file *) file->private_data;
+	if (df == NULL) {
+		df = kzalloc(sizeof *df, GFP_KERNEL);
+		file->private_data = df;
+	}
+	return df;
+}
+
+int
+opera_dir_release(struct inode *inode, struct file *file)
+{
+	struct opera_dir_file *df = (struct opera_dir_file *) file->private_data;
+
+	if (df != NULL) {
+		if (df->walk != NULL)
+			opera_tree_walk_free(df->walk);
+		kfree(df);
+	}
+	(void) inode;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+// Instantiate a positive dentry for a directory entry, unless one
+// already exists.
+// Returns 1 if a dentry was added, 0 if it already existed, and a
+// negative error code on failure.
+// The caller holds the lock of the parent directory inode, so there
+// can be no concurrent opera_lookup() for the same name.
+static int
+opera_prepopulate(struct dentry *parent, const char *name, size_t len,
+		ino_t ino, const struct opera_disk_dirent *tdd) {
+	struct qstr qname = QSTR_INIT(name, len);
+	struct dentry *dentry;
+	struct inode *inode;
+
+	dentry = d_hash_and_lookup(parent, &qname);
+	if (dentry != NULL) {
+		if (IS_ERR(dentry))
+			return PTR_ERR(dentry);
+		dput(dentry);
+		return 0;
+	}
+
+	dentry = d_alloc(parent, &qname);
+	if (dentry == NULL)
+		return -ENOMEM;
+
+	inode = operafs_iget_dirent(parent->d_sb, ino, tdd);
+	if (IS_ERR(inode)) {
+		dput(dentry);
+		return PTR_ERR(inode);
+	}
+
+	d_add(dentry, inode);
+	dput(dentry);
+			// The dentry stays in the dcache, unused, until either
+			// someone looks it up or memory pressure reclaims it.
+	return 1;
+}
 
@@ -17,19 +17,31 @@
 
 #include <linux/types.h>
 #include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
 
 #include "operafs.h"
 
 //============================================================================
 
+
+static int opera_file_open(struct inode *inode, struct file *file);
+static ssize_t opera_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t opera_file_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+
+
+//============================================================================
+
 /* Write support isn't needed */
 
 struct file_operations opera_file_operations = {
        /*.read = do_sync_read,*/
-       .read_iter = generic_file_read_iter,
+       .open = opera_file_open,
+       .read_iter = opera_file_read_iter,
        /*.write_iter = generic_file_write_iter,*/
        .mmap = generic_file_mmap,
-       .splice_read = generic_file_splice_read,
+       .splice_read = opera_file_splice_read,
        /*.splice_write = iter_file_splice_write,*/
        .llseek = generic_file_llseek,
        
@@ -45,3 +57,50 @@ struct file_operations opera_file_operations = {
 // ============================================================================
 
 
+static int
+opera_file_open(struct inode *inode, struct file *file)
+{
+	opera_trace_add(OPERA_SB(inode->i_sb), inode->i_ino, 0, 0);
+	opera_ra_open(file);
+	return generic_file_open(inode, file);
+}
+
+static ssize_t
+opera_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct opera_ra_sample sample;
+	loff_t pos = iocb->ki_pos;
+	ssize_t res;
+
+	opera_coalesce(iocb->ki_filp, pos);
+	opera_ra_begin(iocb->ki_filp, pos, &sample);
+	res = generic_file_read_iter(iocb, to);
+	opera_ra_end(iocb->ki_filp, &sample, res);
+	if (res > 0) {
+		opera_trace_add(OPERA_SB(inode->i_sb), inode->i_ino, pos, res);
+		opera_prefetch_next(iocb->ki_filp, pos, res);
+	}
+	return res;
+}
+
+static ssize_t
+opera_file_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct inode *inode = file_inode(in);
+	struct opera_ra_sample sample;
+	loff_t pos = *ppos;
+	ssize_t res;
+
+	opera_coalesce(in, pos);
+	opera_ra_begin(in, pos, &sample);
+	res = generic_file_splice_read(in, ppos, pipe, len, flags);
+	opera_ra_end(in, &sample, res);
+	if (res > 0) {
+		opera_trace_add(OPERA_SB(inode->i_sb), inode->i_ino, pos, res);
+		opera_prefetch_next(in, pos, res);
+	}
+	return res;
+}
+
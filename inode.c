@@ -25,7 +25,8 @@
 
 static struct dentry *opera_lookup(struct inode *dir, struct dentry *dentry,  unsigned int nd);
 static int opera_lookup_callback(void *data, const char *name,
-		size_t name_len, ino_t ino, unsigned int type);
+		size_t name_len, ino_t ino, unsigned int type,
+		const struct opera_disk_dirent *tdd);
 
 
 //============================================================================
@@ -33,10 +34,11 @@ static int opera_lookup_callback(void *data, const char *name,
 
 struct inode_operations opera_dir_inode_operations = {
 	.lookup		= opera_lookup,
+	.listxattr	= opera_listxattr,
 };
 
 struct inode_operations opera_file_inode_operations = {
-
+	.listxattr	= opera_listxattr,
 };
 
 
@@ -90,7 +92,7 @@ out:
 
 static int
 opera_lookup_callback(void *data, const char *name, size_t name_len,
-		ino_t ino, unsigned int type) {
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd) {
 	struct lookup_arg *arg = (struct lookup_arg *) data;
 	struct inode *inode;
 
@@ -101,14 +103,22 @@ opera_lookup_callback(void *data, const char *name, size_t name_len,
 	}
 	
 	// We have found a match
-	inode = operafs_iget(arg->sb, ino);
+	if (type == DT_DIR && !opera_meta_cached(OPERA_SB(arg->sb),
+			be32_to_cpu(tdd->copies[0]), be32_to_cpu(tdd->block_count))) {
+		// The next lookup will probably be in this directory, and
+		// opera_count_dirs() is about to read all of it anyway. Start
+		// all of its reads now, rather than one block at a time.
+		// Unless another mount of the disk has it in memory already.
+		opera_prefetch_dir(arg->sb, be32_to_cpu(tdd->copies[0]),
+				be32_to_cpu(tdd->block_count));
+	}
+	inode = operafs_iget_dirent(arg->sb, ino, tdd);
 	if (IS_ERR(inode))
 		return -1;  // Abort
 
 	d_add(arg->dentry, inode);
 	arg->found_match = 1;
 	
-	(void) type;  /* Unused variable - satisfy compiler */
 	return 1;  // Stop looking, we're done.
 }
 
@@ -53,6 +53,7 @@ static struct dentry * opera_get_sb(struct file_system_type *fs_type,
 static int opera_init_inodecache(void);
 static void opera_destroy_inodecache(void);
 static void opera_inode_init_once(void *info_in);
+static void opera_kill_sb(struct super_block *sb);
 static int opera_fill_super(struct super_block *sb, void *data,
 		int silent);
 static int parse_mount_options(char *optstr,
@@ -69,7 +70,7 @@ static struct file_system_type opera_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "opera",
 	.mount		= opera_get_sb,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= opera_kill_sb,
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 
@@ -96,13 +97,25 @@ __init init_opera_fs(void)
 	if (err)
 		return err;
 
+	err = opera_proc_init();
+	if (err)
+		goto out_inodecache;
+
+	err = opera_meta_init();
+	if (err)
+		goto out_proc;
+
 	err = register_filesystem(&opera_fs_type);
 	if (err)
-		goto out_err;
+		goto out_meta;
 
 	return 0;
 
-out_err:
+out_meta:
+	opera_meta_exit();
+out_proc:
+	opera_proc_exit();
+out_inodecache:
 	opera_destroy_inodecache();
 	return err;
 }
@@ -111,6 +124,8 @@ static void
 __exit exit_opera_fs(void)
 {
 	unregister_filesystem(&opera_fs_type);
+	opera_meta_exit();
+	opera_proc_exit();
 	opera_destroy_inodecache();
 }
 
@@ -142,7 +157,10 @@ opera_destroy_inodecache(void)
 
 enum {
 	Opt_uid, Opt_gid, Opt_umask, Opt_dmask, Opt_fmask,
-	Opt_showspecial, Opt_hidespecial, Opt_err
+	Opt_showspecial, Opt_hidespecial, Opt_prepopulate, Opt_trace,
+	Opt_prefetch_next, Opt_coalesce, Opt_spec_rate, Opt_share,
+	Opt_noshare, Opt_pin, Opt_pin_max, Opt_ra_min, Opt_ra_max, Opt_ra_lat,
+	Opt_err
 };
 
 static match_table_t opera_option_tokens = {
@@ -153,6 +171,18 @@ static match_table_t opera_option_tokens = {
 	{ Opt_fmask, "fmask=%o" },
 	{ Opt_showspecial, "showspecial" },
 	{ Opt_hidespecial, "hidespecial" },
+	{ Opt_prepopulate, "prepopulate=%u" },
+	{ Opt_trace, "trace=%u" },
+	{ Opt_prefetch_next, "prefetch_next=%u" },
+	{ Opt_coalesce, "coalesce=%u" },
+	{ Opt_spec_rate, "spec_rate=%u" },
+	{ Opt_share, "share" },
+	{ Opt_noshare, "noshare" },
+	{ Opt_pin, "pin=%s" },
+	{ Opt_pin_max, "pin_max=%u" },
+	{ Opt_ra_min, "ra_min=%u" },
+	{ Opt_ra_max, "ra_max=%u" },
+	{ Opt_ra_lat, "ra_lat=%u" },
 	{ Opt_err, NULL }
 };
 
@@ -201,6 +231,81 @@ parse_mount_options(char *optstr, struct opera_fs_options *options) {
 			case Opt_hidespecial:
 				options->show_special = 0;
 				break;
+			case Opt_prepopulate:
+				// Value in KiB.
+				if (match_int(&args[0], &temp_int) || temp_int < 0 ||
+						temp_int > OPERA_PREPOPULATE_MAX / 1024)
+					return -EINVAL;
+				options->prepopulate = temp_int * 1024;
+				break;
+			case Opt_trace:
+				// Number of records.
+				if (match_int(&args[0], &temp_int) || temp_int < 0 ||
+						temp_int > OPERA_TRACE_MAX)
+					return -EINVAL;
+				options->trace = temp_int;
+				break;
+			case Opt_prefetch_next:
+				// Value in KiB.
+				if (match_int(&args[0], &temp_int) || temp_int < 0 ||
+						temp_int > OPERA_PREFETCH_NEXT_MAX / 1024)
+					return -EINVAL;
+				options->prefetch_next = temp_int * 1024;
+				break;
+			case Opt_coalesce:
+				// Value in KiB.
+				if (match_int(&args[0], &temp_int) || temp_int < 0 ||
+						temp_int > OPERA_COALESCE_MAX / 1024)
+					return -EINVAL;
+				options->coalesce = temp_int * 1024;
+				break;
+			case Opt_spec_rate:
+				// Value in KiB per second.
+				if (match_int(&args[0], &temp_int) || temp_int < 0 ||
+						temp_int > OPERA_SPEC_RATE_MAX / 1024)
+					return -EINVAL;
+				options->spec_rate = temp_int * 1024;
+				break;
+			case Opt_share:
+				options->share = 1;
+				break;
+			case Opt_noshare:
+				options->share = 0;
+				break;
+			case Opt_pin:
+				if (options->num_pins == OPERA_PIN_OPTIONS_MAX) {
+					printk(KERN_ERR "Opera: no more than %d pin options "
+							"allowed.\n", OPERA_PIN_OPTIONS_MAX);
+					return -EINVAL;
+				}
+				options->pins[options->num_pins] = match_strdup(&args[0]);
+				if (options->pins[options->num_pins] == NULL)
+					return -ENOMEM;
+				options->num_pins++;
+				break;
+			case Opt_pin_max:
+				// Value in KiB.
+				if (match_int(&args[0], &temp_int) || temp_int < 0)
+					return -EINVAL;
+				options->pin_max = (uint64_t) temp_int * 1024;
+				break;
+			case Opt_ra_min:
+			case Opt_ra_max:
+				// Value in KiB.
+				if (match_int(&args[0], &temp_int) || temp_int < 0 ||
+						temp_int > OPERA_RA_MAX / 1024)
+					return -EINVAL;
+				if (token == Opt_ra_min) {
+					options->ra_min = temp_int * 1024;
+				} else
+					options->ra_max = temp_int * 1024;
+				break;
+			case Opt_ra_lat:
+				// Value in microseconds.
+				if (match_int(&args[0], &temp_int) || temp_int <= 0)
+					return -EINVAL;
+				options->ra_lat = temp_int;
+				break;
 			default:
 				printk(KERN_ERR "Opera: Unrecognised mount option "
 						"\"%s\" or missing value.\n", ptr);
@@ -217,12 +322,29 @@ opera_get_sb(struct file_system_type *fs_type, int flags,
 	return mount_bdev(fs_type, flags, dev_name, data, opera_fill_super);
 }
 
+static void
+opera_kill_sb(struct super_block *sb)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+
+	// The pins hold inode references, which have to be dropped before
+	// the VFS evicts the inodes. Remove the /proc files first, so that
+	// no new pins can be added.
+	if (sbi != NULL) {
+		opera_proc_unregister(sb);
+		opera_pin_release(sbi);
+	}
+	kill_block_super(sb);
+}
+
 static int
 opera_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct opera_sb_info *sbi;
 	struct buffer_head *bh = NULL;
 	const struct opera_disk_superblock *dsb;
+	struct opera_disk_superblock dsb_copy;
+			// The superblock is needed after bh has been released.
 	struct inode *root_inode = NULL;
 	int error;
 
@@ -237,10 +359,28 @@ opera_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->options.fmask = current->fs->umask;
 	sbi->options.dmask = current->fs->umask;
 	sbi->options.show_special = OPERA_DEFAULT_SHOW_SPECIAL;
+	sbi->options.prepopulate = 0;
+	sbi->options.trace = 0;
+	sbi->options.prefetch_next = 0;
+	sbi->options.coalesce = 0;
+	sbi->options.spec_rate = OPERA_DEFAULT_SPEC_RATE;
+	sbi->options.share = 0;
+	sbi->options.pin_max = OPERA_DEFAULT_PIN_MAX;
+	sbi->options.num_pins = 0;
+	sbi->options.ra_min = OPERA_DEFAULT_RA_MIN;
+	sbi->options.ra_max = 0;
+	sbi->options.ra_lat = OPERA_DEFAULT_RA_LAT;
+	mutex_init(&sbi->pin_lock);
+	INIT_LIST_HEAD(&sbi->pins);
+	spin_lock_init(&sbi->spec.lock);
 	error = parse_mount_options((char *) data, &sbi->options);
 	if (error)
 		goto out_err;
 
+	error = opera_trace_init(sbi);
+	if (error)
+		goto out_err;
+
 	sb->s_magic = OPERA_MAGIC;
 	sb->s_flags |= MS_RDONLY;
 
@@ -255,7 +395,8 @@ opera_fill_super(struct super_block *sb, void *data, int silent)
 		goto out_err;
 	}
 
-	dsb = (const struct opera_disk_superblock *) bh->b_data;
+	memcpy(&dsb_copy, bh->b_data, sizeof dsb_copy);
+	dsb = &dsb_copy;
 
 	if (dsb->record_type != 0x01
 			|| dsb->volume.sync[0] != 0x5A
@@ -311,21 +452,40 @@ opera_fill_super(struct super_block *sb, void *data, int silent)
 	
 	sbi->block_count = be32_to_cpu(dsb->volume.block_count);
 
+	error = opera_ra_init(sbi);
+	if (error)
+		goto out_err;
+
 	sbi->sb = sb;
 	sb->s_fs_info = sbi;
 	brelse(bh);
 	bh = NULL;
 
+	error = opera_meta_attach(sbi, dsb);
+	if (error)
+		goto out_err;
+
 	sb->s_op = &opera_super_ops;
+	sb->s_xattr = opera_xattr_handlers;
 	error = opera_make_root_inode(sb, dsb, &root_inode, silent);
 	if (error)
 		goto out_err;
 
 	sb->s_root = d_make_root(root_inode);
+	root_inode = NULL;
+			// d_make_root() consumed the reference, even on failure.
 	if (sb->s_root == NULL) {
 		error = -ENOMEM;
 		goto out_err;
 	}
+
+	if (opera_proc_register(sb) < 0) {
+		// Not fatal; there just won't be any statistics.
+		printk(KERN_WARNING "Opera: could not create /proc/fs/opera/%s "
+				"(disk #%08X).\n", sb->s_id, sbi->disk_id);
+	}
+
+	opera_pin_mount(sb);
 	
 	return 0;
 
@@ -336,6 +496,9 @@ out_err:
 		brelse(bh);
 	if (sbi != NULL) {
 		sb->s_fs_info = NULL;
+		opera_pin_release(sbi);
+		opera_meta_detach(sbi);
+		opera_trace_free(sbi);
 		kfree(sbi);
 	}
 	return error;
@@ -376,7 +539,23 @@ opera_make_root_inode(struct super_block *sb,
 	inode->i_size = be32_to_cpu(dsb->root.block_count) *
 			be32_to_cpu(dsb->root.block_size);
 	inode->i_blocks = be32_to_cpu(dsb->root.block_count);
-	OPERA_I(inode)->start_block = be32_to_cpu(dsb->root.copies[0]);
+	OPERA_I(inode)->id = be32_to_cpu(dsb->root.id);
+	OPERA_I(inode)->flags = OPERA_DIRENT_DIR;
+	memcpy(OPERA_I(inode)->type, "*dir", sizeof OPERA_I(inode)->type);
+	if (be32_to_cpu(dsb->root.last_copy) >= NUM_COPIES_ROOT) {
+		if (!silent)
+			printk(KERN_ERR "Opera: root directory claims %d copies, "
+					"at most %d supported (disk #%08X).\n",
+					be32_to_cpu(dsb->root.last_copy) + 1, NUM_COPIES_ROOT,
+					sbi->disk_id);
+		iput(inode);
+		return -EINVAL;
+	}
+	if (opera_set_copies(inode, be32_to_cpu(dsb->root.last_copy),
+			dsb->root.copies) < 0) {
+		iput(inode);
+		return -ENOMEM;
+	}
 	
 	set_nlink(inode, 2); 
 	inc_nlink(opera_count_dirs(inode));
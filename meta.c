@@ -0,0 +1,618 @@
+/*
+ * meta.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Directory metadata shared between mounts of the same disk
+// (mount option 'share').
+//
+// Mounts are considered to be of the same disk if the disk id, the
+// block size, the block count and a checksum of the superblock are the
+// same. Such mounts share one opera_meta, which holds a copy of the
+// entries of each directory which has been read by any of them. Once a
+// directory is in there, opera_for_all_entries() takes the entries from
+// memory instead of from the disk, for all of these mounts.
+//
+// A directory is only looked up by where it starts; when a mount asks
+// for one with a different size, which only a damaged disk would cause,
+// it is read from the disk instead.
+//
+// The directories of all disks together take at most OPERA_META_MAX
+// bytes. Beyond that, and when the system is short of memory (through a
+// shrinker), the least recently used ones are dropped. The memory is
+// charged to the memory cgroup of whoever read the directory first.
+// Each directory is reference counted, so that a walk can go on without
+// the lock while the directory is dropped from the cache. Everything of
+// a disk is dropped when the last of its mounts goes away.
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/crc32.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+// One directory entry, as kept in an opera_meta_dir.
+struct opera_meta_entry {
+	uint32_t pos;  // position in the directory, as for start_pos
+	uint32_t dirent_off;  // offset of the dirent in opera_meta_dir.dirents
+	uint8_t type;  // DT_DIR or DT_REG
+	uint8_t special;  // is this a special file?
+	uint8_t name_len;
+};
+
+struct opera_meta_dir {
+	struct rb_node node;  // in opera_meta.dirs
+	struct list_head lru;  // in opera_meta_lru, most recently used first
+	struct opera_meta *meta;
+	atomic_t refs;  // one for being in the cache, one per walk
+	uint32_t start_block;
+	uint32_t num_blocks;
+	uint32_t num_entries;
+	uint32_t size;  // bytes allocated for this structure
+	struct opera_meta_entry *entries;
+	uint8_t *dirents;  // copies of the on-disk entries, one after another
+};
+
+struct opera_meta {
+	struct list_head list;  // in opera_meta_list
+	unsigned int mounts;  // reference count, protected by opera_meta_mutex
+
+	uint32_t disk_id;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t checksum;  // of the superblock
+
+	struct rb_root dirs;
+			// opera_meta_dir, by start_block. Protected by
+			// opera_meta_lock.
+
+	atomic64_t num_dirs;
+	atomic64_t bytes;  // memory used by the directories
+	atomic64_t hits;  // directory walks done from memory
+	atomic64_t misses;  // directory walks which had to read the disk
+	atomic64_t evicted;  // directories dropped to make room
+};
+
+// Used while reading a directory from the disk.
+struct opera_meta_build {
+	struct opera_meta_entry *entries;
+	uint32_t num_entries;
+	uint32_t max_entries;
+	uint8_t *dirents;
+	uint32_t dirents_size;
+	uint32_t dirents_max;
+	loff_t dir_start;  // position of the first block of the dir, in bytes
+	int error;  // set if the callback failed
+};
+
+static struct opera_meta_dir *opera_meta_find(struct opera_meta *meta,
+		uint32_t start_block, uint32_t num_blocks);
+static struct opera_meta_dir *opera_meta_insert(struct opera_meta *meta,
+		struct opera_meta_dir *dir);
+static void opera_meta_put(struct opera_meta_dir *dir);
+static void opera_meta_evict(struct opera_meta_dir *dir);
+static unsigned long opera_meta_count(struct shrinker *shrinker,
+		struct shrink_control *sc);
+static unsigned long opera_meta_scan(struct shrinker *shrinker,
+		struct shrink_control *sc);
+static int opera_meta_build_callback(void *data, const char *name,
+		size_t len, ino_t ino, unsigned int type,
+		const struct opera_disk_dirent *tdd);
+static struct opera_meta_dir *opera_meta_read_dir(struct super_block *sb,
+		uint32_t start_block, uint32_t num_blocks);
+static void opera_meta_free(struct opera_meta *meta);
+
+
+//============================================================================
+
+
+static LIST_HEAD(opera_meta_list);
+static DEFINE_MUTEX(opera_meta_mutex);
+		// Protects opera_meta_list and opera_meta.mounts.
+
+#define OPERA_META_MAX (32 << 20)
+		// Maximum number of bytes in the directories of all disks.
+
+static DEFINE_SPINLOCK(opera_meta_lock);
+		// Protects opera_meta_lru, opera_meta_bytes, and the dirs of
+		// every opera_meta.
+static LIST_HEAD(opera_meta_lru);
+static unsigned long opera_meta_bytes;
+static unsigned long opera_meta_count_dirs;
+
+static struct shrinker opera_meta_shrinker = {
+	.count_objects = opera_meta_count,
+	.scan_objects = opera_meta_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+
+//============================================================================
+
+
+int
+opera_meta_init(void)
+{
+	return register_shrinker(&opera_meta_shrinker);
+}
+
+void
+opera_meta_exit(void)
+{
+	unregister_shrinker(&opera_meta_shrinker);
+}
+
+// Join the opera_meta of the disk, or create it if this is the first
+// mount of the disk. Does nothing unless the 'share' option is set.
+int
+opera_meta_attach(struct opera_sb_info *sbi,
+		const struct opera_disk_superblock *dsb)
+{
+	struct opera_meta *meta;
+	uint32_t checksum;
+
+	if (!sbi->options.share)
+		return 0;
+
+	checksum = crc32_le(~0, (const unsigned char *) dsb, sizeof *dsb);
+
+	mutex_lock(&opera_meta_mutex);
+	list_for_each_entry(meta, &opera_meta_list, list) {
+		if (meta->disk_id == sbi->disk_id &&
+				meta->block_size == sbi->block_size &&
+				meta->block_count == sbi->block_count &&
+				meta->checksum == checksum) {
+			meta->mounts++;
+			goto out;
+		}
+	}
+
+	meta = kzalloc(sizeof *meta, GFP_KERNEL);
+	if (meta == NULL) {
+		mutex_unlock(&opera_meta_mutex);
+		return -ENOMEM;
+	}
+	meta->mounts = 1;
+	meta->disk_id = sbi->disk_id;
+	meta->block_size = sbi->block_size;
+	meta->block_count = sbi->block_count;
+	meta->checksum = checksum;
+	meta->dirs = RB_ROOT;
+	list_add(&meta->list, &opera_meta_list);
+
+out:
+	mutex_unlock(&opera_meta_mutex);
+	sbi->meta = meta;
+	return 0;
+}
+
+void
+opera_meta_detach(struct opera_sb_info *sbi)
+{
+	struct opera_meta *meta = sbi->meta;
+
+	if (meta == NULL)
+		return;
+	sbi->meta = NULL;
+
+	mutex_lock(&opera_meta_mutex);
+	meta->mounts--;
+	if (meta->mounts == 0) {
+		list_del(&meta->list);
+		opera_meta_free(meta);
+	}
+	mutex_unlock(&opera_meta_mutex);
+}
+
+static void
+opera_meta_free(struct opera_meta *meta)
+{
+	struct opera_meta_dir *dir;
+	struct rb_node *node;
+	LIST_HEAD(victims);
+
+	spin_lock(&opera_meta_lock);
+	while ((node = rb_first(&meta->dirs)) != NULL) {
+		dir = rb_entry(node, struct opera_meta_dir, node);
+		opera_meta_evict(dir);
+		list_add(&dir->lru, &victims);
+	}
+	spin_unlock(&opera_meta_lock);
+
+	while (!list_empty(&victims)) {
+		dir = list_first_entry(&victims, struct opera_meta_dir, lru);
+		list_del(&dir->lru);
+		opera_meta_put(dir);
+	}
+	kfree(meta);
+}
+
+// Take dir out of the cache. The reference of the cache is passed to
+// the caller, who should drop it, after releasing opera_meta_lock, with
+// opera_meta_put(). dir->lru may be used for that meanwhile.
+// Called with opera_meta_lock held.
+static void
+opera_meta_evict(struct opera_meta_dir *dir)
+{
+	struct opera_meta *meta = dir->meta;
+
+	rb_erase(&dir->node, &meta->dirs);
+	list_del(&dir->lru);
+	opera_meta_bytes -= dir->size;
+	opera_meta_count_dirs--;
+	atomic64_dec(&meta->num_dirs);
+	atomic64_sub(dir->size, &meta->bytes);
+}
+
+static void
+opera_meta_put(struct opera_meta_dir *dir)
+{
+	if (atomic_dec_and_test(&dir->refs))
+		kfree(dir);
+}
+
+// Look up a directory, and take a reference to it.
+// Returns NULL if it is not in the cache, or is with another size.
+static struct opera_meta_dir *
+opera_meta_find(struct opera_meta *meta, uint32_t start_block,
+		uint32_t num_blocks)
+{
+	struct rb_node *node;
+	struct opera_meta_dir *dir = NULL;
+
+	spin_lock(&opera_meta_lock);
+	node = meta->dirs.rb_node;
+	while (node != NULL) {
+		dir = rb_entry(node, struct opera_meta_dir, node);
+		if (start_block < dir->start_block) {
+			node = node->rb_left;
+		} else if (start_block > dir->start_block) {
+			node = node->rb_right;
+		} else
+			break;
+	}
+	if (node == NULL || dir->num_blocks != num_blocks) {
+		dir = NULL;
+	} else {
+		atomic_inc(&dir->refs);
+		list_move(&dir->lru, &opera_meta_lru);
+	}
+	spin_unlock(&opera_meta_lock);
+	return dir;
+}
+
+// Add dir, which holds one reference, for the caller. If another mount
+// has added the same directory in the meantime, dir is freed and the
+// existing one is returned instead, with a reference for the caller.
+// If dir cannot be added (too large, or another directory with the
+// same start), it is returned as is.
+// Makes room by dropping the least recently used directories.
+static struct opera_meta_dir *
+opera_meta_insert(struct opera_meta *meta, struct opera_meta_dir *dir)
+{
+	struct rb_node **link, *parent = NULL;
+	struct opera_meta_dir *other;
+	LIST_HEAD(victims);
+
+	if (dir->size > OPERA_META_MAX / 4)
+		return dir;
+
+	spin_lock(&opera_meta_lock);
+	link = &meta->dirs.rb_node;
+	while (*link != NULL) {
+		parent = *link;
+		other = rb_entry(parent, struct opera_meta_dir, node);
+		if (dir->start_block < other->start_block) {
+			link = &parent->rb_left;
+		} else if (dir->start_block > other->start_block) {
+			link = &parent->rb_right;
+		} else {
+			if (other->num_blocks != dir->num_blocks) {
+				spin_unlock(&opera_meta_lock);
+				return dir;
+			}
+			atomic_inc(&other->refs);
+			list_move(&other->lru, &opera_meta_lru);
+			spin_unlock(&opera_meta_lock);
+			opera_meta_put(dir);
+			return other;
+		}
+	}
+	rb_link_node(&dir->node, parent, link);
+	rb_insert_color(&dir->node, &meta->dirs);
+	atomic_inc(&dir->refs);
+	list_add(&dir->lru, &opera_meta_lru);
+	opera_meta_bytes += dir->size;
+	opera_meta_count_dirs++;
+	atomic64_inc(&meta->num_dirs);
+	atomic64_add(dir->size, &meta->bytes);
+
+	while (opera_meta_bytes > OPERA_META_MAX) {
+		other = list_last_entry(&opera_meta_lru, struct opera_meta_dir,
+				lru);
+		atomic64_inc(&other->meta->evicted);
+		opera_meta_evict(other);
+		list_add(&other->lru, &victims);
+	}
+	spin_unlock(&opera_meta_lock);
+
+	while (!list_empty(&victims)) {
+		other = list_first_entry(&victims, struct opera_meta_dir, lru);
+		list_del(&other->lru);
+		opera_meta_put(other);
+	}
+	return dir;
+}
+
+static unsigned long
+opera_meta_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	(void) shrinker;  /* Unused variable - satisfy compiler */
+	(void) sc;  /* Unused variable - satisfy compiler */
+	return READ_ONCE(opera_meta_count_dirs);
+}
+
+static unsigned long
+opera_meta_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct opera_meta_dir *dir;
+	unsigned long freed = 0;
+	LIST_HEAD(victims);
+
+	spin_lock(&opera_meta_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&opera_meta_lru)) {
+		dir = list_last_entry(&opera_meta_lru, struct opera_meta_dir, lru);
+		atomic64_inc(&dir->meta->evicted);
+		opera_meta_evict(dir);
+		list_add(&dir->lru, &victims);
+		freed++;
+	}
+	spin_unlock(&opera_meta_lock);
+
+	while (!list_empty(&victims)) {
+		dir = list_first_entry(&victims, struct opera_meta_dir, lru);
+		list_del(&dir->lru);
+		opera_meta_put(dir);
+	}
+	(void) shrinker;  /* Unused variable - satisfy compiler */
+	return freed;
+}
+
+// Is the directory in the cache of the mount? For prefetch decisions;
+// it may be gone by the time it is used.
+int
+opera_meta_cached(struct opera_sb_info *sbi, uint32_t start_block,
+		uint32_t num_blocks)
+{
+	struct opera_meta_dir *dir;
+
+	if (sbi->meta == NULL)
+		return 0;
+	dir = opera_meta_find(sbi->meta, start_block, num_blocks);
+	if (dir == NULL)
+		return 0;
+	opera_meta_put(dir);
+	return 1;
+}
+
+static int
+opera_meta_build_callback(void *data, const char *name, size_t len,
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd)
+{
+	struct opera_meta_build *build = (struct opera_meta_build *) data;
+	struct opera_meta_entry *entry;
+	uint32_t dirent_size;
+
+	if (build->num_entries == build->max_entries) {
+		uint32_t max = build->max_entries == 0 ? 32 :
+				2 * build->max_entries;
+		entry = krealloc(build->entries,
+				max * sizeof (struct opera_meta_entry), GFP_KERNEL);
+		if (entry == NULL) {
+			build->error = -ENOMEM;
+			return -1;
+		}
+		build->entries = entry;
+		build->max_entries = max;
+	}
+
+	dirent_size = 72 + 4 * be32_to_cpu(tdd->last_copy);
+			// opera_for_all_entries_disk() has checked that this fits.
+	if (build->dirents_size + dirent_size > build->dirents_max) {
+		uint32_t max = build->dirents_max == 0 ? 2048 :
+				2 * build->dirents_max;
+		uint8_t *dirents;
+		while (build->dirents_size + dirent_size > max)
+			max *= 2;
+		dirents = krealloc(build->dirents, max, GFP_KERNEL);
+		if (dirents == NULL) {
+			build->error = -ENOMEM;
+			return -1;
+		}
+		build->dirents = dirents;
+		build->dirents_max = max;
+	}
+
+	entry = &build->entries[build->num_entries];
+	entry->pos = ino - build->dir_start;
+	entry->dirent_off = build->dirents_size;
+	entry->type = type;
+	entry->special = OPERA_DIRENT_TYPE(be32_to_cpu(tdd->flags)) ==
+			OPERA_DIRENT_SPECIAL;
+	entry->name_len = len;
+	memcpy(build->dirents + build->dirents_size, tdd, dirent_size);
+	build->dirents_size += dirent_size;
+	build->num_entries++;
+
+	(void) name;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+// Read a directory from the disk into a new opera_meta_dir.
+static struct opera_meta_dir *
+opera_meta_read_dir(struct super_block *sb, uint32_t start_block,
+		uint32_t num_blocks)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct opera_meta_build build;
+	struct opera_meta_dir *dir;
+	size_t entries_size;
+	loff_t pos = 0;
+	int res;
+
+	memset(&build, '\0', sizeof build);
+	build.dir_start = (loff_t) start_block << sbi->block_shift;
+
+	res = opera_for_all_entries_disk(sb, start_block, num_blocks, &pos, 1,
+			opera_meta_build_callback, &build);
+	if (res < 0) {
+		dir = ERR_PTR(res);
+		goto out;
+	}
+	if (build.error < 0) {
+		dir = ERR_PTR(build.error);
+		goto out;
+	}
+
+	// Put it all in one allocation.
+	entries_size = build.num_entries * sizeof (struct opera_meta_entry);
+	dir = kmalloc(sizeof *dir + entries_size + build.dirents_size,
+			GFP_KERNEL_ACCOUNT);
+	if (dir == NULL) {
+		dir = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	atomic_set(&dir->refs, 1);
+	INIT_LIST_HEAD(&dir->lru);
+	dir->meta = sbi->meta;
+	dir->start_block = start_block;
+	dir->num_blocks = num_blocks;
+	dir->num_entries = build.num_entries;
+	dir->size = sizeof *dir + entries_size + build.dirents_size;
+	dir->entries = (struct opera_meta_entry *) (dir + 1);
+	dir->dirents = (uint8_t *) dir->entries + entries_size;
+	memcpy(dir->entries, build.entries, entries_size);
+	memcpy(dir->dirents, build.dirents, build.dirents_size);
+
+out:
+	kfree(build.entries);
+	kfree(build.dirents);
+	return dir;
+}
+
+// opera_for_all_entries_at() for mounts with a shared opera_meta.
+int
+opera_meta_for_all_entries(struct super_block *sb, uint32_t start_block,
+		unsigned int num_blocks, loff_t *start_pos,
+		opera_for_all_callback callback, void *data)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct opera_meta *meta = sbi->meta;
+	struct opera_meta_dir *dir;
+	const struct opera_meta_entry *entry;
+	const struct opera_disk_dirent *tdd;
+	loff_t end = (loff_t) num_blocks << sbi->block_shift;
+	int stored = 0;
+	uint32_t i;
+	int res;
+
+	if (*start_pos >= end) {
+		// We're already done.
+		return 0;
+	}
+
+	dir = opera_meta_find(meta, start_block, num_blocks);
+	if (dir != NULL) {
+		atomic64_inc(&meta->hits);
+	} else {
+		atomic64_inc(&meta->misses);
+		dir = opera_meta_read_dir(sb, start_block, num_blocks);
+		if (IS_ERR(dir))
+			return PTR_ERR(dir);
+		dir = opera_meta_insert(meta, dir);
+				// If it could not be added, this walk still uses it,
+				// and it is freed at the end.
+	}
+
+	for (i = 0; i < dir->num_entries; i++) {
+		if (dir->entries[i].pos >= *start_pos)
+			break;
+	}
+
+	for (; i < dir->num_entries; i++) {
+		entry = &dir->entries[i];
+		if (entry->special && !sbi->options.show_special)
+			continue;
+		tdd = (const struct opera_disk_dirent *)
+				(dir->dirents + entry->dirent_off);
+
+		res = callback(data, tdd->name, entry->name_len,
+				(ino_t) ((loff_t) start_block << sbi->block_shift) +
+				entry->pos, entry->type, tdd);
+		if (res) {
+			if (res > 0) {
+				stored++;
+				i++;
+			}
+			*start_pos = i < dir->num_entries ? dir->entries[i].pos : end;
+			opera_meta_put(dir);
+			return stored;
+		}
+		stored++;
+	}
+
+	*start_pos = end;
+	opera_meta_put(dir);
+	return stored;
+}
+
+// For the stats file.
+void
+opera_meta_stats(struct opera_sb_info *sbi, struct seq_file *m)
+{
+	struct opera_meta *meta = sbi->meta;
+	unsigned int mounts;
+
+	if (meta == NULL)
+		return;
+
+	mutex_lock(&opera_meta_mutex);
+	mounts = meta->mounts;
+	mutex_unlock(&opera_meta_mutex);
+
+	seq_printf(m, "share_mounts %u\n", mounts);
+	seq_printf(m, "share_dirs %lld\n",
+			(long long) atomic64_read(&meta->num_dirs));
+	seq_printf(m, "share_bytes %lld\n",
+			(long long) atomic64_read(&meta->bytes));
+	seq_printf(m, "share_hits %lld\n",
+			(long long) atomic64_read(&meta->hits));
+	seq_printf(m, "share_misses %lld\n",
+			(long long) atomic64_read(&meta->misses));
+	seq_printf(m, "share_evicted %lld\n",
+			(long long) atomic64_read(&meta->evicted));
+	seq_printf(m, "share_total_bytes %lu\n", READ_ONCE(opera_meta_bytes));
+}
+
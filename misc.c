@@ -26,7 +26,8 @@
 
 
 static int opera_count_dirs_callback(void *data, const char *name,
-		size_t name_len, ino_t ino, unsigned int type);
+		size_t name_len, ino_t ino, unsigned int type,
+		const struct opera_disk_dirent *tdd);
 
 
 // ============================================================================
@@ -41,16 +42,43 @@ static int opera_count_dirs_callback(void *data, const char *name,
 int
 opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 		opera_for_all_callback callback, void *data)
+{
+	return opera_for_all_entries_at(inode->i_sb,
+			OPERA_I(inode)->start_block,
+			inode->i_size >> OPERA_SB(inode->i_sb)->block_shift,
+			start_pos, callback, data);
+}
+
+// Like opera_for_all_entries(), for the directory of num_blocks blocks
+// starting at block start_block. For when there is no inode for the
+// directory.
+int
+opera_for_all_entries_at(struct super_block *sb, uint32_t start_block,
+		unsigned int num_blocks, loff_t *start_pos,
+		opera_for_all_callback callback, void *data)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+
+	if (sbi->meta != NULL) {
+		return opera_meta_for_all_entries(sb, start_block, num_blocks,
+				start_pos, callback, data);
+	}
+	return opera_for_all_entries_disk(sb, start_block, num_blocks,
+			start_pos, sbi->options.show_special, callback, data);
+}
+
+// Like opera_for_all_entries_at(), always reading from the disk.
+// Special files are included only if show_special is set.
+int
+opera_for_all_entries_disk(struct super_block *sb, uint32_t start_block,
+		unsigned int num_blocks, loff_t *start_pos, int show_special,
+		opera_for_all_callback callback, void *data)
 {
 	int stored = 0;
 			// number of directory entries stored this call so far
-	struct super_block *sb = inode->i_sb;
 	struct opera_sb_info *sbi = OPERA_SB(sb);
-	struct opera_inode_info *info = OPERA_I(inode);
 	struct buffer_head *bh = NULL;
 	const struct opera_disk_dir_header *tddh;
-	unsigned int num_blocks;
-			// number of blocks in the directory
 	uint32_t next_block, prev_block;
 	uint32_t first_free;
 			// first unused byte in the block
@@ -68,8 +96,9 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 			// file type of the current directory entry
 	unsigned int last_dirent_in_dir;
 			// flag - is this the last directory entry in the dir?
+	int seq = 0;
+			// flag - was the previous block read by this call?
 
-	num_blocks = inode->i_size >> sbi->block_shift;
 	blocknr = *start_pos >> sbi->block_shift;
 	if (blocknr >= num_blocks) {
 		// We're already done.
@@ -78,11 +107,12 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 
 	pos = *start_pos & OPERA_BLOCK_MASK(sbi->block_shift);
 	for (;;) {
-		bh = sb_bread(sb, info->start_block + blocknr);
+		bh = opera_ra_bread(sb, start_block + blocknr, seq);
+		seq = 1;
 		if (bh == NULL) {
 			printk(KERN_ERR "Opera: could not read block %d "
 					"(block_size=%d, disk #%08X).\n",
-					info->start_block + blocknr, sbi->block_size,
+					start_block + blocknr, sbi->block_size,
 					sbi->disk_id);
 			error = -EINVAL;
 			goto out_err;
@@ -104,7 +134,7 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 			// and prev_block).
 			printk(KERN_ERR "Opera: bad directory header in block %d "
 					"(block_size=%d, disk #%08X).\n",
-					info->start_block + blocknr, sbi->block_size,
+					start_block + blocknr, sbi->block_size,
 					sbi->disk_id);
 			error = -EINVAL;
 			goto out_err;
@@ -118,7 +148,7 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 				// position outside the block, or not aligned.
 				printk(KERN_ERR "Opera: Bad start of directory in block %d"
 						"(block_size=%d, disk #%08X).\n",
-						info->start_block + blocknr, sbi->block_size,
+						start_block + blocknr, sbi->block_size,
 						sbi->disk_id);
 				error = -EBADF;
 				goto out_err;
@@ -127,17 +157,20 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 			tdd = (struct opera_disk_dirent *)
 					(((uint8_t *) bh->b_data) + pos);
 			
-			entry_size = 72 + 4 * be32_to_cpu(tdd->last_copy);
-			if (pos + entry_size > first_free) {
+			// Check last_copy before multiplying; a huge value would
+			// make the size wrap around.
+			if (pos + 72 > first_free || be32_to_cpu(tdd->last_copy) >
+					(first_free - pos - 72) / 4) {
 				// The entire entry does not fit in the block.
 				// That should not happen.
 				printk(KERN_ERR "Opera: Bad directory entry in block %d "
 						"(pos=%d, block_size=%d, disk #%08X).\n",
-						info->start_block + blocknr, pos, sbi->block_size,
+						start_block + blocknr, pos, sbi->block_size,
 						sbi->disk_id);
 				error = -EBADF;
 				goto out_err;
 			}
+			entry_size = 72 + 4 * be32_to_cpu(tdd->last_copy);
 
 			entry_flags = be32_to_cpu(tdd->flags);
 
@@ -145,7 +178,7 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 				printk(KERN_WARNING "Opera: Block size for directory entry "
 						"in block %d (%d) differs from the file system "
 						"block size (pos=%d, block_size=%d, disk #%08X). "
-						"Entry skipped.\n", info->start_block + blocknr,
+						"Entry skipped.\n", start_block + blocknr,
 						be32_to_cpu(tdd->block_size), pos, sbi->block_size,
 						sbi->disk_id);
 				goto next_entry;
@@ -156,7 +189,7 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 					type = DT_REG;
 					break;
 				case OPERA_DIRENT_SPECIAL:  // Special File
-					if (sbi->options.show_special) {
+					if (show_special) {
 						type = DT_REG;
 					} else
 						goto next_entry;
@@ -168,15 +201,15 @@ opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 					printk(KERN_WARNING "Opera: Unrecognised directory "
 							"entry type %d in block %d (ignored) (pos=%d, "
 							"block_size=%d, disk #%08X).\n",
-							entry_flags & 0xff, info->start_block + blocknr,
+							entry_flags & 0xff, start_block + blocknr,
 							pos, sbi->block_size, sbi->disk_id);
 					goto next_entry;
 			};
 					
 			error = callback(data, tdd->name,
 					strnlen(tdd->name, OPERA_NAME_MAX),
-					(info->start_block + blocknr) * sbi->block_size + pos,
-					type);
+					(start_block + blocknr) * sbi->block_size + pos,
+					type, tdd);
 			if (error) {
 				if (error > 0) {
 					stored++;
@@ -245,7 +278,7 @@ opera_count_dirs(struct inode *inode) {
 
 static int
 opera_count_dirs_callback(void *data, const char *name, size_t name_len,
-		ino_t ino, unsigned int type) {
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd) {
 	struct opera_count_dirs_arg *arg =
 			(struct opera_count_dirs_arg *) data;
 	
@@ -255,6 +288,7 @@ opera_count_dirs_callback(void *data, const char *name, size_t name_len,
 	(void) name;  /* Unused variable - satisfy compiler */
 	(void) name_len;  /* Unused variable - satisfy compiler */
 	(void) ino;  /* Unused variable - satisfy compiler */
+	(void) tdd;  /* Unused variable - satisfy compiler */
 	return 0;  // continue counting
 }
 
@@ -18,6 +18,11 @@
 #ifndef _OPERAFS_H
 #define _OPERAFS_H
 
+#ifndef __KERNEL__
+#	include <stdint.h>
+#	include <linux/ioctl.h>
+#endif
+
 #define OPERA_COMMENT_MAX 32
 		// Maximum comment length
 
@@ -110,6 +115,59 @@ struct opera_disk_dirent {
 			// last_copy, not necessarilly 1.
 } __attribute__((packed));
 
+#define OPERA_ROOT_INO 84
+		// Using the disk position of the dir entry as inode number.
+
+
+#define OPERA_MAGIC  0x4455434B /* DUCK */
+		// Identifying to linux with this value for the file system type.
+
+
+// Snapshot of a whole directory tree, in one or a few calls:
+//	struct opera_tree_snapshot snap = { .cookie = 0, ... };
+//	do {
+//		ioctl(dir_fd, OPERA_IOC_TREE_SNAPSHOT, &snap);
+//		// process snap.count entries
+//	} while (!(snap.flags & OPERA_TREE_DONE));
+// Directories are read in the order of their position on the disk.
+// The cookie is only valid for the file descriptor that returned it.
+struct opera_tree_entry {
+	uint64_t ino;  // position of the directory entry; the inode number
+	uint64_t size;  // size in bytes
+	uint32_t parent;
+			// Index (counting from 0, over all calls) of the entry of
+			// the parent directory, or OPERA_TREE_TOP for entries in the
+			// directory the ioctl was done on.
+#define OPERA_TREE_TOP 0xffffffff
+	uint32_t start_block;  // first block of the first copy
+	uint8_t type;  // DT_DIR or DT_REG
+	uint8_t name_len;
+	uint8_t name[OPERA_NAME_MAX];  // not '\0'-terminated
+	uint8_t reserved[6];
+};
+
+struct opera_tree_snapshot {
+	uint64_t cookie;
+			// In: 0 to start a walk, or the value from the previous
+			// call to continue it. Out: the value for the next call.
+	uint64_t entries;  // user pointer to an array of opera_tree_entry
+	uint32_t max_entries;  // size of that array
+	uint32_t count;  // out: number of entries filled in
+	uint32_t flags;  // out
+#define OPERA_TREE_DONE 0x00000001
+		// The walk is complete.
+	uint32_t reserved;
+};
+
+#define OPERA_IOC_TREE_SNAPSHOT _IOWR('O', 1, struct opera_tree_snapshot)
+
+
+
+#ifdef __KERNEL__
+		// The rest of this file is only meaningful inside the kernel.
+		// The on-disk structures above are shared with the user space
+		// tools in tools/.
+
 struct opera_fs_options {
 	kuid_t uid;  // uid of files and directories
 	kgid_t gid;  // gid of files and directories
@@ -118,8 +176,168 @@ struct opera_fs_options {
 	int show_special: 1;  // show special files?
 #define OPERA_DEFAULT_SHOW_SPECIAL 0
 		// Show special files if no options are passed?
+	unsigned int prepopulate;
+			// Memory budget in bytes for inodes and dentries instantiated
+			// by readdir, per open directory. 0 disables prepopulation.
+#define OPERA_PREPOPULATE_MAX (256 << 20)
+	unsigned int trace;
+			// Number of records in the access trace ring. 0 disables
+			// tracing.
+#define OPERA_TRACE_MAX (1 << 20)
+	unsigned int prefetch_next;
+			// Number of bytes of the next file on the disk to read ahead
+			// when a file has been read to the end. 0 disables it.
+#define OPERA_PREFETCH_NEXT_MAX (16 << 20)
+	unsigned int coalesce;
+			// Maximum number of bytes of neighbouring small files to read
+			// along with a small file. 0 disables it.
+#define OPERA_COALESCE_MAX (1 << 20)
+	unsigned int spec_rate;
+			// Bytes per second of speculative reads (next-file prefetch,
+			// directory prefetch, small file coalescing) a mount may
+			// start. 0 for no limit.
+#define OPERA_DEFAULT_SPEC_RATE (32 << 20)
+#define OPERA_SPEC_RATE_MAX (1 << 30)
+	int share: 1;
+			// Share the directory metadata with other mounts of the
+			// same disk? (see meta.c)
+	uint64_t pin_max;  // maximum number of bytes in pinned files
+#define OPERA_DEFAULT_PIN_MAX (64 << 20)
+#define OPERA_PIN_OPTIONS_MAX 8
+	char *pins[OPERA_PIN_OPTIONS_MAX];
+			// Paths of the files to pin from the mount options. Only
+			// used until they are pinned in opera_fill_super().
+	unsigned int num_pins;
+	unsigned int ra_min;
+	unsigned int ra_max;
+			// Bounds in bytes of the adaptive readahead window (see
+			// ra.c). If ra_max is 0, the readahead of the block device
+			// is used.
+#define OPERA_DEFAULT_RA_MIN (16 << 10)
+#define OPERA_RA_MAX (16 << 20)
+	unsigned int ra_lat;
+			// Average wait in microseconds of the reads which missed,
+			// above which the readahead window grows.
+#define OPERA_DEFAULT_RA_LAT 2000
+};
+
+// One open or read of a file, as recorded by the access trace.
+struct opera_trace_record {
+	uint64_t ino;  // position of the directory entry on the disk
+	uint64_t pos;  // offset in the file
+	uint32_t len;  // number of bytes read; 0 for an open
+};
+
+struct opera_trace {
+	spinlock_t lock;
+	struct opera_trace_record *records;
+	unsigned int size;  // number of records in the ring
+	unsigned int next;  // index of the next record to be written
+	uint64_t count;  // number of records written since the mount
+};
+
+// Counters, shown in /proc/fs/opera/<device>/stats.
+struct opera_stats {
+	atomic64_t prefetch_next;  // next-file prefetches started
+	atomic64_t prefetch_next_bytes;  // bytes requested by those
+	atomic64_t prefetch_next_cached;
+			// next-file prefetches skipped because the file was cached
+	atomic64_t prefetch_next_none;
+			// files read to the end with no next file in the directory
+	atomic64_t prefetch_dir;  // directory prefetches started by lookups
+	atomic64_t prefetch_dir_blocks;  // blocks read by those
+	atomic64_t coalesce;  // small file reads which included neighbours
+	atomic64_t coalesce_files;  // neighbouring files read by those
+	atomic64_t coalesce_bytes;  // bytes of those files
+	atomic64_t coalesce_hits;  // of those files, the ones read later
+	atomic64_t spec_throttled;
+			// speculative reads skipped because of spec_rate
+	atomic64_t pinned_files;  // number of pinned files
+	atomic64_t pinned_bytes;  // page cache held by those
+	atomic64_t ra_reads;  // sampled reads continuing the previous one
+	atomic64_t ra_hits;  // of those, the ones found in memory
+	atomic64_t ra_misses;  // sampled reads which waited for the disk
+	atomic64_t ra_miss_us;  // total time waited by those
+	atomic64_t ra_grow;  // readahead window decisions (see ra.c)
+	atomic64_t ra_shrink;
+	atomic64_t ra_trim;
+	atomic64_t ra_hold;
+};
+
+enum {
+	OPERA_RA_GROW,
+	OPERA_RA_SHRINK,
+	OPERA_RA_TRIM,
+	OPERA_RA_HOLD,
+};
+
+// A change (or not) of the readahead window.
+struct opera_ra_decision {
+	uint64_t time;  // nanoseconds since the mount
+	unsigned int decision;  // OPERA_RA_*
+	unsigned int old_window;  // in pages
+	unsigned int new_window;  // in pages
+	unsigned int reads;  // the samples it was based on
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int lat_us;
+			// estimated latency of a read that misses, apart from the
+			// time to transfer it
+};
+
+// State of the adaptive readahead of a mount.
+struct opera_ra {
+	spinlock_t lock;
+	unsigned int window;
+			// In pages; 0 if not adaptive. Read without the lock.
+	unsigned int min_pages;
+	unsigned int max_pages;
+	uint64_t start;  // ktime of the mount
+
+	// Samples since the last decision.
+	unsigned int reads;
+	unsigned int hits;
+	unsigned int misses;
+	uint64_t miss_ns;
+
+	// Weighted sums over the misses, of their size s in KiB and their
+	// wait t in ns, to fit t = latency + s * per_kib (see ra.c). Halved
+	// at each decision instead of cleared, so that they span several
+	// window sizes.
+	int64_t fit_n;
+	int64_t fit_s;
+	int64_t fit_t;
+	int64_t fit_ss;
+	int64_t fit_st;
+	int64_t per_kib;  // ns per KiB from the last usable fit
+
+	// The last decisions, in a ring.
+#define OPERA_RA_LOG 32
+	struct opera_ra_decision log[OPERA_RA_LOG];
+	unsigned int log_next;
+	uint64_t log_count;
+};
+
+// Budget of the speculative reads of a mount: a token bucket, holding
+// up to one second's worth of options.spec_rate.
+struct opera_spec {
+	spinlock_t lock;
+	uint64_t stamp;  // ktime of the last refill
+	uint64_t tokens;  // bytes which may be read now
+};
+
+// One read being sampled, from opera_ra_begin() to opera_ra_end().
+struct opera_ra_sample {
+	uint64_t start;  // ktime of the start; 0 if not sampled
+	uint32_t bytes;  // size of the read that a miss waits for
+	unsigned int seq: 1;  // continues the previous read of the file
+	unsigned int hit: 1;  // the data was in memory
 };
 
+struct opera_meta;
+struct seq_file;
+struct buffer_head;
+
 struct opera_sb_info {
 	struct super_block *sb;
 
@@ -130,20 +348,57 @@ struct opera_sb_info {
 	uint32_t block_shift;
 
 	uint32_t disk_id;
+
+	struct opera_trace trace;
+	struct opera_stats stats;
+	struct opera_ra ra;
+	struct opera_spec spec;
+	struct opera_meta *meta;  // shared metadata, or NULL
+	struct mutex pin_lock;  // protects pins
+	struct list_head pins;  // pinned files (struct opera_pin)
+	uint64_t pin_reserved;
+			// Bytes of the pinned files, and of those being pinned.
+			// Protected by pin_lock.
+	struct proc_dir_entry *proc_dir;  // /proc/fs/opera/<device>
 };
 #define OPERA_BLOCK_MASK(shift) ((1 << (shift)) - 1)
 
 struct opera_inode_info {
 	uint32_t start_block;
 			// In case of multiple copies, the first one is used.
+	uint32_t id;  // unique identifier from the directory entry
+	uint32_t flags;  // directory entry flags
+	uint8_t type[4];  // file type ("*dir", "*lbl", "*zap", ...)
+	uint32_t last_copy;  // number of copies - 1
+	uint32_t *copies;
+			// Locations of all copies, in blocks. Points to start_block
+			// when there is only one copy.
+	ino_t next_ino;
+			// The file following this one on the disk, in the same
+			// directory. 0 if not looked up yet.
+#define OPERA_NEXT_NONE 1
+		// next_ino value for 'there is no next file'. Never a valid
+		// inode number, as no directory entry starts at byte 1.
+	unsigned long state;  // bit flags:
+#define OPERA_I_COALESCED 0
+		// Read along with a neighbouring small file, and not read by
+		// anyone since.
 	struct inode vfs_inode;
 };
-#define OPERA_ROOT_INO 84
-		// Using the disk position of the dir entry as inode number.
 
+struct opera_tree_walk;
+
+// What an open directory keeps in file->private_data. Allocated on first
+// use, by readdir or by the tree snapshot ioctl, with the directory inode
+// locked.
+struct opera_dir_file {
+	size_t prepopulated;
+			// Bytes of inodes and dentries instantiated by readdir
+			// through this file; charged against options.prepopulate.
+	struct opera_tree_walk *walk;
+			// State of OPERA_IOC_TREE_SNAPSHOT. NULL if none.
+};
 
-#define OPERA_MAGIC  0x4455434B /* DUCK */
-		// Identifying to linux with this value for the file system type.
 
 static inline struct opera_sb_info *
 OPERA_SB(struct super_block *sb)
@@ -163,9 +418,20 @@ extern struct kmem_cache *opera_inode_cache;
 // From super.c:
 extern struct super_operations opera_super_ops;
 struct inode *operafs_iget(struct super_block *sb, unsigned long ino);
+struct inode *operafs_iget_dirent(struct super_block *sb, unsigned long ino,
+		const struct opera_disk_dirent *tdd);
+extern int opera_set_copies(struct inode *inode, uint32_t last_copy,
+		const uint32_t *disk_copies);
 
 // From dir.c:
 extern struct file_operations opera_dir_operations;
+extern struct opera_dir_file *opera_dir_file(struct file *file);
+extern int opera_dir_release(struct inode *inode, struct file *file);
+
+// From tree.c:
+extern long opera_dir_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg);
+extern void opera_tree_walk_free(struct opera_tree_walk *walk);
 
 // From file.c:
 extern struct file_operations opera_file_operations;
@@ -177,12 +443,80 @@ extern struct inode_operations opera_file_inode_operations;
 // From address.c:
 extern struct address_space_operations opera_address_operations;
 
+// From pin.c:
+extern int opera_pin_add(struct super_block *sb, const char *path);
+extern int opera_pin_remove(struct super_block *sb, const char *path);
+extern void opera_pin_mount(struct super_block *sb);
+extern void opera_pin_release(struct opera_sb_info *sbi);
+extern void opera_pin_show(struct opera_sb_info *sbi, struct seq_file *m,
+		void (*show)(struct seq_file *m, const char *path,
+		uint64_t bytes));
+
+// From prefetch.c:
+extern void opera_prefetch_next(struct file *file, loff_t pos, size_t len);
+extern void opera_prefetch_dir(struct super_block *sb, uint32_t start_block,
+		uint32_t num_blocks);
+extern void opera_coalesce(struct file *file, loff_t pos);
+
+// From ra.c:
+extern int opera_ra_init(struct opera_sb_info *sbi);
+extern void opera_ra_begin(struct file *file, loff_t pos,
+		struct opera_ra_sample *sample);
+extern void opera_ra_end(struct file *file,
+		const struct opera_ra_sample *sample, ssize_t res);
+extern void opera_ra_open(struct file *file);
+extern struct buffer_head *opera_ra_bread(struct super_block *sb,
+		sector_t block, int seq);
+extern unsigned int opera_ra_dir_blocks(struct opera_sb_info *sbi,
+		unsigned int limit);
+extern void opera_ra_show(struct opera_sb_info *sbi, struct seq_file *m);
+
+// From procfs.c:
+extern int opera_proc_init(void);
+extern void opera_proc_exit(void);
+extern int opera_proc_register(struct super_block *sb);
+extern void opera_proc_unregister(struct super_block *sb);
+
+// From trace.c:
+extern const struct seq_operations opera_trace_seq_ops;
+extern int opera_trace_init(struct opera_sb_info *sbi);
+extern void opera_trace_free(struct opera_sb_info *sbi);
+extern void opera_trace_add(struct opera_sb_info *sbi, ino_t ino,
+		loff_t pos, size_t len);
+
+// From xattr.c:
+extern const struct xattr_handler *opera_xattr_handlers[];
+extern ssize_t opera_listxattr(struct dentry *dentry, char *buffer,
+		size_t size);
+
+// From meta.c:
+extern int opera_meta_init(void);
+extern void opera_meta_exit(void);
+extern int opera_meta_cached(struct opera_sb_info *sbi, uint32_t start_block,
+		uint32_t num_blocks);
+extern int opera_meta_attach(struct opera_sb_info *sbi,
+		const struct opera_disk_superblock *dsb);
+extern void opera_meta_detach(struct opera_sb_info *sbi);
+extern int opera_meta_for_all_entries(struct super_block *sb,
+		uint32_t start_block, unsigned int num_blocks, loff_t *start_pos,
+		opera_for_all_callback callback, void *data);
+extern void opera_meta_stats(struct opera_sb_info *sbi, struct seq_file *m);
+
 // From misc.c:
 typedef int (*opera_for_all_callback)(void *data, const char *name,
-		size_t len, ino_t ino, unsigned int type);
+		size_t len, ino_t ino, unsigned int type,
+		const struct opera_disk_dirent *tdd);
 extern int opera_for_all_entries(struct inode *inode, loff_t *start_pos,
 		opera_for_all_callback callback, void *data);
+extern int opera_for_all_entries_at(struct super_block *sb,
+		uint32_t start_block, unsigned int num_blocks, loff_t *start_pos,
+		opera_for_all_callback callback, void *data);
+extern int opera_for_all_entries_disk(struct super_block *sb,
+		uint32_t start_block, unsigned int num_blocks, loff_t *start_pos,
+		int show_special, opera_for_all_callback callback, void *data);
 extern struct inode * opera_count_dirs(struct inode *inode);
 
+#endif  /* __KERNEL__ */
+
 #endif  /* _OPERAFS_H */
 
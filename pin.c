@@ -0,0 +1,301 @@
+/*
+ * pin.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Pinned files: files which are read completely and then kept in the
+// page cache for as long as they stay pinned.
+//
+// Files are pinned with the mount option pin=<path> (which may be given
+// more than once), or by writing the path to /proc/fs/opera/<device>/pins.
+// Writing "-<path>" there unpins a file. Paths are relative to the root
+// of the file system. The total size of the pinned files is limited by
+// the mount option pin_max=<KiB>.
+//
+// A pinned file keeps a reference to its inode, and its mapping is
+// marked unevictable, so that reclaim leaves its pages alone. Unpinning
+// drops the pages of the file from the page cache, and puts those which
+// cannot be dropped (mapped or locked ones) back on the normal LRU
+// lists; they could otherwise linger on the unevictable list.
+//
+// Reading a file to pin it can take long, so it is done without
+// pin_lock. The file is first put in the list with 'loading' set, which
+// reserves its bytes and keeps others from pinning it at the same time.
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/namei.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/swap.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+struct opera_pin {
+	struct list_head list;  // in opera_sb_info.pins
+	struct inode *inode;
+	unsigned long pages;  // number of pages pinned
+	int loading;  // still being read by opera_pin_add()
+	char path[];
+};
+
+static struct dentry *opera_pin_lookup(struct super_block *sb,
+		const char *path);
+static void opera_pin_unmap(struct address_space *mapping);
+static void opera_pin_free(struct opera_sb_info *sbi, struct opera_pin *pin);
+
+
+//============================================================================
+
+
+// Find a dentry by its path from the root of the file system.
+static struct dentry *
+opera_pin_lookup(struct super_block *sb, const char *path)
+{
+	struct dentry *dentry, *child;
+	const char *end;
+
+	dentry = dget(sb->s_root);
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+		end = strchrnul(path, '/');
+
+		inode_lock(d_inode(dentry));
+		child = lookup_one_len(path, dentry, end - path);
+		inode_unlock(d_inode(dentry));
+		dput(dentry);
+		if (IS_ERR(child))
+			return child;
+		if (d_really_is_negative(child)) {
+			dput(child);
+			return ERR_PTR(-ENOENT);
+		}
+		dentry = child;
+		path = end;
+	}
+	return dentry;
+}
+
+int
+opera_pin_add(struct super_block *sb, const char *path)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct opera_pin *pin;
+	struct dentry *dentry;
+	struct inode *inode;
+	struct page *page;
+	unsigned long pages, index;
+	int error;
+
+	dentry = opera_pin_lookup(sb, path);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	inode = igrab(d_inode(dentry));
+	dput(dentry);
+	if (inode == NULL)
+		return -ENOENT;
+	if (!S_ISREG(inode->i_mode)) {
+		iput(inode);
+		return -EISDIR;
+	}
+
+	pin = kmalloc(sizeof *pin + strlen(path) + 1, GFP_KERNEL);
+	if (pin == NULL) {
+		iput(inode);
+		return -ENOMEM;
+	}
+	pin->inode = inode;
+	strcpy(pin->path, path);
+	pages = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	pin->pages = pages;
+	pin->loading = 1;
+
+	// Reserve the bytes, and claim the inode.
+	mutex_lock(&sbi->pin_lock);
+	{
+		struct opera_pin *other;
+		list_for_each_entry(other, &sbi->pins, list) {
+			if (other->inode == inode) {
+				mutex_unlock(&sbi->pin_lock);
+				error = -EEXIST;
+				goto out_err;
+			}
+		}
+	}
+	if (sbi->pin_reserved + ((uint64_t) pages << PAGE_SHIFT) >
+			sbi->options.pin_max) {
+		mutex_unlock(&sbi->pin_lock);
+		error = -EFBIG;
+		goto out_err;
+	}
+	sbi->pin_reserved += (uint64_t) pages << PAGE_SHIFT;
+	list_add_tail(&pin->list, &sbi->pins);
+	mutex_unlock(&sbi->pin_lock);
+
+	// Mark the mapping first, so that the pages go to the unevictable
+	// list as they are read.
+	mapping_set_unevictable(inode->i_mapping);
+	for (index = 0; index < pages; index++) {
+		page = read_mapping_page(inode->i_mapping, index, NULL);
+		if (IS_ERR(page)) {
+			error = PTR_ERR(page);
+			opera_pin_unmap(inode->i_mapping);
+			mutex_lock(&sbi->pin_lock);
+			list_del(&pin->list);
+			sbi->pin_reserved -= (uint64_t) pages << PAGE_SHIFT;
+			mutex_unlock(&sbi->pin_lock);
+			goto out_err;
+		}
+		put_page(page);
+	}
+
+	mutex_lock(&sbi->pin_lock);
+	pin->loading = 0;
+	atomic64_inc(&sbi->stats.pinned_files);
+	atomic64_add((uint64_t) pages << PAGE_SHIFT, &sbi->stats.pinned_bytes);
+	mutex_unlock(&sbi->pin_lock);
+	return 0;
+
+out_err:
+	kfree(pin);
+	iput(inode);
+	return error;
+}
+
+// Undo mapping_set_unevictable(): drop what can be dropped, and move the
+// remaining pages off the unevictable list, as shmem does.
+static void
+opera_pin_unmap(struct address_space *mapping)
+{
+	struct pagevec pvec;
+	pgoff_t index = 0;
+
+	mapping_clear_unevictable(mapping);
+	invalidate_mapping_pages(mapping, 0, -1);
+
+	pagevec_init(&pvec);
+	while (pagevec_lookup(&pvec, mapping, &index)) {
+		check_move_unevictable_pages(pvec.pages, pagevec_count(&pvec));
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+}
+
+// Called with sbi->pin_lock held, for a pin which is not loading.
+static void
+opera_pin_free(struct opera_sb_info *sbi, struct opera_pin *pin)
+{
+	list_del(&pin->list);
+	opera_pin_unmap(pin->inode->i_mapping);
+	sbi->pin_reserved -= (uint64_t) pin->pages << PAGE_SHIFT;
+	atomic64_dec(&sbi->stats.pinned_files);
+	atomic64_sub((uint64_t) pin->pages << PAGE_SHIFT,
+			&sbi->stats.pinned_bytes);
+	iput(pin->inode);
+	kfree(pin);
+}
+
+int
+opera_pin_remove(struct super_block *sb, const char *path)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct opera_pin *pin;
+	int error = -ENOENT;
+
+	mutex_lock(&sbi->pin_lock);
+	list_for_each_entry(pin, &sbi->pins, list) {
+		if (strcmp(pin->path, path) == 0) {
+			if (pin->loading) {
+				error = -EBUSY;
+				break;
+			}
+			opera_pin_free(sbi, pin);
+			error = 0;
+			break;
+		}
+	}
+	mutex_unlock(&sbi->pin_lock);
+	return error;
+}
+
+// Pin the files named in the mount options. A file which cannot be
+// pinned does not make the mount fail.
+void
+opera_pin_mount(struct super_block *sb)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < sbi->options.num_pins; i++) {
+		error = opera_pin_add(sb, sbi->options.pins[i]);
+		if (error < 0) {
+			printk(KERN_WARNING "Opera: could not pin %s (error %d) "
+					"(disk #%08X).\n", sbi->options.pins[i], error,
+					sbi->disk_id);
+		}
+		kfree(sbi->options.pins[i]);
+		sbi->options.pins[i] = NULL;
+	}
+	sbi->options.num_pins = 0;
+}
+
+// Unpin everything. This needs to be done before the VFS gets rid of
+// the inodes at unmount, as the pins hold references to them. No pins
+// can be loading by then: the /proc files are gone, and the mount
+// options have been dealt with.
+void
+opera_pin_release(struct opera_sb_info *sbi)
+{
+	struct opera_pin *pin, *next;
+	unsigned int i;
+
+	mutex_lock(&sbi->pin_lock);
+	list_for_each_entry_safe(pin, next, &sbi->pins, list)
+		opera_pin_free(sbi, pin);
+	mutex_unlock(&sbi->pin_lock);
+
+	for (i = 0; i < sbi->options.num_pins; i++)
+		kfree(sbi->options.pins[i]);
+	sbi->options.num_pins = 0;
+}
+
+// For the 'pins' file in /proc and for show_options: call show() for
+// each pinned file.
+void
+opera_pin_show(struct opera_sb_info *sbi, struct seq_file *m,
+		void (*show)(struct seq_file *m, const char *path,
+		uint64_t bytes))
+{
+	struct opera_pin *pin;
+
+	mutex_lock(&sbi->pin_lock);
+	list_for_each_entry(pin, &sbi->pins, list) {
+		if (!pin->loading)
+			show(m, pin->path, (uint64_t) pin->pages << PAGE_SHIFT);
+	}
+	mutex_unlock(&sbi->pin_lock);
+}
+
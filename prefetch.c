@@ -0,0 +1,465 @@
+/*
+ * prefetch.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Prefetching beyond what the generic readahead does.
+//
+// Next-file prefetch (mount option prefetch_next=<KiB>): Opera discs are
+// mastered with the files one after another, and programs tend to read
+// them in that order. Readahead stops at the end of a file, so every
+// file boundary would cost a synchronous read. When a file has been read
+// sequentially up to its end, readahead is started on the file that
+// follows it on the disk, up to the configured size.
+//
+// Directory prefetch: when a lookup finds a directory, the reads of its
+// blocks are started right away, so that they are already in flight
+// when the next component of the path is looked up in it. With adaptive
+// readahead, no more blocks are read than fit in the window (see ra.c).
+//
+// Small file coalescing (mount option coalesce=<KiB>): discs often have
+// runs of many small files next to each other. When a small file is
+// read and is not cached, the small files in the same directory which
+// lie right before and after it on the disk are read as well, up to the
+// configured number of bytes in total. The reads are submitted under
+// one plug, so the block layer merges them into one large request.
+//
+// All of these are guesses, and a wrong guess takes disk time from the
+// reads that are actually needed. Together they may start no more than
+// spec_rate=<KiB> per second of reads (default 32 MiB/s, 0 for no limit);
+// beyond that, they are skipped.
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/dcache.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+struct opera_next_arg {
+	uint32_t after;  // start block of the current file
+	uint32_t best;  // lowest start block after it, so far
+	ino_t ino;  // the entry at 'best'
+};
+
+#define OPERA_PREFETCH_DIR_MAX 16
+		// Maximum number of blocks of a directory to prefetch.
+
+#define OPERA_COALESCE_SMALL 4
+		// Files of at most this many blocks count as small.
+
+struct opera_coalesce_slot {
+	ino_t ino;  // 0 if no small file starts at this block
+	uint32_t num_blocks;
+	struct inode *inode;  // set for the files to be read, but this one
+};
+
+struct opera_coalesce_arg {
+	struct opera_coalesce_slot *slots;
+			// One per block, for the blocks around the file being read.
+	uint32_t first_block;  // the block of slots[0]
+	uint32_t num_slots;
+};
+
+static int opera_spec_charge(struct opera_sb_info *sbi, uint64_t bytes);
+static unsigned long opera_readahead(struct inode *inode, loff_t size);
+static int opera_next_callback(void *data, const char *name, size_t len,
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd);
+static int opera_coalesce_callback(void *data, const char *name,
+		size_t len, ino_t ino, unsigned int type,
+		const struct opera_disk_dirent *tdd);
+
+
+//============================================================================
+
+
+// Take 'bytes' of speculative reads from the budget of the mount.
+// Returns 1 if they may be read, 0 if the budget is used up.
+static int
+opera_spec_charge(struct opera_sb_info *sbi, uint64_t bytes)
+{
+	struct opera_spec *spec = &sbi->spec;
+	uint64_t rate = sbi->options.spec_rate;
+	uint64_t now, elapsed;
+	int res = 1;
+
+	if (rate == 0)
+		return 1;
+
+	now = ktime_get_ns();
+	spin_lock(&spec->lock);
+	elapsed = min_t(uint64_t, now - spec->stamp, NSEC_PER_SEC);
+			// The bucket holds one second's worth; also keeps the
+			// multiplication below from overflowing.
+	spec->tokens = min(spec->tokens +
+			div_u64(elapsed * rate, NSEC_PER_SEC), rate);
+	spec->stamp = now;
+	if (spec->tokens >= bytes) {
+		spec->tokens -= bytes;
+	} else
+		res = 0;
+	spin_unlock(&spec->lock);
+
+	if (!res)
+		atomic64_inc(&sbi->stats.spec_throttled);
+	return res;
+}
+
+// Start reading the first 'size' bytes of a file, without waiting.
+// Returns the number of pages.
+static unsigned long
+opera_readahead(struct inode *inode, loff_t size)
+{
+	struct file_ra_state ra;
+	unsigned long pages;
+
+	pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (pages == 0)
+		return 0;
+
+	file_ra_state_init(&ra, inode->i_mapping);
+	ra.ra_pages = pages;
+	page_cache_sync_readahead(inode->i_mapping, &ra, NULL, 0, pages);
+			// Only submits the reads; does not wait for them.
+	return pages;
+}
+
+static int
+opera_next_callback(void *data, const char *name, size_t len,
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd)
+{
+	struct opera_next_arg *arg = (struct opera_next_arg *) data;
+	uint32_t start;
+
+	if (type != DT_REG)
+		return 0;
+
+	start = be32_to_cpu(tdd->copies[0]);
+	if (start > arg->after && start < arg->best) {
+		arg->best = start;
+		arg->ino = ino;
+	}
+
+	(void) name;  /* Unused variable - satisfy compiler */
+	(void) len;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+// Find the file in the same directory which follows this one on the disk.
+// The result is kept in the inode.
+static ino_t
+opera_find_next(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct opera_inode_info *info = OPERA_I(inode);
+	struct opera_next_arg arg;
+	struct dentry *parent;
+	loff_t pos = 0;
+	ino_t next;
+	int res;
+
+	next = READ_ONCE(info->next_ino);
+	if (next != 0)
+		return next;
+
+	arg.after = info->start_block;
+	arg.best = 0xffffffff;
+	arg.ino = OPERA_NEXT_NONE;
+
+	parent = dget_parent(file->f_path.dentry);
+	res = opera_for_all_entries(d_inode(parent), &pos,
+			opera_next_callback, &arg);
+	dput(parent);
+	if (res < 0)
+		return OPERA_NEXT_NONE;  // Try again next time.
+
+	WRITE_ONCE(info->next_ino, arg.ino);
+	return arg.ino;
+}
+
+// Called after each read of a regular file. 'pos' and 'len' describe
+// the read, which has already been done.
+void
+opera_prefetch_next(struct file *file, loff_t pos, size_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct inode *next;
+	unsigned long expect;
+	unsigned long pages;
+	loff_t size;
+	ino_t ino;
+
+	// file->private_data holds the offset where the next read is expected
+	// if the file is read sequentially. Files are at most 4 GiB (the size
+	// on disk is 32 bits), so it fits.
+	expect = (unsigned long) file->private_data;
+	file->private_data = (void *) (unsigned long) (pos + len);
+
+	if (sbi->options.prefetch_next == 0)
+		return;
+	if (pos != expect || pos + len < i_size_read(inode))
+		return;
+
+	ino = opera_find_next(file);
+	if (ino == OPERA_NEXT_NONE) {
+		atomic64_inc(&sbi->stats.prefetch_next_none);
+		return;
+	}
+
+	next = operafs_iget(sb, ino);
+	if (IS_ERR(next))
+		return;
+
+	if (next->i_mapping->nrpages != 0) {
+		// Already (partly) read or prefetched.
+		atomic64_inc(&sbi->stats.prefetch_next_cached);
+		goto out;
+	}
+
+	size = min_t(loff_t, i_size_read(next), sbi->options.prefetch_next);
+	if (!opera_spec_charge(sbi, size))
+		goto out;
+	pages = opera_readahead(next, size);
+	if (pages == 0)
+		goto out;
+
+	atomic64_inc(&sbi->stats.prefetch_next);
+	atomic64_add(pages << PAGE_SHIFT, &sbi->stats.prefetch_next_bytes);
+
+out:
+	iput(next);
+}
+
+// Start reading the blocks of a directory, without waiting for them.
+void
+opera_prefetch_dir(struct super_block *sb, uint32_t start_block,
+		uint32_t num_blocks)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct buffer_head *bhs[OPERA_PREFETCH_DIR_MAX];
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	unsigned int num_bhs = 0;
+	uint32_t i;
+
+	if (start_block >= sbi->block_count)
+		return;
+	if (num_blocks > sbi->block_count - start_block)
+		num_blocks = sbi->block_count - start_block;
+	num_blocks = min(num_blocks,
+			opera_ra_dir_blocks(sbi, OPERA_PREFETCH_DIR_MAX));
+
+	for (i = 0; i < num_blocks; i++) {
+		bh = sb_getblk(sb, start_block + i);
+		if (bh == NULL)
+			break;
+		if (buffer_uptodate(bh)) {
+			brelse(bh);
+			continue;
+		}
+		bhs[num_bhs++] = bh;
+	}
+	if (num_bhs == 0)
+		return;
+	if (!opera_spec_charge(sbi, (uint64_t) num_bhs << sbi->block_shift))
+		goto out;
+
+	// Submit them together, so that they can be merged into one request.
+	blk_start_plug(&plug);
+	ll_rw_block(REQ_OP_READ, REQ_RAHEAD, num_bhs, bhs);
+	blk_finish_plug(&plug);
+
+	atomic64_inc(&sbi->stats.prefetch_dir);
+	atomic64_add(num_bhs, &sbi->stats.prefetch_dir_blocks);
+out:
+	for (i = 0; i < num_bhs; i++)
+		brelse(bhs[i]);
+}
+
+static int
+opera_coalesce_callback(void *data, const char *name, size_t len,
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd)
+{
+	struct opera_coalesce_arg *arg = (struct opera_coalesce_arg *) data;
+	uint32_t start, num_blocks;
+
+	if (type != DT_REG)
+		return 0;
+
+	num_blocks = be32_to_cpu(tdd->block_count);
+	if (num_blocks == 0 || num_blocks > OPERA_COALESCE_SMALL ||
+			be32_to_cpu(tdd->byte_count) == 0)
+		return 0;
+
+	start = be32_to_cpu(tdd->copies[0]);
+	if (start < arg->first_block || start - arg->first_block >= arg->num_slots)
+		return 0;
+
+	arg->slots[start - arg->first_block].ino = ino;
+	arg->slots[start - arg->first_block].num_blocks = num_blocks;
+
+	(void) name;  /* Unused variable - satisfy compiler */
+	(void) len;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+// Called before each read of a regular file, at 'pos'.
+void
+opera_coalesce(struct file *file, loff_t pos)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct opera_inode_info *info = OPERA_I(inode);
+	struct opera_coalesce_arg arg;
+	struct opera_coalesce_slot *slot;
+	struct dentry *parent;
+	struct inode *other;
+	struct blk_plug plug;
+	struct page *page;
+	uint32_t num_blocks, cap_blocks, total;
+	uint32_t self, lo, hi, i, j;
+	uint64_t bytes;
+	loff_t dir_pos = 0;
+	int res;
+
+	if (sbi->options.coalesce == 0)
+		return;
+
+	if (test_and_clear_bit(OPERA_I_COALESCED, &info->state))
+		atomic64_inc(&sbi->stats.coalesce_hits);
+
+	num_blocks = (i_size_read(inode) + sbi->block_size - 1) >>
+			sbi->block_shift;
+	if (pos != 0 || num_blocks == 0 || num_blocks > OPERA_COALESCE_SMALL)
+		return;
+
+	page = find_get_page(inode->i_mapping, 0);
+	if (page != NULL) {
+		// Already cached (or being read).
+		put_page(page);
+		return;
+	}
+
+	cap_blocks = sbi->options.coalesce >> sbi->block_shift;
+	if (cap_blocks <= num_blocks)
+		return;
+
+	// Look at the blocks within cap_blocks on either side of the file.
+	arg.first_block = info->start_block > cap_blocks ?
+			info->start_block - cap_blocks : 0;
+	self = info->start_block - arg.first_block;
+	arg.num_slots = self + num_blocks + cap_blocks;
+	arg.slots = kcalloc(arg.num_slots, sizeof (struct opera_coalesce_slot),
+			GFP_KERNEL);
+	if (arg.slots == NULL)
+		return;
+
+	parent = dget_parent(file->f_path.dentry);
+	res = opera_for_all_entries(d_inode(parent), &dir_pos,
+			opera_coalesce_callback, &arg);
+	dput(parent);
+	if (res < 0)
+		goto out;
+
+	arg.slots[self].ino = inode->i_ino;
+	arg.slots[self].num_blocks = num_blocks;
+
+	// Grow the run [lo, hi) from this file, first forward then backward,
+	// for as long as the next small file starts right where the run ends.
+	lo = self;
+	hi = self + num_blocks;
+	total = num_blocks;
+	while (hi < arg.num_slots && arg.slots[hi].ino != 0 &&
+			total + arg.slots[hi].num_blocks <= cap_blocks) {
+		total += arg.slots[hi].num_blocks;
+		hi += arg.slots[hi].num_blocks;
+	}
+	for (;;) {
+		for (j = 1; j <= OPERA_COALESCE_SMALL && j <= lo; j++) {
+			slot = &arg.slots[lo - j];
+			if (slot->ino != 0 && slot->num_blocks == j)
+				break;
+		}
+		if (j > OPERA_COALESCE_SMALL || j > lo || total + j > cap_blocks)
+			break;
+		total += j;
+		lo -= j;
+	}
+
+	if (total == num_blocks) {
+		// No neighbours.
+		goto out;
+	}
+
+	// Get the inodes first. operafs_iget() may have to read a directory
+	// block, and that wait would flush the plug below, leaving the reads
+	// before it unmerged with those after it.
+	bytes = 0;
+	for (i = lo; i < hi; i += arg.slots[i].num_blocks) {
+		if (i == self)
+			continue;
+		other = operafs_iget(sb, arg.slots[i].ino);
+		if (IS_ERR(other))
+			continue;
+		if (other->i_mapping->nrpages != 0) {
+			iput(other);
+			continue;
+		}
+		arg.slots[i].inode = other;
+		bytes += i_size_read(other);
+	}
+	if (bytes == 0 || !opera_spec_charge(sbi, bytes))
+		goto out_iput;
+
+	blk_start_plug(&plug);
+	for (i = lo; i < hi; i += arg.slots[i].num_blocks) {
+		if (i == self) {
+			opera_readahead(inode, i_size_read(inode));
+			continue;
+		}
+
+		other = arg.slots[i].inode;
+		if (other == NULL)
+			continue;
+		opera_readahead(other, i_size_read(other));
+		set_bit(OPERA_I_COALESCED, &OPERA_I(other)->state);
+		atomic64_inc(&sbi->stats.coalesce_files);
+		atomic64_add(i_size_read(other), &sbi->stats.coalesce_bytes);
+	}
+	blk_finish_plug(&plug);
+	atomic64_inc(&sbi->stats.coalesce);
+
+out_iput:
+	for (i = lo; i < hi; i += arg.slots[i].num_blocks) {
+		if (arg.slots[i].inode != NULL)
+			iput(arg.slots[i].inode);
+	}
+out:
+	kfree(arg.slots);
+}
+
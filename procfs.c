@@ -0,0 +1,304 @@
+/*
+ * procfs.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Per-mount information in /proc/fs/opera/<device>/:
+//   trace   the access trace (see trace.c)
+//   stats   counters, one 'name value' pair per line
+//   pins    the pinned files, as 'bytes path' (see pin.c); write a path
+//           to pin a file, or '-' and a path to unpin one
+//   ra      the last decisions of the adaptive readahead (see ra.c)
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+static int opera_trace_open(struct inode *inode, struct file *file);
+static int opera_stats_open(struct inode *inode, struct file *file);
+static int opera_stats_show(struct seq_file *m, void *v);
+static int opera_pins_open(struct inode *inode, struct file *file);
+static int opera_pins_show(struct seq_file *m, void *v);
+static void opera_pins_show_one(struct seq_file *m, const char *path,
+		uint64_t bytes);
+static ssize_t opera_pins_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos);
+static int opera_ra_open_proc(struct inode *inode, struct file *file);
+static int opera_ra_proc_show(struct seq_file *m, void *v);
+
+
+//============================================================================
+
+
+static struct proc_dir_entry *opera_proc_root;
+		// /proc/fs/opera
+
+static const struct file_operations opera_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = opera_trace_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
+
+static const struct file_operations opera_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = opera_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations opera_pins_fops = {
+	.owner = THIS_MODULE,
+	.open = opera_pins_open,
+	.read = seq_read,
+	.write = opera_pins_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations opera_ra_fops = {
+	.owner = THIS_MODULE,
+	.open = opera_ra_open_proc,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+//============================================================================
+
+
+int
+opera_proc_init(void)
+{
+	opera_proc_root = proc_mkdir("fs/opera", NULL);
+	if (opera_proc_root == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void
+opera_proc_exit(void)
+{
+	remove_proc_entry("fs/opera", NULL);
+}
+
+int
+opera_proc_register(struct super_block *sb)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+
+	sbi->proc_dir = proc_mkdir(sb->s_id, opera_proc_root);
+	if (sbi->proc_dir == NULL)
+		return -ENOMEM;
+
+	// The trace shows the file names and access patterns of every user;
+	// keep it readable by root only.
+	if (proc_create_data("trace", S_IRUSR, sbi->proc_dir,
+			&opera_trace_fops, sb) == NULL)
+		goto out_err;
+	if (proc_create_data("stats", S_IRUGO, sbi->proc_dir,
+			&opera_stats_fops, sb) == NULL)
+		goto out_err;
+	if (proc_create_data("pins", S_IRUGO | S_IWUSR, sbi->proc_dir,
+			&opera_pins_fops, sb) == NULL)
+		goto out_err;
+	if (proc_create_data("ra", S_IRUGO, sbi->proc_dir,
+			&opera_ra_fops, sb) == NULL)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	proc_remove(sbi->proc_dir);
+	sbi->proc_dir = NULL;
+	return -ENOMEM;
+}
+
+void
+opera_proc_unregister(struct super_block *sb)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+
+	if (sbi->proc_dir == NULL)
+		return;
+	proc_remove(sbi->proc_dir);
+	sbi->proc_dir = NULL;
+}
+
+static int
+opera_trace_open(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = (struct super_block *) PDE_DATA(inode);
+	int res;
+
+	res = seq_open(file, &opera_trace_seq_ops);
+	if (res == 0)
+		((struct seq_file *) file->private_data)->private = OPERA_SB(sb);
+	return res;
+}
+
+static int
+opera_stats_open(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = (struct super_block *) PDE_DATA(inode);
+
+	return single_open(file, opera_stats_show, OPERA_SB(sb));
+}
+
+static int
+opera_stats_show(struct seq_file *m, void *v)
+{
+	struct opera_sb_info *sbi = (struct opera_sb_info *) m->private;
+	struct opera_stats *stats = &sbi->stats;
+
+	seq_printf(m, "prefetch_next %lld\n",
+			(long long) atomic64_read(&stats->prefetch_next));
+	seq_printf(m, "prefetch_next_bytes %lld\n",
+			(long long) atomic64_read(&stats->prefetch_next_bytes));
+	seq_printf(m, "prefetch_next_cached %lld\n",
+			(long long) atomic64_read(&stats->prefetch_next_cached));
+	seq_printf(m, "prefetch_next_none %lld\n",
+			(long long) atomic64_read(&stats->prefetch_next_none));
+	seq_printf(m, "prefetch_dir %lld\n",
+			(long long) atomic64_read(&stats->prefetch_dir));
+	seq_printf(m, "prefetch_dir_blocks %lld\n",
+			(long long) atomic64_read(&stats->prefetch_dir_blocks));
+	seq_printf(m, "coalesce %lld\n",
+			(long long) atomic64_read(&stats->coalesce));
+	seq_printf(m, "coalesce_files %lld\n",
+			(long long) atomic64_read(&stats->coalesce_files));
+	seq_printf(m, "coalesce_bytes %lld\n",
+			(long long) atomic64_read(&stats->coalesce_bytes));
+	seq_printf(m, "coalesce_hits %lld\n",
+			(long long) atomic64_read(&stats->coalesce_hits));
+	seq_printf(m, "spec_throttled %lld\n",
+			(long long) atomic64_read(&stats->spec_throttled));
+	seq_printf(m, "pinned_files %lld\n",
+			(long long) atomic64_read(&stats->pinned_files));
+	seq_printf(m, "pinned_bytes %lld\n",
+			(long long) atomic64_read(&stats->pinned_bytes));
+	seq_printf(m, "pin_max %llu\n",
+			(unsigned long long) sbi->options.pin_max);
+	seq_printf(m, "ra_window %lu\n",
+			(unsigned long) READ_ONCE(sbi->ra.window) << PAGE_SHIFT);
+	seq_printf(m, "ra_min %u\n", sbi->options.ra_min);
+	seq_printf(m, "ra_max %u\n", sbi->options.ra_max);
+	seq_printf(m, "ra_reads %lld\n",
+			(long long) atomic64_read(&stats->ra_reads));
+	seq_printf(m, "ra_hits %lld\n",
+			(long long) atomic64_read(&stats->ra_hits));
+	seq_printf(m, "ra_misses %lld\n",
+			(long long) atomic64_read(&stats->ra_misses));
+	seq_printf(m, "ra_miss_us %lld\n",
+			(long long) atomic64_read(&stats->ra_miss_us));
+	seq_printf(m, "ra_grow %lld\n",
+			(long long) atomic64_read(&stats->ra_grow));
+	seq_printf(m, "ra_shrink %lld\n",
+			(long long) atomic64_read(&stats->ra_shrink));
+	seq_printf(m, "ra_trim %lld\n",
+			(long long) atomic64_read(&stats->ra_trim));
+	seq_printf(m, "ra_hold %lld\n",
+			(long long) atomic64_read(&stats->ra_hold));
+	opera_meta_stats(sbi, m);
+
+	(void) v;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+static int
+opera_pins_open(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = (struct super_block *) PDE_DATA(inode);
+
+	return single_open(file, opera_pins_show, sb);
+}
+
+static int
+opera_pins_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = (struct super_block *) m->private;
+
+	opera_pin_show(OPERA_SB(sb), m, opera_pins_show_one);
+
+	(void) v;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+static void
+opera_pins_show_one(struct seq_file *m, const char *path, uint64_t bytes)
+{
+	seq_printf(m, "%llu %s\n", (unsigned long long) bytes, path);
+}
+
+static ssize_t
+opera_pins_write(struct file *file, const char __user *buf, size_t count,
+		loff_t *ppos)
+{
+	struct super_block *sb = (struct super_block *)
+			((struct seq_file *) file->private_data)->private;
+	char *path, *str;
+	int error;
+
+	if (count == 0 || count >= PATH_MAX)
+		return -EINVAL;
+
+	str = memdup_user_nul(buf, count);
+	if (IS_ERR(str))
+		return PTR_ERR(str);
+	path = strim(str);
+
+	if (path[0] == '-') {
+		error = opera_pin_remove(sb, path + 1);
+	} else
+		error = opera_pin_add(sb, path);
+	kfree(str);
+
+	(void) ppos;  /* Unused variable - satisfy compiler */
+	return error < 0 ? error : count;
+}
+
+static int
+opera_ra_open_proc(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = (struct super_block *) PDE_DATA(inode);
+
+	return single_open(file, opera_ra_proc_show, OPERA_SB(sb));
+}
+
+static int
+opera_ra_proc_show(struct seq_file *m, void *v)
+{
+	struct opera_sb_info *sbi = (struct opera_sb_info *) m->private;
+
+	opera_ra_show(sbi, m);
+
+	(void) v;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
@@ -0,0 +1,377 @@
+/*
+ * ra.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Adaptive readahead.
+//
+// The same disk may be mounted from a CD drive, where every seek costs
+// many milliseconds and large readahead windows pay off, or from an
+// image on fast storage, where they only take up memory. With the mount
+// option ra_max=<KiB>, the readahead window of the mount is adjusted to
+// the device, between ra_min=<KiB> and ra_max.
+//
+// Reads of files and of directory blocks are sampled: whether the data
+// was already in memory (a hit), and if not, how long the read had to
+// wait for it. For reads which continue where the previous read of the
+// same file (or directory) ended, a hit means that readahead kept up.
+//
+// A miss waits for the whole read that it started, which for a file is
+// as large as the window. On a device limited by bandwidth rather than
+// by seeks, the wait would grow with the window, and growing the window
+// would feed on itself. So the waits are split into a fixed latency and
+// a transfer time per KiB, by a least squares fit of wait against size
+// over the recent misses; only the latency counts. Until the misses come
+// in different sizes, the transfer time from the last fit is used (none
+// at first).
+//
+// After every OPERA_RA_EPOCH samples the window is adjusted:
+//  - grow (double) when more than 1/8 of the sequential reads missed,
+//    and the latency of the misses is above ra_lat=<usec>;
+//  - shrink (halve) when the latency is below ra_lat / 4; the device
+//    is fast enough to read on demand;
+//  - trim (by 1/8) when nothing missed, to find out whether a smaller
+//    window would do as well;
+//  - hold otherwise.
+// The window is used for file reads and mmap, and limits the directory
+// prefetch of lookups (prefetch.c).
+//
+// The current window and the counters are in /proc/fs/opera/<device>/
+// stats; the last OPERA_RA_LOG decisions are in .../ra, oldest first:
+//   <ms since mount> <decision> <old KiB> <new KiB> <reads> <hits>
+//   <misses> <miss latency in usec, without the transfer time>
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/backing-dev.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+#define OPERA_RA_EPOCH 32
+		// Number of samples between decisions.
+
+#define OPERA_RA_FIT_WEIGHT 16
+		// Weight of one miss in the fit sums; more than 1, so that
+		// halving them keeps some precision.
+#define OPERA_RA_FIT_MAX_NS (50 * NSEC_PER_MSEC)
+		// Waits are capped at this for the fit, which keeps the sums
+		// from overflowing. Longer waits are well above any ra_lat.
+
+static const char *const opera_ra_decision_names[] = {
+	[OPERA_RA_GROW] = "grow",
+	[OPERA_RA_SHRINK] = "shrink",
+	[OPERA_RA_TRIM] = "trim",
+	[OPERA_RA_HOLD] = "hold",
+};
+
+static void opera_ra_account(struct opera_sb_info *sbi, int seq, int hit,
+		uint64_t ns, uint32_t bytes);
+static unsigned int opera_ra_latency(struct opera_ra *ra);
+static void opera_ra_decide(struct opera_sb_info *sbi);
+
+
+//============================================================================
+
+
+int
+opera_ra_init(struct opera_sb_info *sbi)
+{
+	struct opera_ra *ra = &sbi->ra;
+	struct opera_fs_options *options = &sbi->options;
+
+	memset(ra, '\0', sizeof *ra);
+	spin_lock_init(&ra->lock);
+	ra->start = ktime_get_ns();
+
+	if (options->ra_max == 0)
+		return 0;
+
+	if (options->ra_min > options->ra_max) {
+		printk(KERN_ERR "Opera: ra_min (%u KiB) is larger than ra_max "
+				"(%u KiB).\n", options->ra_min / 1024,
+				options->ra_max / 1024);
+		return -EINVAL;
+	}
+
+	ra->min_pages = max_t(unsigned int, options->ra_min >> PAGE_SHIFT, 1);
+	ra->max_pages = max_t(unsigned int, options->ra_max >> PAGE_SHIFT, 1);
+	// Start from what the device would have used.
+	ra->window = clamp_t(unsigned int, sbi->sb->s_bdi->ra_pages,
+			ra->min_pages, ra->max_pages);
+	return 0;
+}
+
+// Called before each read of a regular file, at 'pos'.
+void
+opera_ra_begin(struct file *file, loff_t pos, struct opera_ra_sample *sample)
+{
+	struct inode *inode = file_inode(file);
+	struct opera_sb_info *sbi = OPERA_SB(inode->i_sb);
+	unsigned int window = READ_ONCE(sbi->ra.window);
+	struct page *page;
+
+	sample->start = 0;
+	if (window == 0)
+		return;
+
+	file->f_ra.ra_pages = window;
+	if (pos >= i_size_read(inode))
+		return;
+
+	// file->private_data holds where the previous read ended; see
+	// opera_prefetch_next().
+	sample->seq = pos != 0 && pos == (unsigned long) file->private_data;
+	// A miss starts (synchronous) readahead of the window from here,
+	// up to the end of the file.
+	sample->bytes = min_t(loff_t, (loff_t) window << PAGE_SHIFT,
+			i_size_read(inode) - pos);
+	page = find_get_page(inode->i_mapping, pos >> PAGE_SHIFT);
+	sample->hit = page != NULL && PageUptodate(page);
+	if (page != NULL)
+		put_page(page);
+	sample->start = ktime_get_ns();
+}
+
+// Called after the read of opera_ra_begin(); 'res' is its result.
+void
+opera_ra_end(struct file *file, const struct opera_ra_sample *sample,
+		ssize_t res)
+{
+	struct opera_sb_info *sbi = OPERA_SB(file_inode(file)->i_sb);
+
+	if (sample->start == 0 || res <= 0)
+		return;
+
+	opera_ra_account(sbi, sample->seq, sample->hit,
+			sample->hit ? 0 : ktime_get_ns() - sample->start,
+			sample->bytes);
+}
+
+// Set the readahead window of a newly opened file.
+void
+opera_ra_open(struct file *file)
+{
+	struct opera_sb_info *sbi = OPERA_SB(file_inode(file)->i_sb);
+	unsigned int window = READ_ONCE(sbi->ra.window);
+
+	if (window != 0)
+		file->f_ra.ra_pages = window;
+}
+
+// sb_bread() for directory blocks, with sampling. 'seq' should be set
+// if the previous block of the same directory was read just before.
+struct buffer_head *
+opera_ra_bread(struct super_block *sb, sector_t block, int seq)
+{
+	struct opera_sb_info *sbi = OPERA_SB(sb);
+	struct buffer_head *bh;
+	uint64_t start;
+
+	if (READ_ONCE(sbi->ra.window) == 0)
+		return sb_bread(sb, block);
+
+	bh = sb_getblk(sb, block);
+	if (bh == NULL)
+		return NULL;
+	if (buffer_uptodate(bh)) {
+		opera_ra_account(sbi, seq, 1, 0, 0);
+		return bh;
+	}
+
+	start = ktime_get_ns();
+	ll_rw_block(REQ_OP_READ, 0, 1, &bh);
+			// Does nothing if a prefetch of the block is in flight.
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	opera_ra_account(sbi, seq, 0, ktime_get_ns() - start, sbi->block_size);
+	return bh;
+}
+
+// Maximum number of blocks of a directory to prefetch, at most 'limit'.
+unsigned int
+opera_ra_dir_blocks(struct opera_sb_info *sbi, unsigned int limit)
+{
+	unsigned int window = READ_ONCE(sbi->ra.window);
+	unsigned int blocks;
+
+	if (window == 0)
+		return limit;
+	blocks = ((unsigned long) window << PAGE_SHIFT) >> sbi->block_shift;
+	return clamp_t(unsigned int, blocks, 1, limit);
+}
+
+static void
+opera_ra_account(struct opera_sb_info *sbi, int seq, int hit, uint64_t ns,
+		uint32_t bytes)
+{
+	struct opera_ra *ra = &sbi->ra;
+	int64_t s, t;
+
+	if (seq) {
+		atomic64_inc(&sbi->stats.ra_reads);
+		if (hit)
+			atomic64_inc(&sbi->stats.ra_hits);
+	}
+	if (!hit) {
+		atomic64_inc(&sbi->stats.ra_misses);
+		atomic64_add(div_u64(ns, 1000), &sbi->stats.ra_miss_us);
+	}
+
+	spin_lock(&ra->lock);
+	if (seq) {
+		ra->reads++;
+		if (hit)
+			ra->hits++;
+	}
+	if (!hit) {
+		ra->misses++;
+		ra->miss_ns += ns;
+
+		s = DIV_ROUND_UP(bytes, 1024);
+		t = min_t(uint64_t, ns, OPERA_RA_FIT_MAX_NS);
+		ra->fit_n += OPERA_RA_FIT_WEIGHT;
+		ra->fit_s += OPERA_RA_FIT_WEIGHT * s;
+		ra->fit_t += OPERA_RA_FIT_WEIGHT * t;
+		ra->fit_ss += OPERA_RA_FIT_WEIGHT * s * s;
+		ra->fit_st += OPERA_RA_FIT_WEIGHT * s * t;
+	}
+	if (ra->reads + ra->misses >= OPERA_RA_EPOCH)
+		opera_ra_decide(sbi);
+	spin_unlock(&ra->lock);
+}
+
+// Latency in usec of the recent misses, without their transfer time.
+// Called with ra->lock held.
+static unsigned int
+opera_ra_latency(struct opera_ra *ra)
+{
+	int64_t det, per_kib, lat;
+
+	if (ra->fit_n == 0)
+		return 0;
+
+	// Least squares: per_kib = cov(s, t) / var(s), scaled by n^2.
+	// The sums are bounded by OPERA_RA_FIT_MAX_NS, the window size and
+	// the number of samples, so that these products fit in 63 bits.
+	det = ra->fit_n * ra->fit_ss - ra->fit_s * ra->fit_s;
+	if (det > ra->fit_n * ra->fit_n) {
+		// The sizes vary by more than 1 KiB; the fit means something.
+		per_kib = div64_s64(ra->fit_n * ra->fit_st - ra->fit_s * ra->fit_t,
+				det);
+		ra->per_kib = clamp_t(int64_t, per_kib, 0, OPERA_RA_FIT_MAX_NS);
+	}
+
+	lat = div64_s64(ra->fit_t - ra->per_kib * ra->fit_s, ra->fit_n);
+	return lat <= 0 ? 0 : div_u64(lat, 1000);
+}
+
+// Called with ra->lock held.
+static void
+opera_ra_decide(struct opera_sb_info *sbi)
+{
+	struct opera_ra *ra = &sbi->ra;
+	struct opera_ra_decision *d;
+	unsigned int window = ra->window;
+	unsigned int lat_us;
+	int decision;
+
+	lat_us = ra->misses == 0 ? 0 : opera_ra_latency(ra);
+	if (ra->misses != 0 && lat_us >= sbi->options.ra_lat &&
+			(ra->reads - ra->hits) * 8 > ra->reads) {
+		decision = OPERA_RA_GROW;
+		window = min(window * 2, ra->max_pages);
+	} else if (ra->misses != 0 && lat_us < sbi->options.ra_lat / 4) {
+		decision = OPERA_RA_SHRINK;
+		window = max(window / 2, ra->min_pages);
+	} else if (ra->misses == 0) {
+		decision = OPERA_RA_TRIM;
+		window = max(window - max(window / 8, 1U), ra->min_pages);
+	} else
+		decision = OPERA_RA_HOLD;
+
+	d = &ra->log[ra->log_next];
+	d->time = ktime_get_ns() - ra->start;
+	d->decision = decision;
+	d->old_window = ra->window;
+	d->new_window = window;
+	d->reads = ra->reads;
+	d->hits = ra->hits;
+	d->misses = ra->misses;
+	d->lat_us = lat_us;
+	ra->log_next = (ra->log_next + 1) % OPERA_RA_LOG;
+	ra->log_count++;
+
+	switch (decision) {
+		case OPERA_RA_GROW:
+			atomic64_inc(&sbi->stats.ra_grow);
+			break;
+		case OPERA_RA_SHRINK:
+			atomic64_inc(&sbi->stats.ra_shrink);
+			break;
+		case OPERA_RA_TRIM:
+			atomic64_inc(&sbi->stats.ra_trim);
+			break;
+		default:
+			atomic64_inc(&sbi->stats.ra_hold);
+			break;
+	}
+
+	WRITE_ONCE(ra->window, window);
+	ra->reads = 0;
+	ra->hits = 0;
+	ra->misses = 0;
+	ra->miss_ns = 0;
+	ra->fit_n /= 2;
+	ra->fit_s /= 2;
+	ra->fit_t /= 2;
+	ra->fit_ss /= 2;
+	ra->fit_st /= 2;
+}
+
+// For the 'ra' file in /proc.
+void
+opera_ra_show(struct opera_sb_info *sbi, struct seq_file *m)
+{
+	struct opera_ra *ra = &sbi->ra;
+	const struct opera_ra_decision *d;
+	unsigned int i, n;
+
+	spin_lock(&ra->lock);
+	n = min_t(uint64_t, ra->log_count, OPERA_RA_LOG);
+	for (i = 0; i < n; i++) {
+		d = &ra->log[(ra->log_next + OPERA_RA_LOG - n + i) % OPERA_RA_LOG];
+		seq_printf(m, "%llu %s %lu %lu %u %u %u %u\n",
+				(unsigned long long) div_u64(d->time, 1000000),
+				opera_ra_decision_names[d->decision],
+				(unsigned long) d->old_window << (PAGE_SHIFT - 10),
+				(unsigned long) d->new_window << (PAGE_SHIFT - 10),
+				d->reads, d->hits, d->misses, d->lat_us);
+	}
+	spin_unlock(&ra->lock);
+}
+
@@ -35,6 +35,8 @@ static void opera_put_super(struct super_block *sb);
 static int opera_statfs(struct dentry *dentry, struct kstatfs *buf);
 static int opera_remount(struct super_block *sb, int *flags, char *data);
 static int opera_show_options(struct seq_file *out, struct vfsmount *mnt);
+static void opera_show_pin(struct seq_file *out, const char *path,
+		uint64_t bytes);
 
 
 //============================================================================
@@ -61,6 +63,9 @@ opera_alloc_inode(struct super_block *sb)
 			opera_inode_cache, GFP_KERNEL);
 	if (!info)
 		return NULL;
+	info->copies = NULL;
+	info->next_ino = 0;
+	info->state = 0;
 	(void) sb;  /* Unused variable - satisfy compiler */
 	return &info->vfs_inode;
 }
@@ -68,7 +73,84 @@ opera_alloc_inode(struct super_block *sb)
 static void
 opera_destroy_inode(struct inode *inode)
 {
-	kmem_cache_free(opera_inode_cache, OPERA_I(inode));
+	struct opera_inode_info *info = OPERA_I(inode);
+
+	if (info->copies != &info->start_block)
+		kfree(info->copies);
+	kmem_cache_free(opera_inode_cache, info);
+}
+
+// Store the list of copies of an entry in the inode.
+// disk_copies points to the (big-endian) copies array as found on the
+// disk, containing last_copy + 1 entries.
+int
+opera_set_copies(struct inode *inode, uint32_t last_copy,
+		const uint32_t *disk_copies)
+{
+	struct opera_inode_info *info = OPERA_I(inode);
+	uint32_t i;
+
+	info->start_block = be32_to_cpu(disk_copies[0]);
+	info->last_copy = last_copy;
+	if (last_copy == 0) {
+		// The common case. No need to allocate anything.
+		info->copies = &info->start_block;
+		return 0;
+	}
+
+	info->copies = kmalloc_array(last_copy + 1, sizeof (uint32_t),
+			GFP_KERNEL);
+	if (info->copies == NULL)
+		return -ENOMEM;
+	for (i = 0; i <= last_copy; i++)
+		info->copies[i] = be32_to_cpu(disk_copies[i]);
+	return 0;
+}
+
+// Fill in a new inode from its directory entry.
+static int
+opera_read_inode(struct inode *inode, const struct opera_disk_dirent *tdd)
+{
+	struct opera_sb_info *sbi = OPERA_SB(inode->i_sb);
+	int ret;
+
+	inode->i_uid = sbi->options.uid;
+	inode->i_gid = sbi->options.gid;
+	inode->i_mtime.tv_sec = 0;
+	inode->i_mtime.tv_nsec = 0;
+	inode->i_atime.tv_sec = 0;
+	inode->i_atime.tv_nsec = 0;
+	inode->i_ctime.tv_sec = 0;
+	inode->i_ctime.tv_nsec = 0;
+	
+	inode->i_blocks = be32_to_cpu(tdd->block_count);
+
+	OPERA_I(inode)->id = be32_to_cpu(tdd->id);
+	OPERA_I(inode)->flags = be32_to_cpu(tdd->flags);
+	memcpy(OPERA_I(inode)->type, tdd->type, sizeof OPERA_I(inode)->type);
+	ret = opera_set_copies(inode, be32_to_cpu(tdd->last_copy), tdd->copies);
+	if (ret < 0)
+		return ret;
+
+	if (OPERA_DIRENT_TYPE(be32_to_cpu(tdd->flags)) == OPERA_DIRENT_DIR) {
+		// is a directory
+		inode->i_mode = (S_IRWXUGO & ~sbi->options.dmask) | S_IFDIR;
+		inode->i_op = &opera_dir_inode_operations;
+		inode->i_fop = &opera_dir_operations;
+		inode->i_size = be32_to_cpu(tdd->block_count) *
+				be32_to_cpu(tdd->block_size);
+		set_nlink(inode, 2); 
+		inc_nlink(opera_count_dirs(inode));
+	} else {
+		// is a file (possibly a special file)
+		set_nlink(inode, 1); 
+		inode->i_mode = ((S_IRUGO | S_IWUGO) & ~sbi->options.fmask) | S_IFREG;
+		inode->i_op = &opera_file_inode_operations;
+		inode->i_fop = &opera_file_operations;
+		inode->i_size = be32_to_cpu(tdd->byte_count);
+		inode->i_mapping->a_ops = &opera_address_operations;
+	}
+	return 0;
 }
 
 struct inode *
@@ -125,38 +207,23 @@ operafs_iget(struct super_block *sb, unsigned long ino)
 
 	tdd = (const struct opera_disk_dirent *) ((char *) bh->b_data + off);
 
-	inode->i_uid = sbi->options.uid;
-	inode->i_gid = sbi->options.gid;
-	inode->i_mtime.tv_sec = 0;
-	inode->i_mtime.tv_nsec = 0;
-	inode->i_atime.tv_sec = 0;
-	inode->i_atime.tv_nsec = 0;
-	inode->i_ctime.tv_sec = 0;
-	inode->i_ctime.tv_nsec = 0;
-	
-	inode->i_blocks = be32_to_cpu(tdd->block_count);
-
-	OPERA_I(inode)->start_block = be32_to_cpu(tdd->copies[0]);
-	if (OPERA_DIRENT_TYPE(be32_to_cpu(tdd->flags)) == OPERA_DIRENT_DIR) {
-		// is a directory
-		inode->i_mode = (S_IRWXUGO & ~sbi->options.dmask) | S_IFDIR;
-		inode->i_op = &opera_dir_inode_operations;
-		inode->i_fop = &opera_dir_operations;
-		inode->i_size = be32_to_cpu(tdd->block_count) *
-				be32_to_cpu(tdd->block_size);
-		set_nlink(inode, 2); 
-		inc_nlink(opera_count_dirs(inode));
-	} else {
-		// is a file (possibly a special file)
-		set_nlink(inode, 1); 
-		inode->i_mode = ((S_IRUGO | S_IWUGO) & ~sbi->options.fmask) | S_IFREG;
-		inode->i_op = &opera_file_inode_operations;
-		inode->i_fop = &opera_file_operations;
-		inode->i_size = be32_to_cpu(tdd->byte_count);
-		inode->i_mapping->a_ops = &opera_address_operations;
+	// Check last_copy before multiplying; a huge value would make the
+	// size wrap around.
+	if (off + 72 > sbi->block_size || be32_to_cpu(tdd->last_copy) >
+			(sbi->block_size - off - 72) / 4) {
+		printk(KERN_ERR "Opera: directory entry in block %d does not fit "
+				"in the block (pos=%d, block_size=%d, disk #%08X).\n",
+				block, off, sbi->block_size, sbi->disk_id);
+		brelse(bh);
+		ret = -EIO;
+		goto out_err;
 	}
 
+	ret = opera_read_inode(inode, tdd);
 	brelse(bh);
+	if (ret < 0)
+		goto out_err;
+
 	unlock_new_inode(inode);
 	return inode;
 
@@ -165,12 +232,44 @@ out_err:
 	return ERR_PTR(ret);
 }
 
+// Like operafs_iget(), but for when the caller already has the
+// directory entry at hand (as checked by opera_for_all_entries()),
+// so that no block needs to be read.
+struct inode *
+operafs_iget_dirent(struct super_block *sb, unsigned long ino,
+		const struct opera_disk_dirent *tdd)
+{
+	struct inode *inode;
+	int ret;
+
+	inode = iget_locked(sb, ino);
+	if (inode == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	if (!(inode->i_state & I_NEW)) {
+		// We already have an inode for 'ino'.
+		return inode;
+	}
+
+	ret = opera_read_inode(inode, tdd);
+	if (ret < 0) {
+		iget_failed(inode);
+		return ERR_PTR(ret);
+	}
+
+	unlock_new_inode(inode);
+	return inode;
+}
+
 static void
 opera_put_super(struct super_block *sb)
 {
 	struct opera_sb_info *sbi = OPERA_SB(sb);
 
+	opera_proc_unregister(sb);
 	sb->s_fs_info = NULL;
+	opera_meta_detach(sbi);
+	opera_trace_free(sbi);
 	kfree(sbi);
 }
 	
@@ -219,7 +318,37 @@ opera_show_options(struct seq_file *out, struct vfsmount *mnt)
 		} else
 			seq_printf(out, ",hidespecial");
 	}
+	if (options->prepopulate != 0)
+		seq_printf(out, ",prepopulate=%u", options->prepopulate / 1024);
+	if (options->trace != 0)
+		seq_printf(out, ",trace=%u", options->trace);
+	if (options->prefetch_next != 0)
+		seq_printf(out, ",prefetch_next=%u", options->prefetch_next / 1024);
+	if (options->coalesce != 0)
+		seq_printf(out, ",coalesce=%u", options->coalesce / 1024);
+	if (options->spec_rate != OPERA_DEFAULT_SPEC_RATE)
+		seq_printf(out, ",spec_rate=%u", options->spec_rate / 1024);
+	if (options->share)
+		seq_printf(out, ",share");
+	if (options->pin_max != OPERA_DEFAULT_PIN_MAX)
+		seq_printf(out, ",pin_max=%llu",
+				(unsigned long long) options->pin_max / 1024);
+	if (options->ra_max != 0) {
+		seq_printf(out, ",ra_min=%u,ra_max=%u", options->ra_min / 1024,
+				options->ra_max / 1024);
+		if (options->ra_lat != OPERA_DEFAULT_RA_LAT)
+			seq_printf(out, ",ra_lat=%u", options->ra_lat);
+	}
+	opera_pin_show(sbi, out, opera_show_pin);
 	return 0;
 }
 
+static void
+opera_show_pin(struct seq_file *out, const char *path, uint64_t bytes)
+{
+	seq_puts(out, ",pin=");
+	seq_escape(out, path, ", \t\n\\");
+	(void) bytes;  /* Unused variable - satisfy compiler */
+}
+
 
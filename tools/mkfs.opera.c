@@ -0,0 +1,792 @@
+/*
+ * mkfs.opera.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Build an Opera image from a directory tree.
+//
+// Usage: mkfs.opera [-b block_size] [-c copies] [-l label] [-C comment]
+//                   [-i disk_id] [-o order_file] [-j threads]
+//                   <srcdir> <image>
+//
+// Layout of the image:
+//   block 0            the superblock
+//   directories        all of them, root first, breadth first
+//   files              those named in the order file first, in that
+//                      order, then the rest in depth-first tree order
+//   replicas           copies 1 .. copies-1 of the directories and
+//                      files, in the same order
+// Putting the files in the order they are loaded makes the reads of a
+// title mostly sequential, which is what counts on optical and network
+// storage.
+//
+// The order file holds one path per line, relative to <srcdir>.
+// Directories cannot be empty on an Opera disc (the driver expects at
+// least one entry), so empty source directories are left out.
+//
+// The file contents are copied into the image by a pool of threads.
+// When done, the image is read back with the same checks as the driver
+// uses in opera_fill_super() and opera_for_all_entries().
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "opera_image.h"
+
+
+//============================================================================
+
+
+#define MKFS_MAX_COPIES NUM_COPIES_ROOT
+		// The root directory can't have more copies than this, so we
+		// use the same limit for everything.
+
+#define MKFS_DIR_HEADER_SIZE 0x14
+		// sizeof (struct opera_disk_dir_header)
+
+struct mkfs_node {
+	char name[OPERA_NAME_MAX + 1];
+	char *src;  // path of the source file or directory
+	char *path;  // path relative to the source root
+	int is_dir;
+	uint32_t id;
+	uint32_t byte_count;
+	uint32_t block_count;
+			// For directories, the number of directory blocks.
+	uint32_t copies[MKFS_MAX_COPIES];
+	int placed;  // files: already given a position
+	struct mkfs_node **children;
+	size_t num_children;
+};
+
+struct mkfs_job {
+	const struct mkfs_node *node;
+	uint64_t offset;  // destination in the image, in bytes
+};
+
+struct mkfs {
+	uint32_t block_size;
+	uint32_t num_copies;
+	uint32_t disk_id;
+	const char *label;
+	const char *comment;
+	uint32_t next_id;
+
+	struct mkfs_node *root;
+	struct mkfs_node **dirs;  // breadth first
+	size_t num_dirs;
+	struct mkfs_node **files;  // in the order they will be placed
+	size_t num_files;
+	size_t max_files;
+
+	int img_fd;
+	uint32_t block_count;
+
+	struct mkfs_job *jobs;
+	size_t num_jobs;
+	size_t next_job;
+	pthread_mutex_t lock;
+	int errors;
+};
+
+static struct mkfs_node *mkfs_scan(struct mkfs *fs, const char *src,
+		const char *path, const char *name);
+static int mkfs_read_order(struct mkfs *fs, const char *order_file);
+static void mkfs_layout(struct mkfs *fs);
+static int mkfs_write_metadata(struct mkfs *fs);
+static int mkfs_copy_files(struct mkfs *fs, long num_threads);
+static int mkfs_verify(const char *image, size_t expected_entries);
+
+
+//============================================================================
+
+
+static inline uint32_t
+mkfs_entry_size(const struct mkfs *fs)
+{
+	return 72 + 4 * (fs->num_copies - 1);
+}
+
+static int
+mkfs_cmp_node_name(const void *a, const void *b)
+{
+	const struct mkfs_node *na = *(const struct mkfs_node * const *) a;
+	const struct mkfs_node *nb = *(const struct mkfs_node * const *) b;
+
+	return strcmp(na->name, nb->name);
+}
+
+static char *
+mkfs_join(const char *a, const char *b)
+{
+	char *res;
+
+	if (*a == '\0')
+		return strdup(b);
+	if (asprintf(&res, "%s/%s", a, b) == -1)
+		return NULL;
+	return res;
+}
+
+static void
+mkfs_add_file(struct mkfs *fs, struct mkfs_node *node)
+{
+	if (fs->num_files == fs->max_files) {
+		fs->max_files = fs->max_files == 0 ? 1024 : 2 * fs->max_files;
+		fs->files = realloc(fs->files,
+				fs->max_files * sizeof (struct mkfs_node *));
+		if (fs->files == NULL) {
+			perror("mkfs.opera");
+			exit(1);
+		}
+	}
+	fs->files[fs->num_files++] = node;
+}
+
+// Read the source tree. Returns NULL for entries to be left out.
+static struct mkfs_node *
+mkfs_scan(struct mkfs *fs, const char *src, const char *path,
+		const char *name)
+{
+	struct mkfs_node *node;
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	struct mkfs_node *child;
+
+	if (stat(src, &st) == -1) {
+		fprintf(stderr, "mkfs.opera: %s: %s\n", src, strerror(errno));
+		exit(1);
+	}
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "mkfs.opera: %s: not a regular file or "
+				"directory; skipped.\n", src);
+		return NULL;
+	}
+	if (strlen(name) > OPERA_NAME_MAX) {
+		fprintf(stderr, "mkfs.opera: %s: name longer than %d "
+				"characters; skipped.\n", src, OPERA_NAME_MAX);
+		return NULL;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+		fprintf(stderr, "mkfs.opera: %s: too large for an Opera file "
+				"system; skipped.\n", src);
+		return NULL;
+	}
+
+	node = calloc(1, sizeof *node);
+	if (node == NULL) {
+		perror("mkfs.opera");
+		exit(1);
+	}
+	strcpy(node->name, name);
+	node->src = strdup(src);
+	node->path = strdup(path);
+	node->id = fs->next_id++;
+	node->is_dir = S_ISDIR(st.st_mode);
+	if (!node->is_dir) {
+		node->byte_count = st.st_size;
+		node->block_count = (st.st_size + fs->block_size - 1) /
+				fs->block_size;
+		return node;
+	}
+
+	dir = opendir(src);
+	if (dir == NULL) {
+		fprintf(stderr, "mkfs.opera: %s: %s\n", src, strerror(errno));
+		exit(1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		char *child_src, *child_path;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		child_src = mkfs_join(src, de->d_name);
+		child_path = mkfs_join(path, de->d_name);
+		if (child_src == NULL || child_path == NULL) {
+			perror("mkfs.opera");
+			exit(1);
+		}
+		child = mkfs_scan(fs, child_src, child_path, de->d_name);
+		free(child_src);
+		free(child_path);
+		if (child == NULL)
+			continue;
+
+		node->children = realloc(node->children,
+				(node->num_children + 1) * sizeof (struct mkfs_node *));
+		if (node->children == NULL) {
+			perror("mkfs.opera");
+			exit(1);
+		}
+		node->children[node->num_children++] = child;
+	}
+	closedir(dir);
+
+	if (node->num_children == 0 && *path != '\0') {
+		fprintf(stderr, "mkfs.opera: %s: empty directories are not "
+				"supported; skipped.\n", src);
+		free(node->src);
+		free(node->path);
+		free(node);
+		return NULL;
+	}
+
+	qsort(node->children, node->num_children, sizeof (struct mkfs_node *),
+			mkfs_cmp_node_name);
+	return node;
+}
+
+static struct mkfs_node *
+mkfs_find(struct mkfs_node *node, char *path)
+{
+	char *component;
+	size_t i;
+
+	while ((component = strsep(&path, "/")) != NULL) {
+		if (*component == '\0')
+			continue;
+		if (!node->is_dir)
+			return NULL;
+		for (i = 0; i < node->num_children; i++) {
+			if (strcmp(node->children[i]->name, component) == 0)
+				break;
+		}
+		if (i == node->num_children)
+			return NULL;
+		node = node->children[i];
+	}
+	return node;
+}
+
+static int
+mkfs_read_order(struct mkfs *fs, const char *order_file)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	struct mkfs_node *node;
+
+	f = fopen(order_file, "r");
+	if (f == NULL) {
+		fprintf(stderr, "mkfs.opera: %s: %s\n", order_file,
+				strerror(errno));
+		return -1;
+	}
+
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		node = mkfs_find(fs->root, line);
+		if (node == NULL || node->is_dir) {
+			fprintf(stderr, "mkfs.opera: %s: no such file in the source "
+					"tree; ignored.\n", line);
+			continue;
+		}
+		if (node->placed)
+			continue;
+		node->placed = 1;
+		mkfs_add_file(fs, node);
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+// Collect the directories breadth first, and the files not placed by
+// the order file depth first.
+static void
+mkfs_collect(struct mkfs *fs, struct mkfs_node *node)
+{
+	size_t i;
+
+	for (i = 0; i < node->num_children; i++) {
+		struct mkfs_node *child = node->children[i];
+		if (child->is_dir) {
+			mkfs_collect(fs, child);
+		} else if (!child->placed) {
+			child->placed = 1;
+			mkfs_add_file(fs, child);
+		}
+	}
+}
+
+static void
+mkfs_collect_dirs(struct mkfs *fs)
+{
+	size_t i, j;
+
+	fs->dirs = malloc(fs->next_id * sizeof (struct mkfs_node *));
+	if (fs->dirs == NULL) {
+		perror("mkfs.opera");
+		exit(1);
+	}
+	fs->dirs[0] = fs->root;
+	fs->num_dirs = 1;
+	for (i = 0; i < fs->num_dirs; i++) {
+		for (j = 0; j < fs->dirs[i]->num_children; j++) {
+			if (fs->dirs[i]->children[j]->is_dir)
+				fs->dirs[fs->num_dirs++] = fs->dirs[i]->children[j];
+		}
+	}
+}
+
+// Number of directory blocks needed for a directory.
+static uint32_t
+mkfs_dir_blocks(const struct mkfs *fs, const struct mkfs_node *dir)
+{
+	uint32_t blocks = 1;
+	uint32_t pos = MKFS_DIR_HEADER_SIZE;
+	size_t i;
+
+	for (i = 0; i < dir->num_children; i++) {
+		if (pos + mkfs_entry_size(fs) > fs->block_size) {
+			blocks++;
+			pos = MKFS_DIR_HEADER_SIZE;
+		}
+		pos += mkfs_entry_size(fs);
+	}
+	return blocks;
+}
+
+static void
+mkfs_layout(struct mkfs *fs)
+{
+	uint32_t next = 1;  // Block 0 holds the superblock.
+	uint32_t copy;
+	size_t i;
+
+	for (i = 0; i < fs->num_dirs; i++) {
+		fs->dirs[i]->block_count = mkfs_dir_blocks(fs, fs->dirs[i]);
+		fs->dirs[i]->byte_count = fs->dirs[i]->block_count * fs->block_size;
+	}
+
+	for (copy = 0; copy < fs->num_copies; copy++) {
+		for (i = 0; i < fs->num_dirs; i++) {
+			fs->dirs[i]->copies[copy] = next;
+			next += fs->dirs[i]->block_count;
+		}
+		for (i = 0; i < fs->num_files; i++) {
+			fs->files[i]->copies[copy] = next;
+			next += fs->files[i]->block_count;
+		}
+	}
+
+	fs->block_count = next;
+}
+
+static void
+mkfs_put_dirent(const struct mkfs *fs, uint8_t *buf,
+		const struct mkfs_node *node, uint32_t extra_flags)
+{
+	struct opera_disk_dirent *tdd = (struct opera_disk_dirent *) buf;
+	uint32_t *copies;
+	uint32_t i;
+
+	memset(tdd, '\0', mkfs_entry_size(fs));
+	tdd->flags = htobe32((node->is_dir ? OPERA_DIRENT_DIR :
+			OPERA_DIRENT_FILE) | extra_flags);
+	tdd->id = htobe32(node->id);
+	if (node->is_dir)
+		memcpy(tdd->type, "*dir", 4);
+	tdd->block_size = htobe32(fs->block_size);
+	tdd->byte_count = htobe32(node->byte_count);
+	tdd->block_count = htobe32(node->block_count);
+	memcpy(tdd->name, node->name, strlen(node->name));
+	tdd->last_copy = htobe32(fs->num_copies - 1);
+	copies = (uint32_t *) (buf + offsetof(struct opera_disk_dirent, copies));
+	for (i = 0; i < fs->num_copies; i++)
+		copies[i] = htobe32(node->copies[i]);
+}
+
+static int
+mkfs_write_dir(struct mkfs *fs, const struct mkfs_node *dir)
+{
+	struct opera_disk_dir_header *tddh;
+	uint8_t *buf;
+	uint32_t blocknr = 0;
+	uint32_t pos = MKFS_DIR_HEADER_SIZE;
+	uint32_t flags;
+	uint32_t copy;
+	size_t size = (size_t) dir->block_count * fs->block_size;
+	size_t i;
+
+	buf = calloc(1, size);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < dir->num_children; i++) {
+		flags = 0;
+		if (i + 1 == dir->num_children) {
+			flags = OPERA_LAST_DIRENT_IN_BLOCK | OPERA_LAST_DIRENT_IN_DIR;
+		} else if (pos + 2 * mkfs_entry_size(fs) > fs->block_size)
+			flags = OPERA_LAST_DIRENT_IN_BLOCK;
+
+		mkfs_put_dirent(fs, buf + blocknr * fs->block_size + pos,
+				dir->children[i], flags);
+		pos += mkfs_entry_size(fs);
+
+		if (flags & OPERA_LAST_DIRENT_IN_BLOCK) {
+			tddh = (struct opera_disk_dir_header *)
+					(buf + blocknr * fs->block_size);
+			tddh->next_block = htobe32(blocknr + 1 == dir->block_count ?
+					0xffffffff : blocknr + 1);
+			tddh->prev_block = htobe32(blocknr == 0 ?
+					0xffffffff : blocknr - 1);
+			tddh->flags = 0;
+			tddh->first_free = htobe32(pos);
+			tddh->first_entry = htobe32(MKFS_DIR_HEADER_SIZE);
+			blocknr++;
+			pos = MKFS_DIR_HEADER_SIZE;
+		}
+	}
+
+	for (copy = 0; copy < fs->num_copies; copy++) {
+		if (pwrite(fs->img_fd, buf, size,
+				(off_t) dir->copies[copy] * fs->block_size) !=
+				(ssize_t) size) {
+			free(buf);
+			return -EIO;
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int
+mkfs_write_metadata(struct mkfs *fs)
+{
+	struct opera_disk_superblock dsb;
+	uint32_t i;
+
+	memset(&dsb, '\0', sizeof dsb);
+	dsb.record_type = 1;
+	memset(dsb.volume.sync, 0x5a, sizeof dsb.volume.sync);
+	dsb.volume.version = 1;
+	dsb.volume.flags = 0;
+	memcpy(dsb.volume.comment, fs->comment,
+			strnlen(fs->comment, OPERA_COMMENT_MAX));
+	memcpy(dsb.volume.label, fs->label, strnlen(fs->label, OPERA_LABEL_MAX));
+	dsb.volume.id = htobe32(fs->disk_id);
+	dsb.volume.block_size = htobe32(fs->block_size);
+	dsb.volume.block_count = htobe32(fs->block_count);
+	dsb.root.id = htobe32(fs->root->id);
+	dsb.root.block_count = htobe32(fs->root->block_count);
+	dsb.root.block_size = htobe32(fs->block_size);
+	dsb.root.last_copy = htobe32(fs->num_copies - 1);
+	for (i = 0; i < fs->num_copies; i++)
+		dsb.root.copies[i] = htobe32(fs->root->copies[i]);
+
+	if (pwrite(fs->img_fd, &dsb, sizeof dsb, 0) != sizeof dsb)
+		return -EIO;
+
+	for (i = 0; i < fs->num_dirs; i++) {
+		if (mkfs_write_dir(fs, fs->dirs[i]) < 0)
+			return -EIO;
+	}
+	return 0;
+}
+
+static int
+mkfs_copy_one(struct mkfs *fs, const struct mkfs_job *job)
+{
+	const struct mkfs_node *node = job->node;
+	loff_t out_off = job->offset;
+	size_t left = node->byte_count;
+	char buf[65536];
+	ssize_t len;
+	int fd;
+
+	fd = open(node->src, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "mkfs.opera: %s: %s\n", node->src, strerror(errno));
+		return -1;
+	}
+
+	while (left > 0) {
+		len = copy_file_range(fd, NULL, fs->img_fd, &out_off, left, 0);
+		if (len == -1 && (errno == EXDEV || errno == ENOSYS ||
+				errno == EINVAL || errno == EOPNOTSUPP)) {
+			// Fall back to copying through user space.
+			len = read(fd, buf, left < sizeof buf ? left : sizeof buf);
+			if (len > 0 && pwrite(fs->img_fd, buf, len, out_off) != len)
+				len = -1;
+			if (len > 0)
+				out_off += len;
+		}
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			fprintf(stderr, "mkfs.opera: %s: %s\n", node->src,
+					len == 0 ? "file shrunk while copying" :
+					strerror(errno));
+			close(fd);
+			return -1;
+		}
+		left -= len;
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void *
+mkfs_worker(void *data)
+{
+	struct mkfs *fs = (struct mkfs *) data;
+	const struct mkfs_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&fs->lock);
+		if (fs->next_job == fs->num_jobs) {
+			pthread_mutex_unlock(&fs->lock);
+			break;
+		}
+		job = &fs->jobs[fs->next_job++];
+		pthread_mutex_unlock(&fs->lock);
+
+		if (mkfs_copy_one(fs, job) < 0) {
+			pthread_mutex_lock(&fs->lock);
+			fs->errors++;
+			pthread_mutex_unlock(&fs->lock);
+		}
+	}
+	return NULL;
+}
+
+static int
+mkfs_copy_files(struct mkfs *fs, long num_threads)
+{
+	pthread_t *threads;
+	uint32_t copy;
+	size_t i;
+	long t;
+
+	fs->jobs = malloc(fs->num_files * fs->num_copies *
+			sizeof (struct mkfs_job));
+	threads = malloc(num_threads * sizeof (pthread_t));
+	if (fs->jobs == NULL || threads == NULL)
+		return -ENOMEM;
+
+	// In image order, so that the writes are mostly sequential too.
+	for (copy = 0; copy < fs->num_copies; copy++) {
+		for (i = 0; i < fs->num_files; i++) {
+			if (fs->files[i]->byte_count == 0)
+				continue;
+			fs->jobs[fs->num_jobs].node = fs->files[i];
+			fs->jobs[fs->num_jobs].offset =
+					(uint64_t) fs->files[i]->copies[copy] * fs->block_size;
+			fs->num_jobs++;
+		}
+	}
+
+	pthread_mutex_init(&fs->lock, NULL);
+	for (t = 0; t < num_threads; t++) {
+		if (pthread_create(&threads[t], NULL, mkfs_worker, fs) != 0)
+			break;
+	}
+	if (t == 0)
+		mkfs_worker(fs);
+	num_threads = t;
+	for (t = 0; t < num_threads; t++)
+		pthread_join(threads[t], NULL);
+
+	free(threads);
+	return fs->errors == 0 ? 0 : -EIO;
+}
+
+static int
+mkfs_verify_callback(void *data, const char *path,
+		const struct opera_entry *entry)
+{
+	(*(size_t *) data)++;
+	(void) path;  /* Unused variable - satisfy compiler */
+	(void) entry;  /* Unused variable - satisfy compiler */
+	return 0;
+}
+
+static int
+mkfs_verify(const char *image, size_t expected_entries)
+{
+	struct opera_image img;
+	size_t num_entries = 0;
+	int res;
+
+	res = opera_image_open(&img, image);
+	if (res < 0)
+		return res;
+	res = opera_image_walk(&img, 0, mkfs_verify_callback, &num_entries);
+	opera_image_close(&img);
+	if (res < 0)
+		return res;
+	if (num_entries != expected_entries) {
+		fprintf(stderr, "mkfs.opera: read back %zu entries, expected "
+				"%zu.\n", num_entries, expected_entries);
+		return -EIO;
+	}
+	return 0;
+}
+
+
+//============================================================================
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [options] <srcdir> <image>\n"
+			"    -b block_size  block size (default 2048)\n"
+			"    -c copies      copies of each file and directory, 1-%d "
+			"(default 1)\n"
+			"    -l label       volume label (default \"CD-ROM\")\n"
+			"    -C comment     volume comment\n"
+			"    -i disk_id     disk id, in hex (default: random)\n"
+			"    -o order_file  files to place first, in this order\n"
+			"    -j threads     number of copying threads (default: number "
+			"of CPUs)\n", progname, MKFS_MAX_COPIES);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mkfs fs;
+	const char *order_file = NULL;
+	long num_threads;
+	int opt;
+
+	memset(&fs, '\0', sizeof fs);
+	fs.block_size = 2048;
+	fs.num_copies = 1;
+	fs.label = "CD-ROM";
+	fs.comment = "";
+	fs.next_id = 1;
+	srandom(time(NULL) ^ getpid());
+	fs.disk_id = random();
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+
+	while ((opt = getopt(argc, argv, "b:c:l:C:i:o:j:")) != -1) {
+		switch (opt) {
+			case 'b':
+				fs.block_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				fs.num_copies = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				fs.label = optarg;
+				break;
+			case 'C':
+				fs.comment = optarg;
+				break;
+			case 'i':
+				fs.disk_id = strtoul(optarg, NULL, 16);
+				break;
+			case 'o':
+				order_file = optarg;
+				break;
+			case 'j':
+				num_threads = strtol(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (argc - optind != 2 || num_threads < 1 || fs.num_copies < 1 ||
+			fs.num_copies > MKFS_MAX_COPIES) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (fs.block_size < 256 || fs.block_size > 4096 ||
+			((fs.block_size - 1) & fs.block_size) != 0) {
+		fprintf(stderr, "mkfs.opera: the block size must be a power of 2 "
+				"between 256 and 4096.\n");
+		return 1;
+	}
+	if (MKFS_DIR_HEADER_SIZE + mkfs_entry_size(&fs) > fs.block_size) {
+		fprintf(stderr, "mkfs.opera: too many copies for this block "
+				"size.\n");
+		return 1;
+	}
+
+	fs.root = mkfs_scan(&fs, argv[optind], "", "");
+	if (fs.root == NULL || !fs.root->is_dir) {
+		fprintf(stderr, "mkfs.opera: %s is not a directory.\n",
+				argv[optind]);
+		return 1;
+	}
+	if (fs.root->num_children == 0) {
+		fprintf(stderr, "mkfs.opera: %s is empty.\n", argv[optind]);
+		return 1;
+	}
+
+	if (order_file != NULL && mkfs_read_order(&fs, order_file) < 0)
+		return 1;
+	mkfs_collect(&fs, fs.root);
+	mkfs_collect_dirs(&fs);
+	mkfs_layout(&fs);
+
+	fs.img_fd = open(argv[optind + 1],
+			O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fs.img_fd == -1) {
+		fprintf(stderr, "mkfs.opera: %s: %s\n", argv[optind + 1],
+				strerror(errno));
+		return 1;
+	}
+	if (ftruncate(fs.img_fd, (off_t) fs.block_count * fs.block_size) == -1 ||
+			mkfs_write_metadata(&fs) < 0) {
+		fprintf(stderr, "mkfs.opera: error writing %s: %s\n",
+				argv[optind + 1], strerror(errno));
+		return 1;
+	}
+	if (mkfs_copy_files(&fs, num_threads) < 0)
+		return 1;
+	if (fsync(fs.img_fd) == -1 || close(fs.img_fd) == -1) {
+		fprintf(stderr, "mkfs.opera: error writing %s: %s\n",
+				argv[optind + 1], strerror(errno));
+		return 1;
+	}
+
+	if (mkfs_verify(argv[optind + 1], fs.num_dirs - 1 + fs.num_files) < 0) {
+		fprintf(stderr, "mkfs.opera: %s failed verification.\n",
+				argv[optind + 1]);
+		return 1;
+	}
+
+	printf("mkfs.opera: disk #%08X, %zu directories, %zu files, "
+			"%u blocks of %u bytes, %u cop%s\n", fs.disk_id, fs.num_dirs,
+			fs.num_files, fs.block_count, fs.block_size, fs.num_copies,
+			fs.num_copies == 1 ? "y" : "ies");
+	return 0;
+}
+
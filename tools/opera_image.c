@@ -0,0 +1,490 @@
+/*
+ * opera_image.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "opera_image.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#	define OPERA_DECODE_SSSE3
+#elif defined(__aarch64__)
+#	include <arm_neon.h>
+#	define OPERA_DECODE_NEON
+#endif
+
+
+// ============================================================================
+
+
+#define OPERA_WALK_MAX_DEPTH 64
+		// Protection against directories containing themselves.
+
+struct opera_walk_arg {
+	const struct opera_image *img;
+	int show_special;
+	opera_walk_callback callback;
+	void *data;
+	char path[OPERA_WALK_MAX_DEPTH * (OPERA_NAME_MAX + 1)];
+	size_t path_len;
+	unsigned int depth;
+};
+
+static int opera_walk_callback_internal(void *data,
+		const struct opera_entry *entry);
+static void opera_decode_dirent(const struct opera_disk_dirent *tdd,
+		struct opera_entry *entry);
+
+
+// ============================================================================
+
+
+int
+opera_image_open(struct opera_image *img, const char *path)
+{
+	const struct opera_disk_superblock *dsb;
+	struct stat st;
+	uint64_t size;
+	void *data;
+	int error;
+
+	memset(img, '\0', sizeof *img);
+	img->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (img->fd == -1) {
+		error = -errno;
+		fprintf(stderr, "Opera: could not open %s: %s\n", path,
+				strerror(errno));
+		return error;
+	}
+
+	if (fstat(img->fd, &st) == -1) {
+		error = -errno;
+		goto out_err;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(img->fd, BLKGETSIZE64, &size) == -1) {
+			error = -errno;
+			goto out_err;
+		}
+	} else
+		size = st.st_size;
+
+	if (size < sizeof (struct opera_disk_superblock)) {
+		fprintf(stderr, "Opera: no Opera superblock found in %s\n", path);
+		error = -EINVAL;
+		goto out_err;
+	}
+
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, img->fd, 0);
+	if (data == MAP_FAILED) {
+		error = -errno;
+		goto out_err;
+	}
+	img->data = data;
+	img->size = size;
+
+	dsb = (const struct opera_disk_superblock *) img->data;
+	if (dsb->record_type != 0x01
+			|| dsb->volume.sync[0] != 0x5A
+			|| dsb->volume.sync[1] != 0x5A
+			|| dsb->volume.sync[2] != 0x5A
+			|| dsb->volume.sync[3] != 0x5A
+			|| dsb->volume.sync[4] != 0x5A) {
+		fprintf(stderr, "Opera: no Opera superblock found in %s\n", path);
+		error = -EINVAL;
+		goto out_err;
+	}
+
+	if (dsb->volume.version != 1) {
+		fprintf(stderr, "Opera: superblock version %d not supported\n",
+				dsb->volume.version);
+		error = -EINVAL;
+		goto out_err;
+	}
+
+	img->disk_id = be32toh(dsb->volume.id);
+	memcpy(img->label, dsb->volume.label, OPERA_LABEL_MAX);
+	img->label[OPERA_LABEL_MAX] = '\0';
+
+	img->block_size = be32toh(dsb->volume.block_size);
+	if (img->block_size < 256 ||
+			((img->block_size - 1) & img->block_size) != 0) {
+		fprintf(stderr, "Opera: bad block size %d (disk #%08X)\n",
+				img->block_size, img->disk_id);
+		error = -EINVAL;
+		goto out_err;
+	}
+	img->block_shift = 0;
+	while ((img->block_size >> (img->block_shift + 1)) != 0)
+		img->block_shift++;
+	img->block_count = be32toh(dsb->volume.block_count);
+
+	if (be32toh(dsb->root.block_size) != img->block_size) {
+		fprintf(stderr, "Opera: root directory block size (%d) differs "
+				"from file system block size (%d) (disk #%08X).\n",
+				be32toh(dsb->root.block_size), img->block_size,
+				img->disk_id);
+		error = -EINVAL;
+		goto out_err;
+	}
+	img->root_start = be32toh(dsb->root.copies[0]);
+	img->root_blocks = be32toh(dsb->root.block_count);
+
+	return 0;
+
+out_err:
+	opera_image_close(img);
+	return error;
+}
+
+void
+opera_image_close(struct opera_image *img)
+{
+	if (img->data != NULL)
+		munmap((void *) img->data, img->size);
+	if (img->fd != -1)
+		close(img->fd);
+	img->data = NULL;
+	img->fd = -1;
+}
+
+// Is 'name' usable as a path component?
+static int
+opera_valid_name(const char *name, size_t len)
+{
+	if (len == 0 || memchr(name, '/', len) != NULL)
+		return 0;
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return 0;
+	return 1;
+}
+
+// The user space counterpart of opera_for_all_entries() in misc.c.
+int
+opera_image_for_all_entries(const struct opera_image *img,
+		uint32_t start_block, uint32_t num_blocks, int show_special,
+		opera_image_callback callback, void *data)
+{
+	const struct opera_disk_dir_header *tddh;
+	const struct opera_disk_dirent *tdd;
+	const uint8_t *block;
+	struct opera_entry entry;
+	uint32_t next_block, prev_block;
+	uint32_t first_free;
+	uint32_t blocknr;
+	uint32_t pos;
+	uint32_t entry_flags;
+	uint32_t entry_size;
+	int res;
+
+	if (((uint64_t) start_block + num_blocks) << img->block_shift >
+			img->size) {
+		fprintf(stderr, "Opera: directory at block %d extends past the "
+				"end of the image (disk #%08X).\n", start_block,
+				img->disk_id);
+		return -EINVAL;
+	}
+
+	for (blocknr = 0; blocknr < num_blocks; blocknr++) {
+		block = img->data +
+				((uint64_t) (start_block + blocknr) << img->block_shift);
+		tddh = (const struct opera_disk_dir_header *) block;
+
+		next_block = be32toh(tddh->next_block);
+		prev_block = be32toh(tddh->prev_block);
+		first_free = be32toh(tddh->first_free);
+		if (((blocknr == 0) != (prev_block == 0xffffffff)) ||
+				(blocknr > 0 && blocknr != prev_block + 1) ||
+				((blocknr + 1 == num_blocks) != (next_block == 0xffffffff)) ||
+				(next_block != 0xffffffff && next_block != blocknr + 1) ||
+				first_free > img->block_size) {
+			fprintf(stderr, "Opera: bad directory header in block %d "
+					"(block_size=%d, disk #%08X).\n",
+					start_block + blocknr, img->block_size, img->disk_id);
+			return -EINVAL;
+		}
+
+		pos = be32toh(tddh->first_entry);
+		for (;;) {
+			if (pos > img->block_size || ((pos & 0x03) != 0x00)) {
+				fprintf(stderr, "Opera: Bad start of directory in block %d "
+						"(block_size=%d, disk #%08X).\n",
+						start_block + blocknr, img->block_size,
+						img->disk_id);
+				return -EBADF;
+			}
+
+			tdd = (const struct opera_disk_dirent *) (block + pos);
+			// Make sure the fixed part is inside the block before
+			// reading last_copy, and check last_copy before
+			// multiplying; as in opera_for_all_entries_disk().
+			if (pos + 72 > first_free || be32toh(tdd->last_copy) >
+					(first_free - pos - 72) / 4) {
+				fprintf(stderr, "Opera: Bad directory entry in block %d "
+						"(pos=%d, block_size=%d, disk #%08X).\n",
+						start_block + blocknr, pos, img->block_size,
+						img->disk_id);
+				return -EBADF;
+			}
+			entry_size = 72 + 4 * be32toh(tdd->last_copy);
+
+			entry_flags = be32toh(tdd->flags);
+			if (be32toh(tdd->block_size) != img->block_size)
+				goto next_entry;
+
+			switch (OPERA_DIRENT_TYPE(entry_flags)) {
+				case OPERA_DIRENT_FILE:
+					entry.dtype = DT_REG;
+					break;
+				case OPERA_DIRENT_SPECIAL:
+					if (!show_special)
+						goto next_entry;
+					entry.dtype = DT_REG;
+					break;
+				case OPERA_DIRENT_DIR:
+					entry.dtype = DT_DIR;
+					break;
+				default:
+					goto next_entry;
+			}
+
+			entry.ino = ((uint64_t) (start_block + blocknr) <<
+					img->block_shift) + pos;
+			opera_decode_dirent(tdd, &entry);
+			if (!opera_valid_name(entry.name, entry.name_len)) {
+				// The tools turn names into paths on the host; these
+				// would escape or confuse them.
+				fprintf(stderr, "Opera: Bad name for directory entry in "
+						"block %d (pos=%d, disk #%08X). Entry skipped.\n",
+						start_block + blocknr, pos, img->disk_id);
+				goto next_entry;
+			}
+			entry.copies = (const uint32_t *) ((const uint8_t *) tdd +
+					offsetof(struct opera_disk_dirent, copies));
+					// Entries are 4-byte aligned (checked above).
+
+			res = callback(data, &entry);
+			if (res != 0)
+				return res;
+
+next_entry:
+			pos += entry_size;
+			if (entry_flags & OPERA_LAST_DIRENT_IN_BLOCK)
+				break;
+		}
+
+		if (entry_flags & OPERA_LAST_DIRENT_IN_DIR)
+			return 0;
+	}
+
+	fprintf(stderr, "Opera: missing end-of-directory flag "
+			"(num_blocks = %d, block_size=%d, disk #%08X).\n",
+			num_blocks, img->block_size, img->disk_id);
+	return 0;
+}
+
+// Decoding of the fixed part of a directory entry (everything but the
+// copies). The first 32 bytes are eight big-endian words, apart from
+// 'type' which is four characters; the name is 32 bytes, '\0'-padded.
+// Where the CPU allows, the words are byte-swapped in one vector
+// shuffle and the end of the name is found with one vector compare,
+// rather than field by field. This is the inner loop of anything that
+// reads whole directory trees, such as operacatalog.
+
+// Store the fields from the eight decoded words.
+static inline void
+opera_decode_words(const uint32_t *words, const struct opera_disk_dirent *tdd,
+		struct opera_entry *entry)
+{
+	entry->flags = words[0];
+	entry->id = words[1];
+	memcpy(entry->type, tdd->type, sizeof entry->type);
+	entry->byte_count = words[4];
+	entry->block_count = words[5];
+	entry->last_copy = be32toh(tdd->last_copy);
+}
+
+static void
+opera_decode_dirent_scalar(const struct opera_disk_dirent *tdd,
+		struct opera_entry *entry)
+{
+	uint32_t words[8];
+	unsigned int i;
+
+	memcpy(words, tdd, sizeof words);
+	for (i = 0; i < 8; i++)
+		words[i] = be32toh(words[i]);
+	opera_decode_words(words, tdd, entry);
+
+	entry->name_len = strnlen((const char *) tdd->name, OPERA_NAME_MAX);
+	memcpy(entry->name, tdd->name, entry->name_len);
+	entry->name[entry->name_len] = '\0';
+}
+
+#if defined(OPERA_DECODE_SSSE3)
+__attribute__((target("ssse3")))
+static void
+opera_decode_dirent_ssse3(const struct opera_disk_dirent *tdd,
+		struct opera_entry *entry)
+{
+	const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+			8, 9, 10, 11, 15, 14, 13, 12);
+			// Swap each word, except the third ('type').
+	const __m128i swap_all = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+			11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i zero = _mm_setzero_si128();
+	const uint8_t *p = (const uint8_t *) tdd;
+	uint32_t words[8];
+	__m128i lo, hi, name_lo, name_hi;
+	uint32_t mask;
+
+	lo = _mm_loadu_si128((const __m128i *) p);
+	hi = _mm_loadu_si128((const __m128i *) (p + 16));
+	_mm_storeu_si128((__m128i *) words, _mm_shuffle_epi8(lo, swap));
+	_mm_storeu_si128((__m128i *) (words + 4), _mm_shuffle_epi8(hi, swap_all));
+	opera_decode_words(words, tdd, entry);
+
+	name_lo = _mm_loadu_si128((const __m128i *) tdd->name);
+	name_hi = _mm_loadu_si128((const __m128i *) (tdd->name + 16));
+	mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(name_lo, zero)) |
+			((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(name_hi, zero))
+			<< 16);
+	entry->name_len = mask == 0 ? OPERA_NAME_MAX : __builtin_ctz(mask);
+	_mm_storeu_si128((__m128i *) entry->name, name_lo);
+	_mm_storeu_si128((__m128i *) (entry->name + 16), name_hi);
+	entry->name[entry->name_len] = '\0';
+}
+#elif defined(OPERA_DECODE_NEON)
+static void
+opera_decode_dirent_neon(const struct opera_disk_dirent *tdd,
+		struct opera_entry *entry)
+{
+	const uint8_t *p = (const uint8_t *) tdd;
+	uint32_t words[8];
+	uint8x16_t name_lo, name_hi;
+	uint64_t zeros_lo, zeros_hi;
+	unsigned int len;
+
+	vst1q_u8((uint8_t *) words, vrev32q_u8(vld1q_u8(p)));
+	vst1q_u8((uint8_t *) (words + 4), vrev32q_u8(vld1q_u8(p + 16)));
+	opera_decode_words(words, tdd, entry);
+			// 'type' is copied from tdd, so swapping it does no harm.
+
+	// Narrow the 0xff/0x00 comparison results to 4 bits per byte, to
+	// get something that fits a 64-bit register.
+	name_lo = vld1q_u8(tdd->name);
+	name_hi = vld1q_u8(tdd->name + 16);
+	zeros_lo = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+			vreinterpretq_u16_u8(vceqzq_u8(name_lo)), 4)), 0);
+	zeros_hi = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+			vreinterpretq_u16_u8(vceqzq_u8(name_hi)), 4)), 0);
+	if (zeros_lo != 0) {
+		len = __builtin_ctzll(zeros_lo) / 4;
+	} else if (zeros_hi != 0) {
+		len = 16 + __builtin_ctzll(zeros_hi) / 4;
+	} else
+		len = OPERA_NAME_MAX;
+	entry->name_len = len;
+	vst1q_u8((uint8_t *) entry->name, name_lo);
+	vst1q_u8((uint8_t *) entry->name + 16, name_hi);
+	entry->name[len] = '\0';
+}
+#endif
+
+static void
+opera_decode_dirent(const struct opera_disk_dirent *tdd,
+		struct opera_entry *entry)
+{
+#if defined(OPERA_DECODE_SSSE3)
+	static int have_ssse3 = -1;
+
+	if (have_ssse3 == -1)
+		have_ssse3 = __builtin_cpu_supports("ssse3");
+			// Racy when called from several threads, but they all
+			// store the same value.
+	if (have_ssse3) {
+		opera_decode_dirent_ssse3(tdd, entry);
+		return;
+	}
+#elif defined(OPERA_DECODE_NEON)
+	opera_decode_dirent_neon(tdd, entry);
+	return;
+#endif
+	opera_decode_dirent_scalar(tdd, entry);
+}
+
+int
+opera_image_walk(const struct opera_image *img, int show_special,
+		opera_walk_callback callback, void *data)
+{
+	struct opera_walk_arg arg;
+
+	arg.img = img;
+	arg.show_special = show_special;
+	arg.callback = callback;
+	arg.data = data;
+	arg.path[0] = '\0';
+	arg.path_len = 0;
+	arg.depth = 0;
+
+	return opera_image_for_all_entries(img, img->root_start,
+			img->root_blocks, show_special, opera_walk_callback_internal,
+			&arg);
+}
+
+static int
+opera_walk_callback_internal(void *data, const struct opera_entry *entry)
+{
+	struct opera_walk_arg *arg = (struct opera_walk_arg *) data;
+	size_t saved_len = arg->path_len;
+	int res;
+
+	if (arg->path_len != 0)
+		arg->path[arg->path_len++] = '/';
+	memcpy(arg->path + arg->path_len, entry->name, entry->name_len + 1);
+	arg->path_len += entry->name_len;
+
+	res = arg->callback(arg->data, arg->path, entry);
+	if (res == 0 && entry->dtype == DT_DIR) {
+		if (arg->depth + 1 >= OPERA_WALK_MAX_DEPTH) {
+			fprintf(stderr, "Opera: directories nested too deeply at "
+					"\"%s\" (disk #%08X).\n", arg->path,
+					arg->img->disk_id);
+			res = -ELOOP;
+		} else {
+			arg->depth++;
+			res = opera_image_for_all_entries(arg->img,
+					opera_entry_copy(entry, 0), entry->block_count,
+					arg->show_special, opera_walk_callback_internal, arg);
+			arg->depth--;
+		}
+	}
+
+	arg->path_len = saved_len;
+	arg->path[saved_len] = '\0';
+	return res;
+}
+
@@ -0,0 +1,106 @@
+/*
+ * opera_image.h
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Read access to Opera images from user space, for the tools in this
+// directory. The checks match those of the kernel driver, so that
+// anything these tools accept, the driver accepts too.
+
+#ifndef _OPERA_IMAGE_H
+#define _OPERA_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include "../operafs.h"
+
+struct opera_image {
+	int fd;
+	const uint8_t *data;  // the whole image, mmapped
+	size_t size;  // size of the image in bytes
+
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t block_shift;
+
+	uint32_t disk_id;
+	char label[OPERA_LABEL_MAX + 1];
+
+	uint32_t root_start;  // first block of the first root copy
+	uint32_t root_blocks;  // number of blocks in the root directory
+};
+
+// A directory entry, in host byte order.
+struct opera_entry {
+	uint64_t ino;
+			// Position of the entry from the beginning of the disk.
+			// The kernel driver uses this as the inode number.
+	uint32_t flags;
+	uint32_t id;
+	uint8_t type[4];
+	uint32_t byte_count;
+	uint32_t block_count;
+	uint32_t last_copy;  // number of copies - 1
+	const uint32_t *copies;
+			// Points into the image; big-endian. Use opera_entry_copy().
+	unsigned int dtype;  // DT_DIR or DT_REG
+	size_t name_len;
+	char name[OPERA_NAME_MAX + 1];
+};
+
+static inline uint32_t
+opera_entry_copy(const struct opera_entry *entry, uint32_t i)
+{
+	return be32toh(entry->copies[i]);
+}
+
+static inline uint64_t
+opera_entry_offset(const struct opera_image *img,
+		const struct opera_entry *entry)
+{
+	return (uint64_t) opera_entry_copy(entry, 0) << img->block_shift;
+}
+
+// Called for each entry. A non-zero return value ends the iteration
+// and is passed on to the caller.
+typedef int (*opera_image_callback)(void *data,
+		const struct opera_entry *entry);
+
+// Called for each entry of the tree. 'path' is the path of the entry
+// relative to the root, without leading '/'.
+typedef int (*opera_walk_callback)(void *data, const char *path,
+		const struct opera_entry *entry);
+
+// These return 0 or a negative errno value.
+int opera_image_open(struct opera_image *img, const char *path);
+void opera_image_close(struct opera_image *img);
+
+// Iterate over the entries of the directory starting at 'start_block'.
+// Special files are skipped unless 'show_special' is set, as in the
+// driver. So are entries whose names are empty, "." or "..", or contain
+// a '/'.
+int opera_image_for_all_entries(const struct opera_image *img,
+		uint32_t start_block, uint32_t num_blocks, int show_special,
+		opera_image_callback callback, void *data);
+
+// Depth-first walk of the whole tree. Directories are reported before
+// their contents.
+int opera_image_walk(const struct opera_image *img, int show_special,
+		opera_walk_callback callback, void *data);
+
+#endif  /* _OPERA_IMAGE_H */
+
@@ -0,0 +1,753 @@
+/*
+ * operacatalog.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Index the files of many Opera images into one catalog file, and
+// query it.
+//
+// Usage: operacatalog build [-j threads] [-s] <catalog> <image>...
+//        operacatalog build [-j threads] [-s] <catalog> -  (images on stdin)
+//        operacatalog find <catalog> <name>      (name may end in '*')
+//        operacatalog size <catalog> <min> [<max>]
+//
+// The images are read by a pool of threads, one image at a time each,
+// straight from the mmapped image (see opera_image.c for the directory
+// decoding). Queries print one line per file:
+//     <image>\t<path in image>\t<size>
+//
+// The catalog is meant to be mmapped and used in place. All numbers are
+// in host byte order. Layout:
+//   struct catalog_header
+//   struct catalog_image     [num_images]
+//   struct catalog_file      [num_files]
+//   uint32_t by_name         [num_files]  file indices, sorted by base
+//                                         name, then image, then path
+//   uint32_t by_size         [num_files]  file indices, sorted by size
+//   char     strings         [strings_size]  '\0'-terminated strings
+// Every section starts at a multiple of 8 bytes.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "opera_image.h"
+
+
+//============================================================================
+
+
+#define CATALOG_MAGIC "OPCATLG1"
+
+struct catalog_header {
+	char magic[8];  // CATALOG_MAGIC
+	uint32_t byte_order;  // 0x01020304 as written by the host
+	uint32_t num_images;
+	uint64_t num_files;
+	uint64_t images_off;  // offsets from the start of the file
+	uint64_t files_off;
+	uint64_t by_name_off;
+	uint64_t by_size_off;
+	uint64_t strings_off;
+	uint64_t strings_size;
+};
+
+struct catalog_image {
+	uint64_t path;  // offset in strings
+	uint32_t disk_id;
+	uint32_t num_files;
+};
+
+struct catalog_file {
+	uint64_t path;  // offset in strings; the path within the image
+	uint32_t name;  // offset of the base name from 'path'
+	uint32_t image;  // index in the images
+	uint32_t size;  // byte_count
+	uint32_t start_block;  // first block of the first copy
+};
+
+// An image being indexed.
+struct build_image {
+	const char *path;
+	uint32_t disk_id;
+	int error;
+	uint64_t dir_bytes;  // size of the directories read
+
+	struct catalog_file *files;
+			// 'path' is an offset in 'strings' until merged.
+	size_t num_files;
+	size_t max_files;
+	char *strings;
+	size_t strings_size;
+	size_t strings_max;
+};
+
+struct build {
+	struct build_image *images;
+	size_t num_images;
+	int show_special;
+
+	pthread_mutex_t lock;
+	size_t next_image;  // next image to be taken by a worker
+};
+
+// For the sort comparisons.
+struct catalog_view {
+	const struct catalog_file *files;
+	const char *strings;
+};
+
+static int build_walk_callback(void *data, const char *path,
+		const struct opera_entry *entry);
+static void *build_worker(void *data);
+
+
+//============================================================================
+
+
+static int
+build_add_string(struct build_image *bi, const char *str, size_t len,
+		uint64_t *off)
+{
+	if (bi->strings_size + len + 1 > bi->strings_max) {
+		size_t max = bi->strings_max == 0 ? 4096 : 2 * bi->strings_max;
+		char *strings;
+		while (bi->strings_size + len + 1 > max)
+			max *= 2;
+		strings = realloc(bi->strings, max);
+		if (strings == NULL)
+			return -ENOMEM;
+		bi->strings = strings;
+		bi->strings_max = max;
+	}
+	memcpy(bi->strings + bi->strings_size, str, len);
+	bi->strings[bi->strings_size + len] = '\0';
+	*off = bi->strings_size;
+	bi->strings_size += len + 1;
+	return 0;
+}
+
+static int
+build_walk_callback(void *data, const char *path,
+		const struct opera_entry *entry)
+{
+	struct build_image *bi = (struct build_image *) data;
+	struct catalog_file *file;
+	size_t path_len;
+
+	if (entry->dtype == DT_DIR) {
+		bi->dir_bytes += (uint64_t) entry->block_count;
+				// In blocks for now; see build_worker().
+		return 0;
+	}
+
+	if (bi->num_files == bi->max_files) {
+		size_t max = bi->max_files == 0 ? 256 : 2 * bi->max_files;
+		file = realloc(bi->files, max * sizeof (struct catalog_file));
+		if (file == NULL)
+			return -ENOMEM;
+		bi->files = file;
+		bi->max_files = max;
+	}
+
+	file = &bi->files[bi->num_files];
+	path_len = strlen(path);
+	if (build_add_string(bi, path, path_len, &file->path) < 0)
+		return -ENOMEM;
+	file->name = path_len - entry->name_len;
+	file->size = entry->byte_count;
+	file->start_block = opera_entry_copy(entry, 0);
+	bi->num_files++;
+	return 0;
+}
+
+static void *
+build_worker(void *data)
+{
+	struct build *b = (struct build *) data;
+	struct build_image *bi;
+	struct opera_image img;
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		if (b->next_image == b->num_images) {
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		bi = &b->images[b->next_image++];
+		pthread_mutex_unlock(&b->lock);
+
+		if (opera_image_open(&img, bi->path) < 0) {
+			bi->error = -EINVAL;
+			continue;
+		}
+		// Only the directory blocks are read; don't let the kernel read
+		// the file data around them.
+		madvise((void *) img.data, img.size, MADV_RANDOM);
+
+		bi->disk_id = img.disk_id;
+		bi->dir_bytes = img.root_blocks;
+		bi->error = opera_image_walk(&img, b->show_special,
+				build_walk_callback, bi);
+		bi->dir_bytes <<= img.block_shift;
+		opera_image_close(&img);
+		if (bi->error < 0) {
+			fprintf(stderr, "operacatalog: error reading %s; skipped.\n",
+					bi->path);
+		}
+	}
+	return NULL;
+}
+
+static int
+cmp_by_name(const void *a, const void *b, void *data)
+{
+	const struct catalog_view *view = (const struct catalog_view *) data;
+	const struct catalog_file *fa = &view->files[*(const uint32_t *) a];
+	const struct catalog_file *fb = &view->files[*(const uint32_t *) b];
+	int res;
+
+	res = strcmp(view->strings + fa->path + fa->name,
+			view->strings + fb->path + fb->name);
+	if (res != 0)
+		return res;
+	if (fa->image != fb->image)
+		return fa->image < fb->image ? -1 : 1;
+	return strcmp(view->strings + fa->path, view->strings + fb->path);
+}
+
+static int
+cmp_by_size(const void *a, const void *b, void *data)
+{
+	const struct catalog_view *view = (const struct catalog_view *) data;
+	const struct catalog_file *fa = &view->files[*(const uint32_t *) a];
+	const struct catalog_file *fb = &view->files[*(const uint32_t *) b];
+
+	if (fa->size != fb->size)
+		return fa->size < fb->size ? -1 : 1;
+	return cmp_by_name(a, b, data);
+}
+
+static int
+write_all(int fd, const void *buf, size_t len, uint64_t *pos)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+	static const uint8_t padding[8];
+	ssize_t res;
+
+	while (len > 0) {
+		res = write(fd, p, len);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += res;
+		len -= res;
+		*pos += res;
+	}
+	// Keep every section 8-byte aligned.
+	if (*pos % 8 != 0)
+		return write_all(fd, padding, 8 - *pos % 8, pos);
+	return 0;
+}
+
+// Merge the per-image results and write the catalog.
+static int
+build_write(struct build *b, const char *catalog_path)
+{
+	struct catalog_header header;
+	struct catalog_image *images;
+	struct catalog_file *files;
+	struct catalog_view view;
+	uint32_t *by_name, *by_size;
+	char *strings;
+	size_t num_files = 0, strings_size = 0;
+	size_t i, j, f;
+	uint64_t pos = 0;
+	char *tmp_path;
+	int error = -ENOMEM;
+	int fd;
+
+	for (i = 0; i < b->num_images; i++) {
+		// Every image gets an entry with its path, even one which
+		// could not be read.
+		strings_size += strlen(b->images[i].path) + 1;
+		if (b->images[i].error < 0)
+			continue;
+		num_files += b->images[i].num_files;
+		strings_size += b->images[i].strings_size;
+	}
+	if (num_files > UINT32_MAX) {
+		fprintf(stderr, "operacatalog: too many files.\n");
+		return -EFBIG;
+	}
+
+	images = calloc(b->num_images, sizeof (struct catalog_image));
+	files = malloc((num_files + 1) * sizeof (struct catalog_file));
+	by_name = malloc((num_files + 1) * sizeof (uint32_t));
+	by_size = malloc((num_files + 1) * sizeof (uint32_t));
+	strings = malloc(strings_size + 1);
+	if (images == NULL || files == NULL || by_name == NULL ||
+			by_size == NULL || strings == NULL)
+		goto out;
+
+	strings_size = 0;
+	f = 0;
+	for (i = 0; i < b->num_images; i++) {
+		struct build_image *bi = &b->images[i];
+		size_t len = strlen(bi->path);
+
+		images[i].path = strings_size;
+		memcpy(strings + strings_size, bi->path, len + 1);
+		strings_size += len + 1;
+		images[i].disk_id = bi->disk_id;
+		if (bi->error < 0)
+			continue;
+		images[i].num_files = bi->num_files;
+
+		for (j = 0; j < bi->num_files; j++, f++) {
+			files[f] = bi->files[j];
+			files[f].path += strings_size;
+			files[f].image = i;
+			by_name[f] = f;
+			by_size[f] = f;
+		}
+		memcpy(strings + strings_size, bi->strings, bi->strings_size);
+		strings_size += bi->strings_size;
+	}
+
+	view.files = files;
+	view.strings = strings;
+	qsort_r(by_name, num_files, sizeof (uint32_t), cmp_by_name, &view);
+	qsort_r(by_size, num_files, sizeof (uint32_t), cmp_by_size, &view);
+
+	memset(&header, '\0', sizeof header);
+	memcpy(header.magic, CATALOG_MAGIC, sizeof header.magic);
+	header.byte_order = 0x01020304;
+	header.num_images = b->num_images;
+	header.num_files = num_files;
+	header.images_off = sizeof header;
+	header.files_off = header.images_off +
+			((b->num_images * sizeof (struct catalog_image) + 7) & ~7);
+	header.by_name_off = header.files_off +
+			num_files * sizeof (struct catalog_file);
+	header.by_size_off = header.by_name_off +
+			((num_files * sizeof (uint32_t) + 7) & ~7);
+	header.strings_off = header.by_size_off +
+			((num_files * sizeof (uint32_t) + 7) & ~7);
+	header.strings_size = strings_size;
+
+	// Write to a temporary file and rename it, so that readers never
+	// see a partial catalog.
+	if (asprintf(&tmp_path, "%s.tmp", catalog_path) == -1)
+		goto out;
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		error = -errno;
+		fprintf(stderr, "operacatalog: could not create %s: %s\n",
+				tmp_path, strerror(errno));
+		free(tmp_path);
+		goto out;
+	}
+	error = write_all(fd, &header, sizeof header, &pos);
+	if (error == 0)
+		error = write_all(fd, images,
+				b->num_images * sizeof (struct catalog_image), &pos);
+	if (error == 0)
+		error = write_all(fd, files,
+				num_files * sizeof (struct catalog_file), &pos);
+	if (error == 0)
+		error = write_all(fd, by_name, num_files * sizeof (uint32_t), &pos);
+	if (error == 0)
+		error = write_all(fd, by_size, num_files * sizeof (uint32_t), &pos);
+	if (error == 0)
+		error = write_all(fd, strings, strings_size, &pos);
+	if (close(fd) == -1 && error == 0)
+		error = -errno;
+	if (error == 0 && rename(tmp_path, catalog_path) == -1)
+		error = -errno;
+	if (error < 0) {
+		fprintf(stderr, "operacatalog: error writing %s: %s\n",
+				catalog_path, strerror(-error));
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+
+out:
+	free(images);
+	free(files);
+	free(by_name);
+	free(by_size);
+	free(strings);
+	return error;
+}
+
+static int
+cmd_build(int argc, char *argv[])
+{
+	struct build b;
+	struct timespec start, end;
+	pthread_t *threads;
+	long num_threads;
+	uint64_t dir_bytes = 0;
+	size_t num_files = 0;
+	size_t max_images = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	int errors = 0;
+	double secs;
+	long i;
+	int opt;
+	int res;
+
+	memset(&b, '\0', sizeof b);
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+
+	while ((opt = getopt(argc, argv, "j:s")) != -1) {
+		switch (opt) {
+			case 'j':
+				num_threads = strtol(optarg, NULL, 10);
+				if (num_threads < 1)
+					return -EINVAL;
+				break;
+			case 's':
+				b.show_special = 1;
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+	if (argc - optind < 2)
+		return -EINVAL;
+
+	if (argc - optind == 2 && strcmp(argv[optind + 1], "-") == 0) {
+		// Read the image names from stdin, one per line.
+		while ((len = getline(&line, &line_size, stdin)) != -1) {
+			if (len > 0 && line[len - 1] == '\n')
+				line[--len] = '\0';
+			if (len == 0)
+				continue;
+			if (b.num_images == max_images) {
+				struct build_image *images;
+				max_images = max_images == 0 ? 1024 : 2 * max_images;
+				images = realloc(b.images,
+						max_images * sizeof (struct build_image));
+				if (images == NULL)
+					return 1;
+				b.images = images;
+			}
+			memset(&b.images[b.num_images], '\0',
+					sizeof (struct build_image));
+			b.images[b.num_images].path = strdup(line);
+			if (b.images[b.num_images].path == NULL)
+				return 1;
+			b.num_images++;
+		}
+		free(line);
+	} else {
+		b.num_images = argc - optind - 1;
+		b.images = calloc(b.num_images, sizeof (struct build_image));
+		if (b.images == NULL)
+			return 1;
+		for (i = 0; i < (long) b.num_images; i++)
+			b.images[i].path = argv[optind + 1 + i];
+	}
+	if (b.num_images > UINT32_MAX)
+		return -EFBIG;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_init(&b.lock, NULL);
+	threads = malloc(num_threads * sizeof (pthread_t));
+	if (threads == NULL)
+		return 1;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, build_worker, &b) != 0) {
+			num_threads = i;
+			break;
+		}
+	}
+	if (num_threads == 0) {
+		// Couldn't start any threads; do it ourselves.
+		build_worker(&b);
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < (long) b.num_images; i++) {
+		if (b.images[i].error < 0) {
+			errors++;
+			continue;
+		}
+		num_files += b.images[i].num_files;
+		dir_bytes += b.images[i].dir_bytes;
+	}
+
+	res = build_write(&b, argv[optind]);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "operacatalog: %zu images, %zu files, %.1f MiB of "
+			"directories in %.3f s (%.1f images/s, %.1f MiB/s), "
+			"%d error(s)\n", b.num_images, num_files,
+			dir_bytes / 1048576.0, secs,
+			secs > 0 ? b.num_images / secs : 0.0,
+			secs > 0 ? dir_bytes / 1048576.0 / secs : 0.0, errors);
+
+	for (i = 0; i < (long) b.num_images; i++) {
+		free(b.images[i].files);
+		free(b.images[i].strings);
+	}
+	free(b.images);
+	if (res < 0)
+		return 1;
+	return errors == 0 ? 0 : 1;
+}
+
+
+//============================================================================
+
+
+struct catalog {
+	const uint8_t *data;
+	size_t size;
+	const struct catalog_header *header;
+	const struct catalog_image *images;
+	const struct catalog_file *files;
+	const uint32_t *by_name;
+	const uint32_t *by_size;
+	const char *strings;
+};
+
+static int
+catalog_open(struct catalog *cat, const char *path)
+{
+	const struct catalog_header *h;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "operacatalog: could not open %s: %s\n", path,
+				strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof *h) {
+		fprintf(stderr, "operacatalog: %s is not a catalog.\n", path);
+		close(fd);
+		return -1;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "operacatalog: could not map %s: %s\n", path,
+				strerror(errno));
+		return -1;
+	}
+
+	cat->data = data;
+	cat->size = st.st_size;
+	h = (const struct catalog_header *) data;
+	if (memcmp(h->magic, CATALOG_MAGIC, sizeof h->magic) != 0 ||
+			h->byte_order != 0x01020304 ||
+			h->images_off + (uint64_t) h->num_images *
+					sizeof (struct catalog_image) > cat->size ||
+			h->files_off + h->num_files * sizeof (struct catalog_file) >
+					cat->size ||
+			h->by_name_off + h->num_files * sizeof (uint32_t) > cat->size ||
+			h->by_size_off + h->num_files * sizeof (uint32_t) > cat->size ||
+			h->strings_off + h->strings_size > cat->size ||
+			(h->strings_size > 0 &&
+			cat->data[h->strings_off + h->strings_size - 1] != '\0')) {
+		fprintf(stderr, "operacatalog: %s is not a valid catalog (or was "
+				"written on a host with another byte order).\n", path);
+		munmap(data, st.st_size);
+		return -1;
+	}
+	cat->header = h;
+	cat->images = (const struct catalog_image *) (cat->data + h->images_off);
+	cat->files = (const struct catalog_file *) (cat->data + h->files_off);
+	cat->by_name = (const uint32_t *) (cat->data + h->by_name_off);
+	cat->by_size = (const uint32_t *) (cat->data + h->by_size_off);
+	cat->strings = (const char *) (cat->data + h->strings_off);
+	return 0;
+}
+
+static void
+catalog_print(const struct catalog *cat, uint32_t index)
+{
+	const struct catalog_file *file = &cat->files[index];
+
+	printf("%s\t%s\t%u\n", cat->strings + cat->images[file->image].path,
+			cat->strings + file->path, file->size);
+}
+
+static const char *
+catalog_name(const struct catalog *cat, uint32_t index)
+{
+	const struct catalog_file *file = &cat->files[index];
+
+	return cat->strings + file->path + file->name;
+}
+
+static int
+cmd_find(int argc, char *argv[])
+{
+	struct catalog cat;
+	const char *name;
+	size_t name_len;
+	int prefix = 0;
+	uint64_t lo, hi, mid;
+	int found = 0;
+
+	if (argc != 3)
+		return -EINVAL;
+	if (catalog_open(&cat, argv[1]) < 0)
+		return 1;
+
+	name = argv[2];
+	name_len = strlen(name);
+	if (name_len > 0 && name[name_len - 1] == '*') {
+		prefix = 1;
+		name_len--;
+	}
+
+	// Find the first entry not before 'name'.
+	lo = 0;
+	hi = cat.header->num_files;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(catalog_name(&cat, cat.by_name[mid]), name,
+				name_len) < 0 ||
+				(!prefix && strcmp(catalog_name(&cat, cat.by_name[mid]),
+				name) < 0)) {
+			lo = mid + 1;
+		} else
+			hi = mid;
+	}
+
+	for (; lo < cat.header->num_files; lo++) {
+		const char *entry_name = catalog_name(&cat, cat.by_name[lo]);
+		if (prefix ? strncmp(entry_name, name, name_len) != 0 :
+				strcmp(entry_name, name) != 0)
+			break;
+		catalog_print(&cat, cat.by_name[lo]);
+		found = 1;
+	}
+
+	munmap((void *) cat.data, cat.size);
+	return found ? 0 : 1;
+}
+
+static int
+cmd_size(int argc, char *argv[])
+{
+	struct catalog cat;
+	unsigned long long min, max;
+	uint64_t lo, hi, mid;
+	int found = 0;
+
+	if (argc != 3 && argc != 4)
+		return -EINVAL;
+	min = strtoull(argv[2], NULL, 0);
+	max = argc == 4 ? strtoull(argv[3], NULL, 0) : min;
+	if (catalog_open(&cat, argv[1]) < 0)
+		return 1;
+
+	lo = 0;
+	hi = cat.header->num_files;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cat.files[cat.by_size[mid]].size < min) {
+			lo = mid + 1;
+		} else
+			hi = mid;
+	}
+
+	for (; lo < cat.header->num_files; lo++) {
+		if (cat.files[cat.by_size[lo]].size > max)
+			break;
+		catalog_print(&cat, cat.by_size[lo]);
+		found = 1;
+	}
+
+	munmap((void *) cat.data, cat.size);
+	return found ? 0 : 1;
+}
+
+
+//============================================================================
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s build [-j threads] [-s] <catalog> "
+			"<image>...\n"
+			"       %s build [-j threads] [-s] <catalog> -\n"
+			"       %s find <catalog> <name>\n"
+			"       %s size <catalog> <min> [<max>]\n"
+			"    -j threads   number of indexing threads (default: number "
+			"of CPUs)\n"
+			"    -s           also index special files\n"
+			"    -            read the image names from stdin\n"
+			"A name ending in '*' matches all names starting with what "
+			"comes before it.\n",
+			progname, progname, progname, progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int res;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "build") == 0) {
+		res = cmd_build(argc - 1, argv + 1);
+	} else if (strcmp(argv[1], "find") == 0) {
+		res = cmd_find(argc - 1, argv + 1);
+	} else if (strcmp(argv[1], "size") == 0) {
+		res = cmd_size(argc - 1, argv + 1);
+	} else
+		res = -EINVAL;
+
+	if (res == -EINVAL) {
+		usage(argv[0]);
+		return 1;
+	}
+	return res < 0 ? 1 : res;
+}
+
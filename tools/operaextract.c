@@ -0,0 +1,446 @@
+/*
+ * operaextract.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Extract all files from an Opera image, without mounting it.
+//
+// Usage: operaextract [-j threads] [-s] [-v] <image> <destdir>
+//
+// The directory tree is read first and all directories are created.
+// The files are then sorted by their position on the disk and copied by
+// a pool of threads which take them in that order, so that the reads
+// from the image stay (nearly) sequential. The data is moved with
+// copy_file_range() (or sendfile() where that is not supported) straight
+// from the image, so it does not pass through user space.
+//
+// Nothing is written outside <destdir>, even if it already contains
+// symlinks: paths are resolved with openat2(RESOLVE_BENEATH |
+// RESOLVE_NO_SYMLINKS) where the kernel has it, and otherwise one
+// component at a time, refusing anything that is not a real directory.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#	include <linux/openat2.h>
+#endif
+
+#include "opera_image.h"
+
+
+//============================================================================
+
+
+struct extract_file {
+	uint64_t offset;  // position of the data in the image, in bytes
+	uint32_t size;  // byte_count
+	char *path;  // relative to the destination directory
+};
+
+struct extract {
+	struct opera_image img;
+	int dest_fd;  // the destination directory
+	int verbose;
+
+	struct extract_file *files;
+	size_t num_files;
+	size_t max_files;
+
+	size_t next_file;  // next file to be taken by a worker
+	pthread_mutex_t lock;
+	uint64_t bytes_done;
+	int errors;
+};
+
+static int extract_walk_callback(void *data, const char *path,
+		const struct opera_entry *entry);
+static void *extract_worker(void *data);
+static int extract_copy(struct extract *ex, const struct extract_file *file);
+static int extract_open_parent(struct extract *ex, const char *path,
+		const char **leaf);
+
+
+//============================================================================
+
+
+static int
+extract_cmp_offset(const void *a, const void *b)
+{
+	const struct extract_file *fa = (const struct extract_file *) a;
+	const struct extract_file *fb = (const struct extract_file *) b;
+
+	if (fa->offset != fb->offset)
+		return fa->offset < fb->offset ? -1 : 1;
+	return 0;
+}
+
+// Open the directory that 'path' (relative to the destination) is in,
+// without following any symlinks. On success, *leaf is set to the last
+// component of 'path'. Returns a file descriptor or a negative errno.
+static int
+extract_open_parent(struct extract *ex, const char *path, const char **leaf)
+{
+	char dir[PATH_MAX];
+	char name[NAME_MAX + 1];
+	const char *slash, *comp, *end;
+	int fd, next;
+	size_t len;
+
+	slash = strrchr(path, '/');
+	if (slash == NULL) {
+		*leaf = path;
+		fd = dup(ex->dest_fd);
+		return fd == -1 ? -errno : fd;
+	}
+	*leaf = slash + 1;
+	len = slash - path;
+	if (len >= sizeof dir)
+		return -ENAMETOOLONG;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+#ifdef SYS_openat2
+	{
+		struct open_how how;
+
+		memset(&how, '\0', sizeof how);
+		how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+		fd = syscall(SYS_openat2, ex->dest_fd, dir, &how, sizeof how);
+		if (fd != -1)
+			return fd;
+		if (errno != ENOSYS)
+			return -errno;
+		// Older kernel; walk the path ourselves.
+	}
+#endif
+
+	fd = dup(ex->dest_fd);
+	if (fd == -1)
+		return -errno;
+	for (comp = dir; *comp != '\0'; comp = *end == '/' ? end + 1 : end) {
+		end = strchrnul(comp, '/');
+		len = end - comp;
+		memcpy(name, comp, len);
+		name[len] = '\0';
+		next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+				O_CLOEXEC);
+				// Fails on a symlink (ELOOP) or on anything which is not
+				// a directory (ENOTDIR).
+		close(fd);
+		if (next == -1)
+			return -errno;
+		fd = next;
+	}
+	return fd;
+}
+
+static int
+extract_walk_callback(void *data, const char *path,
+		const struct opera_entry *entry)
+{
+	struct extract *ex = (struct extract *) data;
+	struct extract_file *file;
+	const char *leaf;
+	struct stat st;
+	int error;
+	int fd;
+
+	if (entry->dtype == DT_DIR) {
+		fd = extract_open_parent(ex, path, &leaf);
+		error = fd < 0 ? fd : 0;
+		if (error == 0 && mkdirat(fd, leaf, 0777) == -1) {
+			error = -errno;
+			if (error == -EEXIST) {
+				// Fine, if it is a real directory.
+				error = 0;
+				if (fstatat(fd, leaf, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+					error = -errno;
+				} else if (!S_ISDIR(st.st_mode))
+					error = -ENOTDIR;
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+		if (error < 0) {
+			fprintf(stderr, "operaextract: could not create %s: %s\n",
+					path, strerror(-error));
+			return error;
+		}
+		return 0;
+	}
+
+	if (ex->num_files == ex->max_files) {
+		size_t max = ex->max_files == 0 ? 1024 : 2 * ex->max_files;
+		file = realloc(ex->files, max * sizeof (struct extract_file));
+		if (file == NULL)
+			return -ENOMEM;
+		ex->files = file;
+		ex->max_files = max;
+	}
+
+	file = &ex->files[ex->num_files];
+	file->offset = opera_entry_offset(&ex->img, entry);
+	file->size = entry->byte_count;
+	if (file->offset + file->size > ex->img.size) {
+		fprintf(stderr, "operaextract: %s extends past the end of the "
+				"image; skipped.\n", path);
+		ex->errors++;
+		return 0;
+	}
+	file->path = strdup(path);
+	if (file->path == NULL)
+		return -ENOMEM;
+	ex->num_files++;
+	return 0;
+}
+
+static void *
+extract_worker(void *data)
+{
+	struct extract *ex = (struct extract *) data;
+	const struct extract_file *file;
+
+	for (;;) {
+		pthread_mutex_lock(&ex->lock);
+		if (ex->next_file == ex->num_files) {
+			pthread_mutex_unlock(&ex->lock);
+			break;
+		}
+		file = &ex->files[ex->next_file++];
+		pthread_mutex_unlock(&ex->lock);
+
+		if (extract_copy(ex, file) < 0) {
+			pthread_mutex_lock(&ex->lock);
+			ex->errors++;
+			pthread_mutex_unlock(&ex->lock);
+		}
+	}
+	return NULL;
+}
+
+static int
+extract_copy(struct extract *ex, const struct extract_file *file)
+{
+	loff_t in_off = file->offset;
+	off_t sf_off;
+	size_t left = file->size;
+	ssize_t len;
+	int use_sendfile = 0;
+	const char *leaf;
+	int dir_fd;
+	int fd;
+	int error;
+
+	dir_fd = extract_open_parent(ex, file->path, &leaf);
+	if (dir_fd < 0) {
+		fprintf(stderr, "operaextract: could not create %s: %s\n",
+				file->path, strerror(-dir_fd));
+		return dir_fd;
+	}
+	fd = openat(dir_fd, leaf,
+			O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0666);
+			// O_NOFOLLOW: the parent is safe, but the file itself may
+			// be a symlink planted in the destination.
+	error = -errno;
+	close(dir_fd);
+	if (fd == -1) {
+		fprintf(stderr, "operaextract: could not create %s: %s\n",
+				file->path, strerror(-error));
+		return error;
+	}
+
+	while (left > 0) {
+		if (!use_sendfile) {
+			len = copy_file_range(ex->img.fd, &in_off, fd, NULL, left, 0);
+			if (len == -1 && (errno == EXDEV || errno == ENOSYS ||
+					errno == EINVAL || errno == EOPNOTSUPP)) {
+				// Not supported between these two files (older kernels,
+				// or the image is a block device).
+				use_sendfile = 1;
+				continue;
+			}
+		} else {
+			sf_off = in_off;
+			len = sendfile(fd, ex->img.fd, &sf_off, left);
+			in_off = sf_off;
+		}
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			error = -errno;
+			fprintf(stderr, "operaextract: error writing %s: %s\n",
+					file->path, strerror(errno));
+			close(fd);
+			return error;
+		}
+		if (len == 0) {
+			// The image is shorter than when it was walked (it was
+			// checked then), or the destination takes no more data.
+			// Either way, the file is incomplete.
+			fprintf(stderr, "operaextract: error writing %s: %s\n",
+					file->path, strerror(EIO));
+			close(fd);
+			return -EIO;
+		}
+		left -= len;
+	}
+
+	if (close(fd) == -1) {
+		error = -errno;
+		fprintf(stderr, "operaextract: error writing %s: %s\n",
+				file->path, strerror(errno));
+		return error;
+	}
+
+	pthread_mutex_lock(&ex->lock);
+	ex->bytes_done += file->size;
+	pthread_mutex_unlock(&ex->lock);
+
+	if (ex->verbose)
+		printf("%s\n", file->path);
+	return 0;
+}
+
+
+//============================================================================
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-s] [-v] <image> <destdir>\n"
+			"    -j threads   number of copying threads (default: number "
+			"of CPUs)\n"
+			"    -s           also extract special files\n"
+			"    -v           print the name of each extracted file\n",
+			progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct extract ex;
+	struct timespec start, end;
+	pthread_t *threads;
+	long num_threads;
+	int show_special = 0;
+	double secs;
+	long i;
+	int opt;
+	int res;
+
+	memset(&ex, '\0', sizeof ex);
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+
+	while ((opt = getopt(argc, argv, "j:sv")) != -1) {
+		switch (opt) {
+			case 'j':
+				num_threads = strtol(optarg, NULL, 10);
+				if (num_threads < 1) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 's':
+				show_special = 1;
+				break;
+			case 'v':
+				ex.verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (opera_image_open(&ex.img, argv[optind]) < 0)
+		return 1;
+
+	if (mkdir(argv[optind + 1], 0777) == -1 && errno != EEXIST) {
+		fprintf(stderr, "operaextract: could not create %s: %s\n",
+				argv[optind + 1], strerror(errno));
+		return 1;
+	}
+	ex.dest_fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ex.dest_fd == -1) {
+		fprintf(stderr, "operaextract: could not open %s: %s\n",
+				argv[optind + 1], strerror(errno));
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	res = opera_image_walk(&ex.img, show_special, extract_walk_callback,
+			&ex);
+	if (res < 0)
+		return 1;
+
+	qsort(ex.files, ex.num_files, sizeof (struct extract_file),
+			extract_cmp_offset);
+
+	pthread_mutex_init(&ex.lock, NULL);
+	threads = malloc(num_threads * sizeof (pthread_t));
+	if (threads == NULL)
+		return 1;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, extract_worker, &ex) != 0) {
+			num_threads = i;
+			break;
+		}
+	}
+	if (num_threads == 0) {
+		// Couldn't start any threads; do it ourselves.
+		extract_worker(&ex);
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "operaextract: %zu files, %llu bytes in %.3f s "
+			"(%.1f MiB/s), %d error(s)\n", ex.num_files,
+			(unsigned long long) ex.bytes_done, secs,
+			secs > 0 ? ex.bytes_done / 1048576.0 / secs : 0.0, ex.errors);
+
+	for (i = 0; i < (long) ex.num_files; i++)
+		free(ex.files[i].path);
+	free(ex.files);
+	free(threads);
+	close(ex.dest_fd);
+	opera_image_close(&ex.img);
+	return ex.errors == 0 ? 0 : 1;
+}
+
@@ -0,0 +1,727 @@
+/*
+ * operafuse.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// FUSE implementation of the Opera file system, for where the kernel
+// module cannot be loaded.
+//
+// Usage: operafuse <image> <mountpoint> [-o uid=,gid=,umask=,fmask=,
+//                  dmask=,showspecial,hidespecial,nosplice] [FUSE options]
+//
+// The mount options, modes, link counts and inode numbers are the same
+// as those of the kernel module; the inode number of an entry is its
+// position on the disk.
+//
+// The image is mmapped and the whole directory tree is read into memory
+// at startup; after that, metadata requests are served without touching
+// the image. File data is passed to the kernel by splicing straight from
+// the image file descriptor, so it is never copied through user space.
+// Requests are handled by the multithreaded session loop; all state is
+// read-only after startup, so no locking is needed.
+
+#define FUSE_USE_VERSION 31
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse_lowlevel.h>
+
+#include "opera_image.h"
+
+
+//============================================================================
+
+
+struct operafuse_options {
+	char *image;
+	unsigned int uid;  // uid of files and directories
+	unsigned int gid;  // gid of files and directories
+	unsigned int fmask;  // file mask
+	unsigned int dmask;  // directory mask
+	unsigned int umask;  // sets both masks, if not -1
+	int show_special;  // show special files?
+	int nosplice;  // don't splice file data to the kernel
+};
+
+struct opera_node {
+	uint64_t ino;  // position of the directory entry on the disk
+	uint32_t parent;  // index of the parent directory node
+	uint32_t first_child;  // index of the first child node
+	uint32_t num_children;
+	uint32_t num_subdirs;
+	uint32_t flags;
+	uint32_t id;
+	uint8_t type[4];
+	uint32_t byte_count;
+	uint32_t block_count;
+	uint32_t start_block;
+	uint32_t last_copy;
+	const uint32_t *copies;  // big-endian, pointing into the image
+	unsigned int dtype;
+	char name[OPERA_NAME_MAX + 1];
+};
+
+struct operafuse {
+	struct opera_image img;
+	struct operafuse_options options;
+
+	struct opera_node *nodes;
+			// Node 0 is the root. The children of each directory are
+			// consecutive, in the order of the directory on the disk.
+	uint32_t *by_name;
+			// Per directory, the indices of its children sorted by name,
+			// at the same positions as the children in 'nodes'.
+	uint32_t num_nodes;
+	uint32_t max_nodes;
+	uint32_t node_limit;
+			// Upper bound on num_nodes. Every directory entry takes at
+			// least 72 bytes of the image, so more nodes than fit in the
+			// image means that some directory was read twice: a loop.
+	uint32_t cur_dir;  // directory being read by operafuse_load_tree()
+};
+
+#define OPERAFUSE_TIMEOUT 86400.0
+		// Nothing ever changes, so the kernel may cache as long as it
+		// likes.
+
+static int operafuse_load_tree(struct operafuse *fs);
+static int operafuse_add_node(void *data, const struct opera_entry *entry);
+
+static void operafuse_init(void *userdata, struct fuse_conn_info *conn);
+static void operafuse_lookup(fuse_req_t req, fuse_ino_t parent,
+		const char *name);
+static void operafuse_getattr(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi);
+static void operafuse_open(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi);
+static void operafuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi);
+static void operafuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi);
+static void operafuse_statfs(fuse_req_t req, fuse_ino_t ino);
+static void operafuse_getxattr(fuse_req_t req, fuse_ino_t ino,
+		const char *name, size_t size);
+static void operafuse_listxattr(fuse_req_t req, fuse_ino_t ino,
+		size_t size);
+
+
+//============================================================================
+
+
+static const struct fuse_lowlevel_ops operafuse_ops = {
+	.init = operafuse_init,
+	.lookup = operafuse_lookup,
+	.getattr = operafuse_getattr,
+	.open = operafuse_open,
+	.read = operafuse_read,
+	.readdir = operafuse_readdir,
+	.statfs = operafuse_statfs,
+	.getxattr = operafuse_getxattr,
+	.listxattr = operafuse_listxattr,
+};
+
+#define OPERAFUSE_OPT(t, p, v) \
+		{ t, offsetof(struct operafuse_options, p), v }
+
+static const struct fuse_opt operafuse_opts[] = {
+	OPERAFUSE_OPT("uid=%u", uid, 0),
+	OPERAFUSE_OPT("gid=%u", gid, 0),
+	OPERAFUSE_OPT("umask=%o", umask, 0),
+	OPERAFUSE_OPT("dmask=%o", dmask, 0),
+	OPERAFUSE_OPT("fmask=%o", fmask, 0),
+	OPERAFUSE_OPT("showspecial", show_special, 1),
+	OPERAFUSE_OPT("hidespecial", show_special, 0),
+	OPERAFUSE_OPT("nosplice", nosplice, 1),
+	FUSE_OPT_END
+};
+
+// Attribute names, as returned by listxattr(). Same as in xattr.c.
+static const char operafuse_xattr_names[] =
+		"opera.type\0"
+		"opera.id\0"
+		"opera.flags\0"
+		"opera.last_copy\0"
+		"opera.copies";
+
+
+//============================================================================
+
+
+static inline struct operafuse *
+OPERAFUSE(fuse_req_t req)
+{
+	return (struct operafuse *) fuse_req_userdata(req);
+}
+
+// Inode 1 is the root for FUSE; node indices start at 0.
+static inline const struct opera_node *
+operafuse_node(struct operafuse *fs, fuse_ino_t ino)
+{
+	if (ino == 0 || ino > fs->num_nodes)
+		return NULL;
+	return &fs->nodes[ino - 1];
+}
+
+static int
+operafuse_opt_proc(void *data, const char *arg, int key,
+		struct fuse_args *outargs)
+{
+	struct operafuse_options *options = (struct operafuse_options *) data;
+
+	if (key == FUSE_OPT_KEY_NONOPT && options->image == NULL) {
+		options->image = strdup(arg);
+		return 0;  // Consumed
+	}
+
+	(void) outargs;  /* Unused variable - satisfy compiler */
+	return 1;  // Keep it for fuse_parse_cmdline()
+}
+
+static int
+operafuse_load_tree(struct operafuse *fs)
+{
+	const struct opera_disk_superblock *dsb =
+			(const struct opera_disk_superblock *) fs->img.data;
+	struct opera_node *root;
+	uint32_t i;
+	int res;
+
+	fs->node_limit = fs->img.size / 72 + 1;
+	if (fs->img.size / 72 + 1 > UINT32_MAX / 2)
+		fs->node_limit = UINT32_MAX / 2;
+	fs->max_nodes = 1024;
+	fs->nodes = malloc(fs->max_nodes * sizeof (struct opera_node));
+	if (fs->nodes == NULL)
+		return -ENOMEM;
+
+	root = &fs->nodes[0];
+	memset(root, '\0', sizeof *root);
+	root->ino = OPERA_ROOT_INO;
+	root->flags = OPERA_DIRENT_DIR;
+	root->id = be32toh(dsb->root.id);
+	memcpy(root->type, "*dir", sizeof root->type);
+	root->block_count = fs->img.root_blocks;
+	root->byte_count = fs->img.root_blocks * fs->img.block_size;
+	root->start_block = fs->img.root_start;
+	root->last_copy = be32toh(dsb->root.last_copy);
+	if (root->last_copy >= NUM_COPIES_ROOT)
+		root->last_copy = 0;
+	root->copies = (const uint32_t *) ((const uint8_t *) dsb +
+			offsetof(struct opera_disk_superblock, root.copies));
+	root->dtype = DT_DIR;
+	fs->num_nodes = 1;
+
+	// Breadth first, so that the children of each directory end up
+	// next to each other.
+	for (i = 0; i < fs->num_nodes; i++) {
+		if (fs->nodes[i].dtype != DT_DIR)
+			continue;
+		fs->nodes[i].first_child = fs->num_nodes;
+		fs->cur_dir = i;
+		res = opera_image_for_all_entries(&fs->img,
+				fs->nodes[i].start_block, fs->nodes[i].block_count,
+				fs->options.show_special, operafuse_add_node, fs);
+		if (res < 0)
+			return res;
+		fs->nodes[i].num_children = fs->num_nodes - fs->nodes[i].first_child;
+	}
+
+	return 0;
+}
+
+static int
+operafuse_add_node(void *data, const struct opera_entry *entry)
+{
+	struct operafuse *fs = (struct operafuse *) data;
+	struct opera_node *node;
+
+	if (fs->num_nodes >= fs->node_limit) {
+		fprintf(stderr, "Opera: more directory entries than fit in the "
+				"image; directory loop? (disk #%08X)\n", fs->img.disk_id);
+		return -ELOOP;
+	}
+
+	if (fs->num_nodes == fs->max_nodes) {
+		struct opera_node *nodes;
+		uint32_t max_nodes;
+
+		max_nodes = fs->max_nodes * 2;
+		if (max_nodes > fs->node_limit)
+			max_nodes = fs->node_limit;
+		nodes = realloc(fs->nodes, (size_t) max_nodes *
+				sizeof (struct opera_node));
+		if (nodes == NULL)
+			return -ENOMEM;
+		fs->nodes = nodes;
+		fs->max_nodes = max_nodes;
+	}
+
+	node = &fs->nodes[fs->num_nodes];
+	node->ino = entry->ino;
+	node->parent = fs->cur_dir;
+	node->first_child = 0;
+	node->num_children = 0;
+	node->num_subdirs = 0;
+	node->flags = entry->flags;
+	node->id = entry->id;
+	memcpy(node->type, entry->type, sizeof node->type);
+	node->byte_count = entry->byte_count;
+	node->block_count = entry->block_count;
+	node->start_block = opera_entry_copy(entry, 0);
+	node->last_copy = entry->last_copy;
+	node->copies = entry->copies;
+	node->dtype = entry->dtype;
+	memcpy(node->name, entry->name, entry->name_len + 1);
+	fs->num_nodes++;
+
+	if (entry->dtype == DT_DIR)
+		fs->nodes[fs->cur_dir].num_subdirs++;
+	return 0;
+}
+
+static struct operafuse *operafuse_sort_fs;
+		// qsort() has no user data argument; only used at startup.
+
+static int
+operafuse_cmp_name(const void *a, const void *b)
+{
+	const struct opera_node *na = &operafuse_sort_fs->nodes[*(uint32_t *) a];
+	const struct opera_node *nb = &operafuse_sort_fs->nodes[*(uint32_t *) b];
+
+	return strcmp(na->name, nb->name);
+}
+
+static int
+operafuse_index_names(struct operafuse *fs)
+{
+	uint32_t i;
+
+	fs->by_name = malloc(fs->num_nodes * sizeof (uint32_t));
+	if (fs->by_name == NULL)
+		return -ENOMEM;
+	for (i = 0; i < fs->num_nodes; i++)
+		fs->by_name[i] = i;
+
+	operafuse_sort_fs = fs;
+	for (i = 0; i < fs->num_nodes; i++) {
+		const struct opera_node *node = &fs->nodes[i];
+		if (node->dtype != DT_DIR || node->num_children == 0)
+			continue;
+		qsort(&fs->by_name[node->first_child], node->num_children,
+				sizeof (uint32_t), operafuse_cmp_name);
+	}
+	return 0;
+}
+
+static void
+operafuse_fill_attr(struct operafuse *fs, const struct opera_node *node,
+		struct stat *st)
+{
+	memset(st, '\0', sizeof *st);
+	st->st_ino = node->ino;
+	st->st_uid = fs->options.uid;
+	st->st_gid = fs->options.gid;
+	st->st_blocks = node->block_count;
+	st->st_blksize = fs->img.block_size;
+	if (node->dtype == DT_DIR) {
+		st->st_mode = (0777 & ~fs->options.dmask) | S_IFDIR;
+		st->st_size = (off_t) node->block_count * fs->img.block_size;
+		st->st_nlink = 2 + node->num_subdirs;
+	} else {
+		st->st_mode = (0666 & ~fs->options.fmask) | S_IFREG;
+		st->st_size = node->byte_count;
+		st->st_nlink = 1;
+	}
+}
+
+
+//============================================================================
+
+
+static void
+operafuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct operafuse *fs = (struct operafuse *) userdata;
+
+	if (!fs->options.nosplice) {
+		if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+			conn->want |= FUSE_CAP_SPLICE_WRITE;
+		if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+			conn->want |= FUSE_CAP_SPLICE_MOVE;
+	}
+}
+
+static void
+operafuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	const struct opera_node *dir = operafuse_node(fs, parent);
+	struct fuse_entry_param e;
+	uint32_t lo, hi, mid;
+	int cmp;
+
+	if (dir == NULL || dir->dtype != DT_DIR) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	lo = dir->first_child;
+	hi = dir->first_child + dir->num_children;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(name, fs->nodes[fs->by_name[mid]].name);
+		if (cmp == 0) {
+			memset(&e, '\0', sizeof e);
+			e.ino = fs->by_name[mid] + 1;
+			e.attr_timeout = OPERAFUSE_TIMEOUT;
+			e.entry_timeout = OPERAFUSE_TIMEOUT;
+			operafuse_fill_attr(fs, &fs->nodes[fs->by_name[mid]], &e.attr);
+			fuse_reply_entry(req, &e);
+			return;
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else
+			lo = mid + 1;
+	}
+
+	fuse_reply_err(req, ENOENT);
+}
+
+static void
+operafuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	const struct opera_node *node = operafuse_node(fs, ino);
+	struct stat st;
+
+	if (node == NULL) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	operafuse_fill_attr(fs, node, &st);
+	fuse_reply_attr(req, &st, OPERAFUSE_TIMEOUT);
+	(void) fi;  /* Unused variable - satisfy compiler */
+}
+
+static void
+operafuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	const struct opera_node *node = operafuse_node(fs, ino);
+
+	if (node == NULL) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (node->dtype == DT_DIR) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void
+operafuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	const struct opera_node *node = operafuse_node(fs, ino);
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(0);
+	uint64_t pos;
+
+	if (node == NULL || node->dtype == DT_DIR) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	if (off < 0 || (uint64_t) off >= node->byte_count) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (size > (uint64_t) node->byte_count - off)
+		size = node->byte_count - off;
+
+	pos = ((uint64_t) node->start_block << fs->img.block_shift) + off;
+	if (pos >= fs->img.size) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	if (size > fs->img.size - pos)
+		size = fs->img.size - pos;
+
+	if (fs->options.nosplice) {
+		fuse_reply_buf(req, (const char *) fs->img.data + pos, size);
+		return;
+	}
+
+	buf.buf[0].size = size;
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fs->img.fd;
+	buf.buf[0].pos = pos;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+
+	(void) fi;  /* Unused variable - satisfy compiler */
+}
+
+static void
+operafuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	const struct opera_node *dir = operafuse_node(fs, ino);
+	const struct opera_node *node;
+	struct stat st;
+	char *buf;
+	size_t used = 0;
+	size_t len;
+	const char *name;
+
+	if (dir == NULL || dir->dtype != DT_DIR) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// Offsets 0 and 1 are "." and "..", the children follow.
+	memset(&st, '\0', sizeof st);
+	for (; (uint64_t) off < (uint64_t) dir->num_children + 2; off++) {
+		if (off == 0) {
+			node = dir;
+			name = ".";
+		} else if (off == 1) {
+			node = &fs->nodes[dir->parent];
+			name = "..";
+		} else {
+			node = &fs->nodes[dir->first_child + off - 2];
+			name = node->name;
+		}
+		st.st_ino = node->ino;
+		st.st_mode = node->dtype == DT_DIR ? S_IFDIR : S_IFREG;
+		len = fuse_add_direntry(req, buf + used, size - used, name, &st,
+				off + 1);
+		if (len > size - used)
+			break;
+		used += len;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+	(void) fi;  /* Unused variable - satisfy compiler */
+}
+
+static void
+operafuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	struct statvfs st;
+
+	memset(&st, '\0', sizeof st);
+	st.f_bsize = fs->img.block_size;
+	st.f_frsize = fs->img.block_size;
+	st.f_blocks = fs->img.block_count;
+	st.f_files = fs->num_nodes;
+	st.f_namemax = OPERA_NAME_MAX;
+	fuse_reply_statfs(req, &st);
+	(void) ino;  /* Unused variable - satisfy compiler */
+}
+
+static void
+operafuse_reply_xattr(fuse_req_t req, size_t size, const char *value,
+		size_t len)
+{
+	if (size == 0) {
+		fuse_reply_xattr(req, len);
+	} else if (len > size) {
+		fuse_reply_err(req, ERANGE);
+	} else
+		fuse_reply_buf(req, value, len);
+}
+
+static void
+operafuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size)
+{
+	struct operafuse *fs = OPERAFUSE(req);
+	const struct opera_node *node = operafuse_node(fs, ino);
+	char str[16];
+	char *copies;
+	size_t len = 0;
+	uint32_t i;
+
+	if (node == NULL) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (strcmp(name, "opera.type") == 0) {
+		len = strnlen((const char *) node->type, sizeof node->type);
+		operafuse_reply_xattr(req, size, (const char *) node->type, len);
+	} else if (strcmp(name, "opera.id") == 0) {
+		len = snprintf(str, sizeof str, "%08X", node->id);
+		operafuse_reply_xattr(req, size, str, len);
+	} else if (strcmp(name, "opera.flags") == 0) {
+		len = snprintf(str, sizeof str, "%08X", node->flags);
+		operafuse_reply_xattr(req, size, str, len);
+	} else if (strcmp(name, "opera.last_copy") == 0) {
+		len = snprintf(str, sizeof str, "%u", node->last_copy);
+		operafuse_reply_xattr(req, size, str, len);
+	} else if (strcmp(name, "opera.copies") == 0) {
+		copies = malloc((node->last_copy + 1) * 11 + 1);
+		if (copies == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		for (i = 0; i <= node->last_copy; i++) {
+			len += sprintf(copies + len, i == 0 ? "%u" : " %u",
+					be32toh(node->copies[i]));
+		}
+		operafuse_reply_xattr(req, size, copies, len);
+		free(copies);
+	} else
+		fuse_reply_err(req, ENODATA);
+}
+
+static void
+operafuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	operafuse_reply_xattr(req, size, operafuse_xattr_names,
+			sizeof operafuse_xattr_names);
+	(void) ino;  /* Unused variable - satisfy compiler */
+}
+
+
+//============================================================================
+
+
+static void
+operafuse_usage(const char *progname)
+{
+	printf("Usage: %s <image> <mountpoint> [options]\n"
+			"\n"
+			"Opera options:\n"
+			"    -o uid=N, gid=N        owner of all files and directories\n"
+			"    -o umask=M, fmask=M, dmask=M\n"
+			"                           permission masks (octal)\n"
+			"    -o showspecial         show special files\n"
+			"    -o hidespecial         hide special files (default)\n"
+			"    -o nosplice            reply from the mmapped image instead "
+			"of splicing\n"
+			"\n", progname);
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	struct operafuse fs;
+	mode_t mask;
+	int res;
+	int ret = 1;
+
+	memset(&fs, '\0', sizeof fs);
+	mask = umask(0);
+	umask(mask);
+	fs.options.uid = getuid();
+	fs.options.gid = getgid();
+	fs.options.fmask = mask;
+	fs.options.dmask = mask;
+	fs.options.umask = (unsigned int) -1;
+	fs.options.show_special = 0;  // as OPERA_DEFAULT_SHOW_SPECIAL
+
+	if (fuse_opt_parse(&args, &fs.options, operafuse_opts,
+			operafuse_opt_proc) == -1)
+		return 1;
+	if (fs.options.umask != (unsigned int) -1) {
+		fs.options.fmask = fs.options.umask;
+		fs.options.dmask = fs.options.umask;
+	}
+
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if (opts.show_help || fs.options.image == NULL ||
+			opts.mountpoint == NULL) {
+		operafuse_usage(argv[0]);
+		ret = opts.show_help ? 0 : 1;
+		goto out_args;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out_args;
+	}
+
+	res = opera_image_open(&fs.img, fs.options.image);
+	if (res < 0)
+		goto out_args;
+	if (operafuse_load_tree(&fs) < 0 || operafuse_index_names(&fs) < 0)
+		goto out_image;
+
+	se = fuse_session_new(&args, &operafuse_ops, sizeof operafuse_ops, &fs);
+	if (se == NULL)
+		goto out_image;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		res = fuse_session_loop(se);
+	} else
+		res = fuse_session_loop_mt(se, opts.clone_fd);
+	ret = res == 0 ? 0 : 1;
+
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+out_image:
+	free(fs.by_name);
+	free(fs.nodes);
+	opera_image_close(&fs.img);
+out_args:
+	free(opts.mountpoint);
+	free(fs.options.image);
+	fuse_opt_free_args(&args);
+	return ret;
+}
+
@@ -0,0 +1,581 @@
+/*
+ * operaprewarm.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Save the access trace of a mount, and replay it on a later mount of
+// the same disk to get the page cache warm before it is needed.
+//
+// Usage: operaprewarm save <mountpoint> <tracedir>
+//        operaprewarm replay [-j threads] <mountpoint> <tracedir>
+//
+// The mount needs the trace=<records> option for 'save' to have
+// something to save (see trace.c). Traces are stored per disk, as
+// <tracedir>/<disk_id>.trace:
+//   disk_id <id>
+//   <ino> <pos> <len> <path>
+//   ...
+// which is the format of /proc/fs/opera/<device>/trace with the path of
+// each file, relative to the mount point, added. 'save' walks the mount
+// once to find those paths, so that 'replay' does not have to.
+//
+// 'replay' merges the read ranges of each file, and hands them, in the
+// order in which the files were first touched, to a pool of threads
+// issuing posix_fadvise(POSIX_FADV_WILLNEED), which starts the reads
+// without waiting for them.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+
+//============================================================================
+
+
+struct prewarm_record {
+	uint64_t ino;
+	uint64_t pos;
+	uint64_t len;
+	size_t seq;  // position in the trace
+	const char *path;
+			// Relative to the mount point. NULL while not known. Shared
+			// between the records of the same file.
+};
+
+struct prewarm_path {
+	uint64_t ino;
+	char *path;
+};
+
+struct prewarm_job {
+	const char *path;
+	uint64_t pos;
+	uint64_t len;
+};
+
+struct prewarm {
+	struct prewarm_record *records;
+	size_t num_records;
+	size_t max_records;
+
+	struct prewarm_path *paths;  // sorted by inode number
+	size_t num_paths;
+	size_t paths_found;
+	size_t prefix_len;  // length of the mount point path, for nftw()
+
+	int mount_fd;
+	struct prewarm_job *jobs;
+	size_t num_jobs;
+	size_t next_job;
+	pthread_mutex_t lock;
+	uint64_t bytes;
+};
+
+static struct prewarm prewarm;
+		// nftw() has no user data argument.
+
+
+//============================================================================
+
+
+// Find /proc/fs/opera/<device>/trace for a mount point.
+static int
+prewarm_proc_trace(const char *mountpoint, char *buf, size_t size)
+{
+	char link[PATH_MAX];
+	char target[PATH_MAX];
+	const char *name;
+	struct stat st;
+	ssize_t len;
+
+	if (stat(mountpoint, &st) == -1) {
+		fprintf(stderr, "operaprewarm: %s: %s\n", mountpoint,
+				strerror(errno));
+		return -1;
+	}
+
+	snprintf(link, sizeof link, "/sys/dev/block/%u:%u",
+			major(st.st_dev), minor(st.st_dev));
+	len = readlink(link, target, sizeof target - 1);
+	if (len == -1) {
+		fprintf(stderr, "operaprewarm: %s is not on a block device.\n",
+				mountpoint);
+		return -1;
+	}
+	target[len] = '\0';
+	name = strrchr(target, '/');
+	name = name == NULL ? target : name + 1;
+
+	snprintf(buf, size, "/proc/fs/opera/%s/trace", name);
+	return 0;
+}
+
+static int
+prewarm_read_disk_id(FILE *f, char *disk_id)
+{
+	if (fscanf(f, "disk_id %8[0-9A-Fa-f]\n", disk_id) != 1) {
+		fprintf(stderr, "operaprewarm: not an Opera trace.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+prewarm_cmp_path_ino(const void *a, const void *b)
+{
+	const struct prewarm_path *pa = (const struct prewarm_path *) a;
+	const struct prewarm_path *pb = (const struct prewarm_path *) b;
+
+	return pa->ino < pb->ino ? -1 : pa->ino > pb->ino;
+}
+
+static const char *
+prewarm_find_path(uint64_t ino)
+{
+	struct prewarm_path key;
+	const struct prewarm_path *p;
+
+	key.ino = ino;
+	p = bsearch(&key, prewarm.paths, prewarm.num_paths,
+			sizeof (struct prewarm_path), prewarm_cmp_path_ino);
+	return p == NULL ? NULL : p->path;
+}
+
+static int
+prewarm_add_record(uint64_t ino, uint64_t pos, uint64_t len,
+		const char *path)
+{
+	struct prewarm_record *r;
+
+	if (prewarm.num_records == prewarm.max_records) {
+		prewarm.max_records = prewarm.max_records == 0 ? 4096 :
+				2 * prewarm.max_records;
+		r = realloc(prewarm.records,
+				prewarm.max_records * sizeof (struct prewarm_record));
+		if (r == NULL)
+			return -1;
+		prewarm.records = r;
+	}
+	r = &prewarm.records[prewarm.num_records];
+	r->ino = ino;
+	r->pos = pos;
+	r->len = len;
+	r->seq = prewarm.num_records;
+	r->path = path;
+	prewarm.num_records++;
+	return 0;
+}
+
+static int
+prewarm_walk_callback(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	struct prewarm_path key;
+	struct prewarm_path *p;
+	const char *rel;
+
+	(void) ftw;  /* Unused variable - satisfy compiler */
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	key.ino = st->st_ino;
+	p = bsearch(&key, prewarm.paths, prewarm.num_paths,
+			sizeof (struct prewarm_path), prewarm_cmp_path_ino);
+	if (p == NULL || p->path != NULL)
+		return 0;  // Not in the trace.
+	if (strchr(path, '\n') != NULL)
+		return 0;  // Cannot be stored in the trace file.
+
+	rel = path + prewarm.prefix_len;
+	if (*rel == '/')
+		rel++;
+	p->path = strdup(rel);
+	if (p->path == NULL)
+		return -1;
+	prewarm.paths_found++;
+	return prewarm.paths_found == prewarm.num_paths ? 1 : 0;
+			// Stop when all have been found.
+}
+
+// Find the path of every file in the trace.
+static int
+prewarm_resolve(const char *mountpoint)
+{
+	size_t i, n;
+	int res;
+
+	prewarm.paths = malloc((prewarm.num_records + 1) *
+			sizeof (struct prewarm_path));
+	if (prewarm.paths == NULL)
+		return -1;
+	for (i = 0; i < prewarm.num_records; i++) {
+		prewarm.paths[i].ino = prewarm.records[i].ino;
+		prewarm.paths[i].path = NULL;
+	}
+	qsort(prewarm.paths, prewarm.num_records, sizeof (struct prewarm_path),
+			prewarm_cmp_path_ino);
+	n = 0;
+	for (i = 0; i < prewarm.num_records; i++) {
+		if (n == 0 || prewarm.paths[i].ino != prewarm.paths[n - 1].ino)
+			prewarm.paths[n++] = prewarm.paths[i];
+	}
+	prewarm.num_paths = n;
+	if (n == 0)
+		return 0;
+
+	prewarm.prefix_len = strlen(mountpoint);
+	res = nftw(mountpoint, prewarm_walk_callback, 32, FTW_PHYS | FTW_MOUNT);
+	if (res == -1) {
+		fprintf(stderr, "operaprewarm: error walking %s\n", mountpoint);
+		return -1;
+	}
+
+	for (i = 0; i < prewarm.num_records; i++)
+		prewarm.records[i].path = prewarm_find_path(prewarm.records[i].ino);
+	return 0;
+}
+
+static int
+prewarm_save(const char *mountpoint, const char *tracedir)
+{
+	char proc_path[PATH_MAX + 32];
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 8];
+	char disk_id[9];
+	unsigned long long ino, pos, len;
+	const struct prewarm_record *r;
+	size_t num_saved = 0;
+	FILE *in, *out;
+	size_t i;
+
+	if (prewarm_proc_trace(mountpoint, proc_path, sizeof proc_path) < 0)
+		return 1;
+	in = fopen(proc_path, "r");
+	if (in == NULL) {
+		fprintf(stderr, "operaprewarm: %s: %s\n", proc_path,
+				strerror(errno));
+		return 1;
+	}
+	if (prewarm_read_disk_id(in, disk_id) < 0)
+		return 1;
+	while (fscanf(in, "%llu %llu %llu\n", &ino, &pos, &len) == 3) {
+		if (prewarm_add_record(ino, pos, len, NULL) < 0) {
+			fprintf(stderr, "operaprewarm: out of memory\n");
+			return 1;
+		}
+	}
+	fclose(in);
+
+	if (prewarm.num_records == 0) {
+		fprintf(stderr, "operaprewarm: the trace of %s is empty. Was it "
+				"mounted with trace=<records>?\n", mountpoint);
+		return 1;
+	}
+	if (prewarm_resolve(mountpoint) < 0)
+		return 1;
+
+	snprintf(path, sizeof path, "%s/%s.trace", tracedir, disk_id);
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+	out = fopen(tmp_path, "w");
+	if (out == NULL) {
+		fprintf(stderr, "operaprewarm: %s: %s\n", tmp_path,
+				strerror(errno));
+		return 1;
+	}
+
+	fprintf(out, "disk_id %s\n", disk_id);
+	for (i = 0; i < prewarm.num_records; i++) {
+		r = &prewarm.records[i];
+		if (r->path == NULL)
+			continue;  // Gone, or not a regular file.
+		fprintf(out, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n",
+				r->ino, r->pos, r->len, r->path);
+		num_saved++;
+	}
+
+	if (fclose(out) != 0 || rename(tmp_path, path) == -1) {
+		fprintf(stderr, "operaprewarm: %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		return 1;
+	}
+
+	printf("operaprewarm: saved %zu of %zu records for disk #%s\n",
+			num_saved, prewarm.num_records, disk_id);
+	return 0;
+}
+
+static int
+prewarm_load(const char *path, const char *expected_disk_id)
+{
+	char disk_id[9];
+	char file[PATH_MAX + 1];
+	unsigned long long ino, pos, len;
+	const char *last_path = NULL;
+	size_t file_len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "operaprewarm: no trace for disk #%s (%s: %s)\n",
+				expected_disk_id, path, strerror(errno));
+		return -1;
+	}
+	if (prewarm_read_disk_id(f, disk_id) < 0 ||
+			strcasecmp(disk_id, expected_disk_id) != 0) {
+		fclose(f);
+		return -1;
+	}
+
+	while (fscanf(f, "%llu %llu %llu ", &ino, &pos, &len) == 3) {
+		if (fgets(file, sizeof file, f) == NULL)
+			break;
+		file_len = strlen(file);
+		if (file_len == 0 || file[file_len - 1] != '\n') {
+			fprintf(stderr, "operaprewarm: %s: bad record; saved by an "
+					"older operaprewarm?\n", path);
+			fclose(f);
+			return -1;
+		}
+		file[file_len - 1] = '\0';
+		if (len == 0)
+			continue;  // An open; opening the file covers those.
+
+		// The records of one file tend to be together.
+		if (last_path == NULL || strcmp(last_path, file) != 0) {
+			last_path = strdup(file);
+			if (last_path == NULL) {
+				fclose(f);
+				return -1;
+			}
+		}
+		if (prewarm_add_record(ino, pos, len, last_path) < 0) {
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+// By inode, then by position, so that ranges of one file can be merged.
+static int
+prewarm_cmp_record_range(const void *a, const void *b)
+{
+	const struct prewarm_record *ra = (const struct prewarm_record *) a;
+	const struct prewarm_record *rb = (const struct prewarm_record *) b;
+
+	if (ra->ino != rb->ino)
+		return ra->ino < rb->ino ? -1 : 1;
+	if (ra->pos != rb->pos)
+		return ra->pos < rb->pos ? -1 : 1;
+	return 0;
+}
+
+static int
+prewarm_cmp_record_seq(const void *a, const void *b)
+{
+	const struct prewarm_record *ra = (const struct prewarm_record *) a;
+	const struct prewarm_record *rb = (const struct prewarm_record *) b;
+
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+// Merge overlapping and adjacent ranges of the same file. A merged
+// range keeps the earliest trace position of its parts, so that it is
+// replayed when the first of them was read.
+static void
+prewarm_merge(void)
+{
+	struct prewarm_record *r = prewarm.records;
+	size_t i, n = 0;
+
+	if (prewarm.num_records == 0)
+		return;
+
+	qsort(r, prewarm.num_records, sizeof *r, prewarm_cmp_record_range);
+	for (i = 1; i < prewarm.num_records; i++) {
+		if (r[i].ino == r[n].ino && r[i].pos <= r[n].pos + r[n].len) {
+			if (r[i].pos + r[i].len > r[n].pos + r[n].len)
+				r[n].len = r[i].pos + r[i].len - r[n].pos;
+			if (r[i].seq < r[n].seq)
+				r[n].seq = r[i].seq;
+		} else
+			r[++n] = r[i];
+	}
+	prewarm.num_records = n + 1;
+	qsort(r, prewarm.num_records, sizeof *r, prewarm_cmp_record_seq);
+}
+
+static void *
+prewarm_worker(void *data)
+{
+	const struct prewarm_job *job;
+	int fd;
+
+	(void) data;  /* Unused variable - satisfy compiler */
+	for (;;) {
+		pthread_mutex_lock(&prewarm.lock);
+		if (prewarm.next_job == prewarm.num_jobs) {
+			pthread_mutex_unlock(&prewarm.lock);
+			break;
+		}
+		job = &prewarm.jobs[prewarm.next_job++];
+		pthread_mutex_unlock(&prewarm.lock);
+
+		fd = openat(prewarm.mount_fd, job->path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;  // Not on this disk after all?
+		if (posix_fadvise(fd, job->pos, job->len,
+				POSIX_FADV_WILLNEED) == 0) {
+			pthread_mutex_lock(&prewarm.lock);
+			prewarm.bytes += job->len;
+			pthread_mutex_unlock(&prewarm.lock);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int
+prewarm_replay(const char *mountpoint, const char *tracedir,
+		long num_threads)
+{
+	char proc_path[PATH_MAX + 32];
+	char path[PATH_MAX];
+	char disk_id[9];
+	pthread_t *threads;
+	FILE *f;
+	size_t i;
+	long t;
+
+	if (prewarm_proc_trace(mountpoint, proc_path, sizeof proc_path) < 0)
+		return 1;
+	f = fopen(proc_path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "operaprewarm: %s: %s\n", proc_path,
+				strerror(errno));
+		return 1;
+	}
+	if (prewarm_read_disk_id(f, disk_id) < 0)
+		return 1;
+	fclose(f);
+
+	snprintf(path, sizeof path, "%s/%s.trace", tracedir, disk_id);
+	if (prewarm_load(path, disk_id) < 0)
+		return 1;
+	prewarm_merge();
+
+	prewarm.mount_fd = open(mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (prewarm.mount_fd == -1) {
+		fprintf(stderr, "operaprewarm: %s: %s\n", mountpoint,
+				strerror(errno));
+		return 1;
+	}
+
+	prewarm.jobs = malloc((prewarm.num_records + 1) *
+			sizeof (struct prewarm_job));
+	threads = malloc(num_threads * sizeof (pthread_t));
+	if (prewarm.jobs == NULL || threads == NULL)
+		return 1;
+	for (i = 0; i < prewarm.num_records; i++) {
+		prewarm.jobs[prewarm.num_jobs].path = prewarm.records[i].path;
+		prewarm.jobs[prewarm.num_jobs].pos = prewarm.records[i].pos;
+		prewarm.jobs[prewarm.num_jobs].len = prewarm.records[i].len;
+		prewarm.num_jobs++;
+	}
+
+	pthread_mutex_init(&prewarm.lock, NULL);
+	for (t = 0; t < num_threads; t++) {
+		if (pthread_create(&threads[t], NULL, prewarm_worker, NULL) != 0)
+			break;
+	}
+	if (t == 0)
+		prewarm_worker(NULL);
+	num_threads = t;
+	for (t = 0; t < num_threads; t++)
+		pthread_join(threads[t], NULL);
+
+	printf("operaprewarm: disk #%s, %zu ranges, %" PRIu64 " bytes "
+			"requested\n", disk_id, prewarm.num_jobs, prewarm.bytes);
+	free(threads);
+	return 0;
+}
+
+
+//============================================================================
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s save <mountpoint> <tracedir>\n"
+			"       %s replay [-j threads] <mountpoint> <tracedir>\n",
+			progname, progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long num_threads = 8;
+	int opt;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "save") == 0) {
+		if (argc != 4) {
+			usage(argv[0]);
+			return 1;
+		}
+		return prewarm_save(argv[2], argv[3]);
+	}
+
+	if (strcmp(argv[1], "replay") == 0) {
+		optind = 2;
+		while ((opt = getopt(argc, argv, "j:")) != -1) {
+			switch (opt) {
+				case 'j':
+					num_threads = strtol(optarg, NULL, 10);
+					break;
+				default:
+					usage(argv[0]);
+					return 1;
+			}
+		}
+		if (argc - optind != 2 || num_threads < 1) {
+			usage(argv[0]);
+			return 1;
+		}
+		return prewarm_replay(argv[optind], argv[optind + 1], num_threads);
+	}
+
+	usage(argv[0]);
+	return 1;
+}
+
@@ -0,0 +1,1438 @@
+/*
+ * operastore.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// A deduplicating store for collections of Opera images.
+//
+// Usage: operastore ingest [-j threads] <store> <image>...
+//        operastore stats <store>
+//        operastore rebuild <store> <name> <output>
+//        operastore serve <store> <name> </dev/nbdN>
+//
+// Each image is split into the contents of its files and the rest (the
+// superblock, the directories and whatever lies between the files). The
+// file contents are stored as objects named by their SHA-256 hash, so a
+// file that is the same in many images (such as between regional
+// versions or revisions of a game) is stored only once. The rest of the
+// image is stored as one more object, with the runs of zero blocks left
+// out. A recipe per image lists where each object goes.
+//
+// 'rebuild' puts an image back together and checks it against the hash
+// of the original. 'serve' makes the image available as a read-only
+// network block device, served from the store without rebuilding it,
+// which can then be mounted with the driver:
+//     operastore serve store game.iso /dev/nbd0 &
+//     mount -t opera -o ro /dev/nbd0 /mnt
+// The image name is the base name of the image file at ingest time.
+// Names are unique: ingesting an image whose name is already taken by a
+// different image fails (rename the file first); ingesting the same image
+// again does nothing.
+//
+// Layout of the store:
+//     <store>/objects/xx/yyyy...  objects, by hex SHA-256 (xx are the
+//                                 first two digits)
+//     <store>/images/<name>       recipes
+// A recipe is a struct store_recipe_header followed by num_extents
+// struct store_extent, sorted by offset, all little-endian. The bytes of
+// the image not covered by any extent are, in order, the contents of the
+// residual object.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/nbd.h>
+
+#include "opera_image.h"
+#include "sha256.h"
+
+
+//============================================================================
+
+
+#define STORE_RECIPE_MAGIC "OPSTRCP1"
+
+struct store_recipe_header {
+	char magic[8];  // STORE_RECIPE_MAGIC
+	uint32_t block_size;
+	uint32_t disk_id;
+	uint64_t image_size;
+	uint64_t num_extents;
+	uint64_t residual_size;
+	uint8_t image_hash[SHA256_SIZE];
+	uint8_t residual_hash[SHA256_SIZE];
+};
+
+enum {
+	STORE_EXTENT_OBJECT,  // the contents of the object 'hash'
+	STORE_EXTENT_ZERO,  // zero bytes
+};
+
+struct store_extent {
+	uint64_t offset;
+	uint64_t length;
+	uint32_t kind;
+	uint32_t reserved;  // 0
+	uint8_t hash[SHA256_SIZE];
+};
+
+struct store {
+	const char *path;
+
+	pthread_mutex_t lock;
+	unsigned int tmp_counter;  // for unique temporary file names
+	uint64_t image_bytes;  // size of the images ingested
+	uint64_t file_bytes;  // bytes in file extents
+	uint64_t zero_bytes;  // bytes in zero extents
+	uint64_t new_bytes;  // bytes in newly stored objects
+	uint64_t new_objects;
+	uint64_t old_objects;  // objects which were already present
+};
+
+struct ingest {
+	struct store *store;
+	char **images;
+	size_t num_images;
+	size_t next_image;  // next image to be taken by a worker
+	pthread_mutex_t lock;
+	int errors;
+};
+
+// An image being ingested.
+struct ingest_image {
+	struct store *store;
+	const struct opera_image *img;
+	struct store_extent *extents;
+	size_t num_extents;
+	size_t max_extents;
+};
+
+// A part of an image, when reading it back from the store.
+struct store_span {
+	uint64_t offset;
+	uint64_t length;
+	const uint8_t *data;  // NULL for zeroes
+};
+
+// An image in the store, opened for reading.
+struct store_image {
+	struct store_recipe_header header;  // in host byte order
+	struct store_span *spans;  // cover the whole image
+	size_t num_spans;
+
+	void **maps;  // the mmapped objects
+	size_t *map_sizes;
+	size_t num_maps;
+};
+
+static int ingest_walk_callback(void *data, const char *path,
+		const struct opera_entry *entry);
+static void *ingest_worker(void *data);
+static int store_read_recipe(const char *recipe_path,
+		struct store_recipe_header *header,
+		struct store_extent **extents_ret);
+
+
+//============================================================================
+
+
+static void
+hash_to_hex(const uint8_t hash[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1])
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < SHA256_SIZE; i++) {
+		hex[2 * i] = digits[hash[i] >> 4];
+		hex[2 * i + 1] = digits[hash[i] & 0x0f];
+	}
+	hex[2 * SHA256_SIZE] = '\0';
+}
+
+static int
+is_zero(const uint8_t *data, size_t len)
+{
+	return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+static char *
+store_object_path(const char *store_path, const uint8_t hash[SHA256_SIZE])
+{
+	char hex[2 * SHA256_SIZE + 1];
+	char *path;
+
+	hash_to_hex(hash, hex);
+	if (asprintf(&path, "%s/objects/%.2s/%s", store_path, hex, hex + 2) == -1)
+		return NULL;
+	return path;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+	ssize_t res;
+
+	while (len > 0) {
+		res = write(fd, p, len);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+// fsync() a directory, so that the entries made in it are on the disk.
+static int
+fsync_dir(const char *path)
+{
+	int error = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+	if (fsync(fd) == -1)
+		error = -errno;
+	close(fd);
+	return error;
+}
+
+// fsync() the directory containing 'path'.
+static int
+fsync_parent(const char *path)
+{
+	char *dir, *slash;
+	int error;
+
+	dir = strdup(path);
+	if (dir == NULL)
+		return -ENOMEM;
+	slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		free(dir);
+		return fsync_dir(".");
+	}
+	*slash = '\0';
+	error = fsync_dir(dir);
+	free(dir);
+	return error;
+}
+
+// Write a file through a temporary file in the same directory, so that
+// nobody ever sees a partial file. If 'exclusive' is set, fail with
+// -EEXIST if the file already exists, otherwise replace it.
+// The file and its directory entry are on the disk when this returns 0,
+// so whatever is written next may refer to it, even after a crash.
+static int
+store_write_file(struct store *store, const char *path, int exclusive,
+		const void *data1, size_t len1, const void *data2, size_t len2)
+{
+	char *tmp_path;
+	unsigned int counter;
+	int error;
+	int fd;
+
+	pthread_mutex_lock(&store->lock);
+	counter = store->tmp_counter++;
+	pthread_mutex_unlock(&store->lock);
+	if (asprintf(&tmp_path, "%s.tmp.%d.%u", path, (int) getpid(),
+			counter) == -1)
+		return -ENOMEM;
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		error = -errno;
+		free(tmp_path);
+		return error;
+	}
+	error = write_all(fd, data1, len1);
+	if (error == 0)
+		error = write_all(fd, data2, len2);
+	if (error == 0 && fsync(fd) == -1)
+		error = -errno;
+	if (close(fd) == -1 && error == 0)
+		error = -errno;
+	if (error == 0 && exclusive) {
+		if (link(tmp_path, path) == -1)
+			error = -errno;
+		unlink(tmp_path);
+	} else {
+		if (error == 0 && rename(tmp_path, path) == -1)
+			error = -errno;
+		if (error < 0)
+			unlink(tmp_path);
+	}
+	if (error == 0)
+		error = fsync_parent(path);
+	free(tmp_path);
+	return error;
+}
+
+// Store an object, unless it is already present.
+static int
+store_put(struct store *store, const uint8_t hash[SHA256_SIZE],
+		const void *data, size_t len)
+{
+	char *path;
+	char *slash;
+	int error;
+
+	path = store_object_path(store->path, hash);
+	if (path == NULL)
+		return -ENOMEM;
+
+	if (access(path, F_OK) == 0) {
+		pthread_mutex_lock(&store->lock);
+		store->old_objects++;
+		pthread_mutex_unlock(&store->lock);
+		free(path);
+		return 0;
+	}
+
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	if (mkdir(path, 0777) == 0) {
+		error = fsync_parent(path);
+	} else
+		error = errno == EEXIST ? 0 : -errno;
+	*slash = '/';
+	if (error < 0) {
+		free(path);
+		return error;
+	}
+
+	// Two threads may write the same object at the same time; only
+	// one of them gets to create it.
+	error = store_write_file(store, path, 1, data, len, NULL, 0);
+	pthread_mutex_lock(&store->lock);
+	if (error == 0) {
+		store->new_objects++;
+		store->new_bytes += len;
+	} else if (error == -EEXIST) {
+		store->old_objects++;
+		error = 0;
+	}
+	pthread_mutex_unlock(&store->lock);
+	free(path);
+	return error;
+}
+
+
+//============================================================================
+
+
+static int
+ingest_add_extent(struct ingest_image *ii, uint64_t offset, uint64_t length,
+		uint32_t kind, const uint8_t *hash)
+{
+	struct store_extent *extent;
+
+	if (ii->num_extents == ii->max_extents) {
+		size_t max = ii->max_extents == 0 ? 256 : 2 * ii->max_extents;
+		extent = realloc(ii->extents, max * sizeof (struct store_extent));
+		if (extent == NULL)
+			return -ENOMEM;
+		ii->extents = extent;
+		ii->max_extents = max;
+	}
+
+	extent = &ii->extents[ii->num_extents++];
+	memset(extent, '\0', sizeof *extent);
+	extent->offset = offset;
+	extent->length = length;
+	extent->kind = kind;
+	if (hash != NULL)
+		memcpy(extent->hash, hash, SHA256_SIZE);
+	return 0;
+}
+
+static int
+ingest_walk_callback(void *data, const char *path,
+		const struct opera_entry *entry)
+{
+	struct ingest_image *ii = (struct ingest_image *) data;
+	const struct opera_image *img = ii->img;
+	uint8_t hash[SHA256_SIZE];
+	uint64_t offset0, offset;
+	uint32_t i;
+	int error;
+
+	(void) path;  /* Unused variable - satisfy compiler */
+
+	if (entry->dtype == DT_DIR || entry->byte_count == 0)
+		return 0;
+
+	offset0 = opera_entry_offset(img, entry);
+	if (offset0 + entry->byte_count > img->size) {
+		// Leave it in the residual object.
+		return 0;
+	}
+
+	sha256(img->data + offset0, entry->byte_count, hash);
+	error = store_put(ii->store, hash, img->data + offset0,
+			entry->byte_count);
+	if (error < 0)
+		return error;
+
+	// The other copies of the file normally hold the same bytes.
+	for (i = 0; i <= entry->last_copy; i++) {
+		offset = (uint64_t) opera_entry_copy(entry, i) << img->block_shift;
+		if (offset + entry->byte_count > img->size)
+			continue;
+		if (i > 0 && memcmp(img->data + offset, img->data + offset0,
+				entry->byte_count) != 0)
+			continue;
+		error = ingest_add_extent(ii, offset, entry->byte_count,
+				STORE_EXTENT_OBJECT, hash);
+		if (error < 0)
+			return error;
+	}
+	return 0;
+}
+
+static int
+extent_cmp_offset(const void *a, const void *b)
+{
+	const struct store_extent *ea = (const struct store_extent *) a;
+	const struct store_extent *eb = (const struct store_extent *) b;
+
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	if (ea->length != eb->length)
+		return ea->length > eb->length ? -1 : 1;
+	return 0;
+}
+
+// Find the runs of zero blocks in [start, end), add them as extents and
+// copy the other bytes to the residual.
+static int
+ingest_gap(struct ingest_image *ii, uint64_t start, uint64_t end,
+		uint8_t *residual, uint64_t *residual_size)
+{
+	const struct opera_image *img = ii->img;
+	uint64_t pos = start;
+	uint64_t block, zero_start;
+	int error;
+
+	block = (start + img->block_size - 1) & ~((uint64_t) img->block_size - 1);
+	while (block + img->block_size <= end) {
+		if (!is_zero(img->data + block, img->block_size)) {
+			block += img->block_size;
+			continue;
+		}
+		zero_start = block;
+		do
+			block += img->block_size;
+		while (block + img->block_size <= end &&
+				is_zero(img->data + block, img->block_size));
+
+		memcpy(residual + *residual_size, img->data + pos, zero_start - pos);
+		*residual_size += zero_start - pos;
+		error = ingest_add_extent(ii, zero_start, block - zero_start,
+				STORE_EXTENT_ZERO, NULL);
+		if (error < 0)
+			return error;
+		pos = block;
+	}
+	memcpy(residual + *residual_size, img->data + pos, end - pos);
+	*residual_size += end - pos;
+	return 0;
+}
+
+// There is already a recipe called 'name'. Returns 0 if it is for the
+// image with hash 'image_hash', and -EEXIST if it is for another image.
+static int
+ingest_check_existing(const char *recipe_path, const char *name,
+		const uint8_t image_hash[SHA256_SIZE])
+{
+	struct store_recipe_header header;
+	struct store_extent *extents;
+	int error;
+
+	error = store_read_recipe(recipe_path, &header, &extents);
+	if (error < 0)
+		return error;
+	free(extents);
+
+	if (memcmp(header.image_hash, image_hash, SHA256_SIZE) != 0) {
+		fprintf(stderr, "operastore: the store already has a different "
+				"image named %s; rename the image file to store it.\n",
+				name);
+		return -EEXIST;
+	}
+	fprintf(stderr, "operastore: %s is already in the store.\n", name);
+	return 0;
+}
+
+static int
+ingest_image(struct store *store, const char *image_path)
+{
+	struct opera_image img;
+	struct ingest_image ii;
+	struct store_recipe_header header;
+	struct store_extent *extents = NULL;
+	size_t num_extents, i, j;
+	uint8_t *residual = NULL;
+	uint64_t residual_size = 0;
+	uint64_t pos, file_bytes = 0, zero_bytes = 0;
+	const char *name;
+	char *recipe_path = NULL;
+	int error;
+
+	error = opera_image_open(&img, image_path);
+	if (error < 0)
+		return error;
+	// Before anything can 'goto out', which frees ii.extents.
+	memset(&ii, '\0', sizeof ii);
+	ii.store = store;
+	ii.img = &img;
+
+	name = strrchr(image_path, '/');
+	name = name == NULL ? image_path : name + 1;
+	if (asprintf(&recipe_path, "%s/images/%s", store->path, name) == -1) {
+		recipe_path = NULL;
+		error = -ENOMEM;
+		goto out;
+	}
+	if (access(recipe_path, F_OK) == 0) {
+		// Don't do all the work just to find out at the end.
+		sha256(img.data, img.size, header.image_hash);
+		error = ingest_check_existing(recipe_path, name, header.image_hash);
+		goto out;
+	}
+
+	error = opera_image_walk(&img, 1, ingest_walk_callback, &ii);
+	if (error < 0)
+		goto out;
+
+	// Entries may share blocks; an extent which overlaps an earlier one
+	// is dropped, and its bytes end up in the residual object.
+	qsort(ii.extents, ii.num_extents, sizeof (struct store_extent),
+			extent_cmp_offset);
+	num_extents = ii.num_extents;
+	extents = ii.extents;
+	for (i = 0, j = 0, pos = 0; i < num_extents; i++) {
+		if (extents[i].offset < pos)
+			continue;
+		extents[j++] = extents[i];
+		pos = extents[i].offset + extents[i].length;
+		file_bytes += extents[i].length;
+	}
+	num_extents = j;
+
+	// The zero extents are added to ii.extents, after the file extents.
+	ii.extents = NULL;
+	ii.num_extents = 0;
+	ii.max_extents = 0;
+	residual = malloc(img.size);
+	if (residual == NULL) {
+		error = -ENOMEM;
+		goto out;
+	}
+	for (i = 0, pos = 0; i <= num_extents; i++) {
+		uint64_t end = i < num_extents ? extents[i].offset : img.size;
+		error = ingest_gap(&ii, pos, end, residual, &residual_size);
+		if (error < 0)
+			goto out;
+		if (i < num_extents) {
+			error = ingest_add_extent(&ii, extents[i].offset,
+					extents[i].length, STORE_EXTENT_OBJECT, extents[i].hash);
+			if (error < 0)
+				goto out;
+			pos = extents[i].offset + extents[i].length;
+		}
+	}
+	free(extents);
+	extents = ii.extents;
+	num_extents = ii.num_extents;
+	ii.extents = NULL;
+
+	memset(&header, '\0', sizeof header);
+	memcpy(header.magic, STORE_RECIPE_MAGIC, sizeof header.magic);
+	header.block_size = htole32(img.block_size);
+	header.disk_id = htole32(img.disk_id);
+	header.image_size = htole64(img.size);
+	header.num_extents = htole64(num_extents);
+	header.residual_size = htole64(residual_size);
+	sha256(img.data, img.size, header.image_hash);
+	sha256(residual, residual_size, header.residual_hash);
+	error = store_put(store, header.residual_hash, residual, residual_size);
+	if (error < 0)
+		goto out;
+
+	for (i = 0; i < num_extents; i++) {
+		if (extents[i].kind == STORE_EXTENT_ZERO)
+			zero_bytes += extents[i].length;
+		extents[i].offset = htole64(extents[i].offset);
+		extents[i].length = htole64(extents[i].length);
+		extents[i].kind = htole32(extents[i].kind);
+	}
+
+	// All objects are on the disk by now; see store_write_file().
+	error = store_write_file(store, recipe_path, 1, &header, sizeof header,
+			extents, num_extents * sizeof (struct store_extent));
+	if (error == -EEXIST) {
+		// Another thread got there first.
+		error = ingest_check_existing(recipe_path, name, header.image_hash);
+		goto out;
+	}
+	if (error < 0)
+		goto out;
+
+	pthread_mutex_lock(&store->lock);
+	store->image_bytes += img.size;
+	store->file_bytes += file_bytes;
+	store->zero_bytes += zero_bytes;
+	pthread_mutex_unlock(&store->lock);
+
+out:
+	free(recipe_path);
+	free(residual);
+	free(extents);
+	free(ii.extents);
+	opera_image_close(&img);
+	return error;
+}
+
+static void *
+ingest_worker(void *data)
+{
+	struct ingest *in = (struct ingest *) data;
+	const char *path;
+	int error;
+
+	for (;;) {
+		pthread_mutex_lock(&in->lock);
+		if (in->next_image == in->num_images) {
+			pthread_mutex_unlock(&in->lock);
+			break;
+		}
+		path = in->images[in->next_image++];
+		pthread_mutex_unlock(&in->lock);
+
+		error = ingest_image(in->store, path);
+		if (error < 0) {
+			fprintf(stderr, "operastore: could not ingest %s: %s\n", path,
+					strerror(-error));
+			pthread_mutex_lock(&in->lock);
+			in->errors++;
+			pthread_mutex_unlock(&in->lock);
+		}
+	}
+	return NULL;
+}
+
+static int
+store_init(struct store *store, const char *path, int create)
+{
+	char *dir;
+	int error = 0;
+
+	memset(store, '\0', sizeof *store);
+	store->path = path;
+	pthread_mutex_init(&store->lock, NULL);
+	if (!create)
+		return 0;
+
+	if (mkdir(path, 0777) == -1 && errno != EEXIST)
+		return -errno;
+	if (asprintf(&dir, "%s/objects", path) == -1)
+		return -ENOMEM;
+	if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+		error = -errno;
+	free(dir);
+	if (error < 0)
+		return error;
+	if (asprintf(&dir, "%s/images", path) == -1)
+		return -ENOMEM;
+	if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+		error = -errno;
+	free(dir);
+	if (error < 0)
+		return error;
+	return fsync_dir(path);
+}
+
+static int
+cmd_ingest(int argc, char *argv[])
+{
+	struct store store;
+	struct ingest in;
+	struct timespec start, end;
+	pthread_t *threads;
+	long num_threads;
+	double secs;
+	long i;
+	int error;
+	int opt;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+			case 'j':
+				num_threads = strtol(optarg, NULL, 10);
+				if (num_threads < 1)
+					return -EINVAL;
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+	if (argc - optind < 2)
+		return -EINVAL;
+
+	error = store_init(&store, argv[optind], 1);
+	if (error < 0) {
+		fprintf(stderr, "operastore: could not create the store %s: %s\n",
+				argv[optind], strerror(-error));
+		return 1;
+	}
+
+	memset(&in, '\0', sizeof in);
+	in.store = &store;
+	in.images = argv + optind + 1;
+	in.num_images = argc - optind - 1;
+	pthread_mutex_init(&in.lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	threads = malloc(num_threads * sizeof (pthread_t));
+	if (threads == NULL)
+		return 1;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, ingest_worker, &in) != 0) {
+			num_threads = i;
+			break;
+		}
+	}
+	if (num_threads == 0) {
+		// Couldn't start any threads; do it ourselves.
+		ingest_worker(&in);
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "operastore: %zu images, %.1f MiB in %.3f s "
+			"(%.1f MiB/s), %d error(s)\n"
+			"    %.1f MiB in files, %.1f MiB in zero blocks\n"
+			"    %llu new objects (%.1f MiB), %llu already stored\n",
+			in.num_images - in.errors, store.image_bytes / 1048576.0, secs,
+			secs > 0 ? store.image_bytes / 1048576.0 / secs : 0.0,
+			in.errors, store.file_bytes / 1048576.0,
+			store.zero_bytes / 1048576.0,
+			(unsigned long long) store.new_objects,
+			store.new_bytes / 1048576.0,
+			(unsigned long long) store.old_objects);
+	return in.errors == 0 ? 0 : 1;
+}
+
+
+//============================================================================
+
+
+static int
+store_read_recipe(const char *recipe_path, struct store_recipe_header *header,
+		struct store_extent **extents_ret)
+{
+	struct store_extent *extents = NULL;
+	struct stat st;
+	uint64_t i, n;
+	int error = -EINVAL;
+	int fd;
+
+	fd = open(recipe_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		error = -errno;
+		goto out;
+	}
+	if (read(fd, header, sizeof *header) != sizeof *header ||
+			memcmp(header->magic, STORE_RECIPE_MAGIC,
+			sizeof header->magic) != 0)
+		goto out;
+	header->block_size = le32toh(header->block_size);
+	header->disk_id = le32toh(header->disk_id);
+	header->image_size = le64toh(header->image_size);
+	header->num_extents = le64toh(header->num_extents);
+	header->residual_size = le64toh(header->residual_size);
+	n = header->num_extents;
+	if ((uint64_t) st.st_size != sizeof *header +
+			n * sizeof (struct store_extent))
+		goto out;
+
+	extents = malloc(n * sizeof (struct store_extent) + 1);
+	if (extents == NULL) {
+		error = -ENOMEM;
+		goto out;
+	}
+	if (read(fd, extents, n * sizeof (struct store_extent)) !=
+			(ssize_t) (n * sizeof (struct store_extent)))
+		goto out;
+	for (i = 0; i < n; i++) {
+		extents[i].offset = le64toh(extents[i].offset);
+		extents[i].length = le64toh(extents[i].length);
+		extents[i].kind = le32toh(extents[i].kind);
+	}
+
+	*extents_ret = extents;
+	extents = NULL;
+	error = 0;
+
+out:
+	free(extents);
+	close(fd);
+	return error;
+}
+
+static const uint8_t *
+store_image_map(struct store_image *si, const char *store_path,
+		const uint8_t hash[SHA256_SIZE], uint64_t size)
+{
+	struct stat st;
+	char *path;
+	void *data;
+	int fd;
+
+	if (size == 0)
+		return (const uint8_t *) "";
+
+	path = store_object_path(store_path, hash);
+	if (path == NULL)
+		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "operastore: missing object %s\n", path);
+		free(path);
+		return NULL;
+	}
+	free(path);
+	if (fstat(fd, &st) == -1 || (uint64_t) st.st_size != size) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	si->maps[si->num_maps] = data;
+	si->map_sizes[si->num_maps] = size;
+	si->num_maps++;
+	return (const uint8_t *) data;
+}
+
+static int
+hash_index_cmp(const void *a, const void *b, void *data)
+{
+	const struct store_extent *extents = (const struct store_extent *) data;
+
+	return memcmp(extents[*(const size_t *) a].hash,
+			extents[*(const size_t *) b].hash, SHA256_SIZE);
+}
+
+static void
+store_image_close(struct store_image *si)
+{
+	size_t i;
+
+	for (i = 0; i < si->num_maps; i++)
+		munmap(si->maps[i], si->map_sizes[i]);
+	free(si->maps);
+	free(si->map_sizes);
+	free(si->spans);
+}
+
+static int
+store_image_open(struct store_image *si, const char *store_path,
+		const char *name)
+{
+	struct store_extent *extents = NULL;
+	const uint8_t **data = NULL;
+	const uint8_t *residual;
+	size_t *order = NULL;
+	char *recipe_path;
+	uint64_t pos, residual_pos;
+	size_t n, i;
+	int error;
+
+	memset(si, '\0', sizeof *si);
+	if (asprintf(&recipe_path, "%s/images/%s", store_path, name) == -1)
+		return -ENOMEM;
+	error = store_read_recipe(recipe_path, &si->header, &extents);
+	free(recipe_path);
+	if (error < 0)
+		return error;
+
+	n = si->header.num_extents;
+	error = -ENOMEM;
+	data = calloc(n + 1, sizeof *data);
+	order = malloc((n + 1) * sizeof *order);
+	si->maps = malloc((n + 1) * sizeof *si->maps);
+	si->map_sizes = malloc((n + 1) * sizeof *si->map_sizes);
+	si->spans = malloc((2 * n + 1) * sizeof *si->spans);
+	if (data == NULL || order == NULL || si->maps == NULL ||
+			si->map_sizes == NULL || si->spans == NULL)
+		goto out_err;
+
+	// Map each object once, even if it is used by several extents.
+	error = -EINVAL;
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	qsort_r(order, n, sizeof *order, hash_index_cmp, extents);
+	for (i = 0; i < n; i++) {
+		const struct store_extent *e = &extents[order[i]];
+		if (e->kind != STORE_EXTENT_OBJECT)
+			continue;
+		if (i > 0 && extents[order[i - 1]].kind == STORE_EXTENT_OBJECT &&
+				memcmp(extents[order[i - 1]].hash, e->hash,
+				SHA256_SIZE) == 0) {
+			data[order[i]] = data[order[i - 1]];
+			continue;
+		}
+		data[order[i]] = store_image_map(si, store_path, e->hash, e->length);
+		if (data[order[i]] == NULL)
+			goto out_err;
+	}
+	residual = store_image_map(si, store_path, si->header.residual_hash,
+			si->header.residual_size);
+	if (residual == NULL)
+		goto out_err;
+
+	// Fill the gaps between the extents from the residual object.
+	for (i = 0, pos = 0, residual_pos = 0; i <= n; i++) {
+		uint64_t end = i < n ? extents[i].offset : si->header.image_size;
+		if (end < pos || end > si->header.image_size)
+			goto out_err;
+		if (end > pos) {
+			if (residual_pos + (end - pos) > si->header.residual_size)
+				goto out_err;
+			si->spans[si->num_spans].offset = pos;
+			si->spans[si->num_spans].length = end - pos;
+			si->spans[si->num_spans].data = residual + residual_pos;
+			si->num_spans++;
+			residual_pos += end - pos;
+		}
+		if (i == n)
+			break;
+		si->spans[si->num_spans].offset = extents[i].offset;
+		si->spans[si->num_spans].length = extents[i].length;
+		si->spans[si->num_spans].data = data[i];
+		si->num_spans++;
+		pos = extents[i].offset + extents[i].length;
+	}
+	if (residual_pos != si->header.residual_size)
+		goto out_err;
+
+	free(order);
+	free(data);
+	free(extents);
+	return 0;
+
+out_err:
+	fprintf(stderr, "operastore: the recipe for %s is damaged or refers "
+			"to objects which are missing.\n", name);
+	free(order);
+	free(data);
+	free(extents);
+	store_image_close(si);
+	return error;
+}
+
+// Read 'len' bytes at 'offset' of the image. Returns the number of
+// bytes read, which is less than 'len' only at the end of the image.
+static size_t
+store_image_read(const struct store_image *si, uint8_t *buf, uint64_t offset,
+		size_t len)
+{
+	size_t lo = 0, hi = si->num_spans, mid;
+	size_t done = 0;
+
+	if (offset >= si->header.image_size)
+		return 0;
+	if (len > si->header.image_size - offset)
+		len = si->header.image_size - offset;
+
+	// Find the span which holds 'offset'.
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (si->spans[mid].offset <= offset) {
+			lo = mid;
+		} else
+			hi = mid;
+	}
+
+	for (; done < len; lo++) {
+		const struct store_span *span = &si->spans[lo];
+		uint64_t skip = offset + done - span->offset;
+		size_t n = span->length - skip;
+		if (n > len - done)
+			n = len - done;
+		if (span->data == NULL) {
+			memset(buf + done, '\0', n);
+		} else
+			memcpy(buf + done, span->data + skip, n);
+		done += n;
+	}
+	return done;
+}
+
+static int
+cmd_rebuild(int argc, char *argv[])
+{
+	struct store_image si;
+	struct sha256 ctx;
+	uint8_t hash[SHA256_SIZE];
+	struct timespec start, end;
+	uint64_t pos;
+	uint8_t *buf;
+	size_t n;
+	double secs;
+	int error = 0;
+	int fd;
+
+	if (argc != 4)
+		return -EINVAL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (store_image_open(&si, argv[1], argv[2]) < 0)
+		return 1;
+
+	buf = malloc(1 << 20);
+	fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (buf == NULL || fd == -1) {
+		fprintf(stderr, "operastore: could not create %s: %s\n", argv[3],
+				strerror(errno));
+		free(buf);
+		store_image_close(&si);
+		return 1;
+	}
+
+	sha256_init(&ctx);
+	for (pos = 0; pos < si.header.image_size; pos += n) {
+		n = store_image_read(&si, buf, pos, 1 << 20);
+		sha256_update(&ctx, buf, n);
+		error = write_all(fd, buf, n);
+		if (error < 0)
+			break;
+	}
+	sha256_final(&ctx, hash);
+	if (close(fd) == -1 && error == 0)
+		error = -errno;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(buf);
+	store_image_close(&si);
+
+	if (error < 0) {
+		fprintf(stderr, "operastore: error writing %s: %s\n", argv[3],
+				strerror(-error));
+		return 1;
+	}
+	if (memcmp(hash, si.header.image_hash, SHA256_SIZE) != 0) {
+		fprintf(stderr, "operastore: %s does not match the original "
+				"image.\n", argv[3]);
+		return 1;
+	}
+
+	secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "operastore: %.1f MiB in %.3f s (%.1f MiB/s), "
+			"verified\n", si.header.image_size / 1048576.0, secs,
+			secs > 0 ? si.header.image_size / 1048576.0 / secs : 0.0);
+	return 0;
+}
+
+
+//============================================================================
+
+
+static volatile int serve_nbd_fd = -1;
+
+static void
+serve_signal(int sig)
+{
+	(void) sig;  /* Unused variable - satisfy compiler */
+
+	if (serve_nbd_fd != -1)
+		ioctl(serve_nbd_fd, NBD_DISCONNECT);
+}
+
+static void *
+serve_do_it(void *data)
+{
+	int nbd_fd = *(int *) data;
+
+	// Returns when the device is disconnected.
+	ioctl(nbd_fd, NBD_DO_IT);
+	ioctl(nbd_fd, NBD_CLEAR_QUE);
+	ioctl(nbd_fd, NBD_CLEAR_SOCK);
+	return NULL;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *) buf;
+	ssize_t res;
+
+	while (len > 0) {
+		res = read(fd, p, len);
+		if (res == 0)
+			return -EPIPE;
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+// Answer the requests of the kernel on 'sock' until it disconnects.
+static int
+serve_requests(const struct store_image *si, int sock)
+{
+	struct nbd_request request;
+	struct nbd_reply reply;
+	uint8_t *buf = NULL;
+	size_t buf_size = 0;
+	uint64_t from;
+	uint32_t len;
+	int error;
+
+	for (;;) {
+		error = read_all(sock, &request, sizeof request);
+		if (error < 0)
+			break;
+		if (ntohl(request.magic) != NBD_REQUEST_MAGIC) {
+			error = -EPROTO;
+			break;
+		}
+		from = be64toh(request.from);
+		len = ntohl(request.len);
+
+		reply.magic = htonl(NBD_REPLY_MAGIC);
+		reply.error = 0;
+		memcpy(reply.handle, request.handle, sizeof reply.handle);
+
+		switch (ntohl(request.type) & 0xffff) {
+			case NBD_CMD_READ:
+				if (len > buf_size) {
+					uint8_t *new_buf = realloc(buf, len);
+					if (new_buf == NULL) {
+						reply.error = htonl(ENOMEM);
+						break;
+					}
+					buf = new_buf;
+					buf_size = len;
+				}
+				if (store_image_read(si, buf, from, len) != len)
+					reply.error = htonl(EIO);
+				break;
+			case NBD_CMD_WRITE:
+				// Read-only; skip over the data.
+				while (len > 0) {
+					uint8_t discard[4096];
+					size_t n = len < sizeof discard ? len : sizeof discard;
+					error = read_all(sock, discard, n);
+					if (error < 0)
+						goto out;
+					len -= n;
+				}
+				reply.error = htonl(EPERM);
+				break;
+			case NBD_CMD_DISC:
+				error = 0;
+				goto out;
+			case NBD_CMD_FLUSH:
+				break;
+			default:
+				reply.error = htonl(EINVAL);
+				break;
+		}
+
+		error = write_all(sock, &reply, sizeof reply);
+		if (error == 0 && (ntohl(request.type) & 0xffff) == NBD_CMD_READ &&
+				reply.error == 0)
+			error = write_all(sock, buf, len);
+		if (error < 0)
+			break;
+	}
+
+out:
+	free(buf);
+	return error == -EPIPE ? 0 : error;
+}
+
+static int
+cmd_serve(int argc, char *argv[])
+{
+	struct store_image si;
+	struct sigaction sa;
+	pthread_t thread;
+	int nbd_fd;
+	int sock[2];
+	int error;
+
+	if (argc != 4)
+		return -EINVAL;
+
+	if (store_image_open(&si, argv[1], argv[2]) < 0)
+		return 1;
+
+	nbd_fd = open(argv[3], O_RDWR | O_CLOEXEC);
+	if (nbd_fd == -1) {
+		fprintf(stderr, "operastore: could not open %s: %s\n", argv[3],
+				strerror(errno));
+		store_image_close(&si);
+		return 1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock) == -1) {
+		fprintf(stderr, "operastore: socketpair: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	ioctl(nbd_fd, NBD_CLEAR_SOCK);
+	if (ioctl(nbd_fd, NBD_SET_BLKSIZE, 512UL) == -1 ||
+			ioctl(nbd_fd, NBD_SET_SIZE,
+					(unsigned long) si.header.image_size) == -1 ||
+			ioctl(nbd_fd, NBD_SET_FLAGS,
+					(unsigned long) (NBD_FLAG_HAS_FLAGS |
+					NBD_FLAG_READ_ONLY | NBD_FLAG_SEND_FLUSH)) == -1 ||
+			ioctl(nbd_fd, NBD_SET_SOCK, (unsigned long) sock[0]) == -1) {
+		fprintf(stderr, "operastore: could not set up %s: %s\n", argv[3],
+				strerror(errno));
+		goto out_err;
+	}
+
+	serve_nbd_fd = nbd_fd;
+	memset(&sa, '\0', sizeof sa);
+	sa.sa_handler = serve_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (pthread_create(&thread, NULL, serve_do_it, &nbd_fd) != 0) {
+		fprintf(stderr, "operastore: could not start a thread.\n");
+		goto out_err;
+	}
+	fprintf(stderr, "operastore: serving %s (%.1f MiB) on %s\n", argv[2],
+			si.header.image_size / 1048576.0, argv[3]);
+
+	error = serve_requests(&si, sock[1]);
+	if (error < 0) {
+		fprintf(stderr, "operastore: %s\n", strerror(-error));
+		ioctl(nbd_fd, NBD_DISCONNECT);
+	}
+	close(sock[1]);
+	pthread_join(thread, NULL);
+	serve_nbd_fd = -1;
+	close(sock[0]);
+	close(nbd_fd);
+	store_image_close(&si);
+	return error < 0 ? 1 : 0;
+
+out_err:
+	close(nbd_fd);
+	store_image_close(&si);
+	return 1;
+}
+
+
+//============================================================================
+
+
+struct stats_object {
+	uint8_t hash[SHA256_SIZE];
+	uint64_t size;
+};
+
+static int
+stats_object_cmp(const void *a, const void *b)
+{
+	return memcmp(((const struct stats_object *) a)->hash,
+			((const struct stats_object *) b)->hash, SHA256_SIZE);
+}
+
+static int
+cmd_stats(int argc, char *argv[])
+{
+	struct stats_object *objects = NULL;
+	size_t num_objects = 0, max_objects = 0;
+	struct store_recipe_header header;
+	struct store_extent *extents;
+	struct dirent *de;
+	uint64_t image_bytes = 0, file_bytes = 0, zero_bytes = 0;
+	uint64_t stored_bytes = 0;
+	size_t num_images = 0, num_unique = 0;
+	char *path;
+	DIR *dir;
+	size_t i;
+	uint64_t j;
+
+	if (argc != 2)
+		return -EINVAL;
+
+	if (asprintf(&path, "%s/images", argv[1]) == -1)
+		return 1;
+	dir = opendir(path);
+	free(path);
+	if (dir == NULL) {
+		fprintf(stderr, "operastore: %s is not a store.\n", argv[1]);
+		return 1;
+	}
+
+	// Collect the objects used by all images.
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' || strstr(de->d_name, ".tmp.") != NULL)
+			continue;
+		if (asprintf(&path, "%s/images/%s", argv[1], de->d_name) == -1)
+			break;
+		if (store_read_recipe(path, &header, &extents) < 0) {
+			fprintf(stderr, "operastore: bad recipe %s\n", path);
+			free(path);
+			continue;
+		}
+		free(path);
+		num_images++;
+		image_bytes += header.image_size;
+
+		if (num_objects + header.num_extents + 1 > max_objects) {
+			struct stats_object *new_objects;
+			max_objects = 2 * (num_objects + header.num_extents + 1);
+			new_objects = realloc(objects,
+					max_objects * sizeof (struct stats_object));
+			if (new_objects == NULL) {
+				free(extents);
+				break;
+			}
+			objects = new_objects;
+		}
+		memcpy(objects[num_objects].hash, header.residual_hash,
+				SHA256_SIZE);
+		objects[num_objects++].size = header.residual_size;
+		for (j = 0; j < header.num_extents; j++) {
+			if (extents[j].kind == STORE_EXTENT_ZERO) {
+				zero_bytes += extents[j].length;
+				continue;
+			}
+			file_bytes += extents[j].length;
+			memcpy(objects[num_objects].hash, extents[j].hash, SHA256_SIZE);
+			objects[num_objects++].size = extents[j].length;
+		}
+		free(extents);
+	}
+	closedir(dir);
+
+	// An object may be used several times, by one image or by many;
+	// it is stored once.
+	qsort(objects, num_objects, sizeof (struct stats_object),
+			stats_object_cmp);
+	for (i = 0; i < num_objects; i++) {
+		if (i > 0 && memcmp(objects[i - 1].hash, objects[i].hash,
+				SHA256_SIZE) == 0)
+			continue;
+		num_unique++;
+		stored_bytes += objects[i].size;
+	}
+	free(objects);
+
+	printf("images:          %zu\n"
+			"image bytes:     %llu (%.1f MiB)\n"
+			"  in files:      %llu\n"
+			"  in zero runs:  %llu\n"
+			"objects:         %zu (%zu references)\n"
+			"stored bytes:    %llu (%.1f MiB)\n"
+			"dedup ratio:     %.2f\n",
+			num_images, (unsigned long long) image_bytes,
+			image_bytes / 1048576.0, (unsigned long long) file_bytes,
+			(unsigned long long) zero_bytes, num_unique, num_objects,
+			(unsigned long long) stored_bytes, stored_bytes / 1048576.0,
+			stored_bytes > 0 ? (double) image_bytes / stored_bytes : 0.0);
+	return 0;
+}
+
+
+//============================================================================
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s ingest [-j threads] <store> <image>...\n"
+			"       %s stats <store>\n"
+			"       %s rebuild <store> <name> <output>\n"
+			"       %s serve <store> <name> </dev/nbdN>\n"
+			"    -j threads   number of ingesting threads (default: number "
+			"of CPUs)\n"
+			"<name> is the base name of the image file at ingest time.\n",
+			progname, progname, progname, progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int res;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "ingest") == 0) {
+		res = cmd_ingest(argc - 1, argv + 1);
+	} else if (strcmp(argv[1], "stats") == 0) {
+		res = cmd_stats(argc - 1, argv + 1);
+	} else if (strcmp(argv[1], "rebuild") == 0) {
+		res = cmd_rebuild(argc - 1, argv + 1);
+	} else if (strcmp(argv[1], "serve") == 0) {
+		res = cmd_serve(argc - 1, argv + 1);
+	} else
+		res = -EINVAL;
+
+	if (res == -EINVAL) {
+		usage(argv[0]);
+		return 1;
+	}
+	return res < 0 ? 1 : res;
+}
+
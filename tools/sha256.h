@@ -0,0 +1,43 @@
+/*
+ * sha256.h
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// SHA-256 (FIPS 180-4), for naming the objects of operastore.
+
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t length;  // bytes hashed so far
+	uint8_t buf[64];
+	size_t buf_len;
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_SIZE]);
+
+// Hash a whole buffer in one go.
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_SIZE]);
+
+#endif  /* _SHA256_H */
+
@@ -0,0 +1,183 @@
+/*
+ * trace.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Access trace.
+// With the trace=<records> mount option, every open and read of a file
+// is recorded in a ring buffer of that many records. The ring can be read
+// from /proc/fs/opera/<device>/trace, oldest record first:
+//   disk_id <id>
+//   <ino> <pos> <len>
+//   ...
+// where <ino> is the inode number (the position of the directory entry
+// on the disk), and <len> is 0 for an open.
+// tools/operaprewarm uses this to warm the page cache on the next mount
+// of the same disk.
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+static void *opera_trace_seq_start(struct seq_file *m, loff_t *pos);
+static void *opera_trace_seq_next(struct seq_file *m, void *v, loff_t *pos);
+static void opera_trace_seq_stop(struct seq_file *m, void *v);
+static int opera_trace_seq_show(struct seq_file *m, void *v);
+
+
+//============================================================================
+
+
+const struct seq_operations opera_trace_seq_ops = {
+	.start = opera_trace_seq_start,
+	.next = opera_trace_seq_next,
+	.stop = opera_trace_seq_stop,
+	.show = opera_trace_seq_show,
+};
+
+
+//============================================================================
+
+
+int
+opera_trace_init(struct opera_sb_info *sbi)
+{
+	struct opera_trace *trace = &sbi->trace;
+
+	spin_lock_init(&trace->lock);
+	trace->records = NULL;
+	trace->size = 0;
+	trace->next = 0;
+	trace->count = 0;
+
+	if (sbi->options.trace == 0)
+		return 0;
+
+	trace->records = vmalloc(sbi->options.trace *
+			sizeof (struct opera_trace_record));
+	if (trace->records == NULL)
+		return -ENOMEM;
+	trace->size = sbi->options.trace;
+	return 0;
+}
+
+void
+opera_trace_free(struct opera_sb_info *sbi)
+{
+	vfree(sbi->trace.records);
+	sbi->trace.records = NULL;
+	sbi->trace.size = 0;
+}
+
+void
+opera_trace_add(struct opera_sb_info *sbi, ino_t ino, loff_t pos,
+		size_t len)
+{
+	struct opera_trace *trace = &sbi->trace;
+	struct opera_trace_record *record;
+
+	if (trace->size == 0)
+		return;
+
+	spin_lock(&trace->lock);
+	record = &trace->records[trace->next];
+	record->ino = ino;
+	record->pos = pos;
+	record->len = len;
+	trace->next++;
+	if (trace->next == trace->size)
+		trace->next = 0;
+	trace->count++;
+	spin_unlock(&trace->lock);
+}
+
+// Position 0 is the header, position n > 0 is the n-th oldest record
+// still in the ring.
+static struct opera_trace_record *
+opera_trace_seq_record(struct opera_trace *trace, loff_t pos)
+{
+	unsigned int num_records;
+	unsigned int first;
+
+	if (trace->count < trace->size) {
+		num_records = trace->count;
+		first = 0;
+	} else {
+		num_records = trace->size;
+		first = trace->next;
+	}
+
+	if (pos > num_records)
+		return NULL;
+	return &trace->records[(first + pos - 1) % trace->size];
+}
+
+// The lock is held from start to stop, so that the records don't change
+// under our feet. show() does not sleep.
+static void *
+opera_trace_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct opera_sb_info *sbi = (struct opera_sb_info *) m->private;
+
+	spin_lock(&sbi->trace.lock);
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+	return opera_trace_seq_record(&sbi->trace, *pos);
+}
+
+static void *
+opera_trace_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct opera_sb_info *sbi = (struct opera_sb_info *) m->private;
+
+	(*pos)++;
+	(void) v;  /* Unused variable - satisfy compiler */
+	return opera_trace_seq_record(&sbi->trace, *pos);
+}
+
+static void
+opera_trace_seq_stop(struct seq_file *m, void *v)
+{
+	struct opera_sb_info *sbi = (struct opera_sb_info *) m->private;
+
+	spin_unlock(&sbi->trace.lock);
+	(void) v;  /* Unused variable - satisfy compiler */
+}
+
+static int
+opera_trace_seq_show(struct seq_file *m, void *v)
+{
+	struct opera_sb_info *sbi = (struct opera_sb_info *) m->private;
+	const struct opera_trace_record *record;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "disk_id %08X\n", sbi->disk_id);
+		return 0;
+	}
+
+	record = (const struct opera_trace_record *) v;
+	seq_printf(m, "%llu %llu %u\n", (unsigned long long) record->ino,
+			(unsigned long long) record->pos, record->len);
+	return 0;
+}
+
@@ -0,0 +1,305 @@
+/*
+ * tree.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// OPERA_IOC_TREE_SNAPSHOT: return all descendants of a directory as a
+// flat array (see operafs.h for the interface).
+//
+// The directories still to be read are kept in a queue ordered by their
+// position on the disk, so that the directory blocks are read in one
+// pass over the disk. No inodes or dentries are created for what is
+// returned. The state of the walk is kept with the open directory, so
+// that a walk can be continued by a later call.
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+struct opera_tree_dir {
+	uint32_t start_block;
+	uint32_t num_blocks;
+	uint32_t index;  // entry index of the directory itself
+};
+
+struct opera_tree_walk {
+	struct opera_tree_dir *dirs;
+			// dirs[head] is being read. Those after it are waiting,
+			// sorted by start_block.
+	unsigned int num_dirs;
+	unsigned int max_dirs;
+	unsigned int head;
+	loff_t pos;  // position within dirs[head]
+	uint64_t next_index;  // index of the next entry to return
+};
+
+struct opera_tree_arg {
+	struct super_block *sb;
+	struct opera_tree_walk *walk;
+	uint32_t parent;
+	struct opera_tree_entry __user *entries;
+	uint32_t max_entries;
+	uint32_t count;
+	int error;
+			// Set if the callback stopped the walk because of an error
+			// or because the user buffer is full (-ENOSPC).
+};
+
+static int opera_tree_callback(void *data, const char *name, size_t len,
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd);
+
+
+//============================================================================
+
+
+void
+opera_tree_walk_free(struct opera_tree_walk *walk)
+{
+	kfree(walk->dirs);
+	kfree(walk);
+}
+
+static struct opera_tree_walk *
+opera_tree_walk_new(struct inode *dir)
+{
+	struct opera_tree_walk *walk;
+
+	walk = kzalloc(sizeof *walk, GFP_KERNEL);
+	if (walk == NULL)
+		return NULL;
+
+	walk->max_dirs = 16;
+	walk->dirs = kmalloc_array(walk->max_dirs,
+			sizeof (struct opera_tree_dir), GFP_KERNEL);
+	if (walk->dirs == NULL) {
+		kfree(walk);
+		return NULL;
+	}
+
+	walk->dirs[0].start_block = OPERA_I(dir)->start_block;
+	walk->dirs[0].num_blocks = dir->i_size >> OPERA_SB(dir->i_sb)->block_shift;
+	walk->dirs[0].index = OPERA_TREE_TOP;
+	walk->num_dirs = 1;
+	return walk;
+}
+
+// Queue a directory, keeping the waiting ones sorted by start_block.
+static int
+opera_tree_queue(struct opera_tree_walk *walk, struct opera_sb_info *sbi,
+		uint32_t start_block, uint32_t num_blocks, uint32_t index)
+{
+	unsigned int lo, hi, mid;
+
+	if (walk->num_dirs >= sbi->block_count) {
+		// There can't be more directories than blocks; there must be
+		// a loop in the directory structure.
+		printk(KERN_ERR "Opera: directory loop detected at block %d "
+				"(disk #%08X).\n", start_block, sbi->disk_id);
+		return -ELOOP;
+	}
+
+	if (walk->num_dirs == walk->max_dirs) {
+		struct opera_tree_dir *dirs;
+
+		dirs = krealloc(walk->dirs, 2 * walk->max_dirs *
+				sizeof (struct opera_tree_dir), GFP_KERNEL);
+		if (dirs == NULL)
+			return -ENOMEM;
+		walk->dirs = dirs;
+		walk->max_dirs *= 2;
+	}
+
+	lo = walk->head + 1;
+	hi = walk->num_dirs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (walk->dirs[mid].start_block <= start_block) {
+			lo = mid + 1;
+		} else
+			hi = mid;
+	}
+
+	memmove(&walk->dirs[lo + 1], &walk->dirs[lo],
+			(walk->num_dirs - lo) * sizeof (struct opera_tree_dir));
+	walk->dirs[lo].start_block = start_block;
+	walk->dirs[lo].num_blocks = num_blocks;
+	walk->dirs[lo].index = index;
+	walk->num_dirs++;
+	return 0;
+}
+
+static int
+opera_tree_callback(void *data, const char *name, size_t len,
+		ino_t ino, unsigned int type, const struct opera_disk_dirent *tdd)
+{
+	struct opera_tree_arg *arg = (struct opera_tree_arg *) data;
+	struct opera_sb_info *sbi = OPERA_SB(arg->sb);
+	struct opera_tree_entry entry;
+	int res;
+
+	if (arg->count == arg->max_entries) {
+		arg->error = -ENOSPC;
+		return -1;  // Stop, and come back to this entry next time.
+	}
+
+	memset(&entry, '\0', sizeof entry);
+	entry.ino = ino;
+	entry.parent = arg->parent;
+	entry.start_block = be32_to_cpu(tdd->copies[0]);
+	entry.type = type;
+	entry.name_len = len;
+	memcpy(entry.name, name, len);
+	if (type == DT_DIR) {
+		entry.size = (uint64_t) be32_to_cpu(tdd->block_count) *
+				sbi->block_size;
+	} else
+		entry.size = be32_to_cpu(tdd->byte_count);
+
+	if (type == DT_DIR) {
+		res = opera_tree_queue(arg->walk, sbi, entry.start_block,
+				be32_to_cpu(tdd->block_count),
+				(uint32_t) arg->walk->next_index);
+		if (res < 0) {
+			arg->error = res;
+			return -1;
+		}
+	}
+
+	if (copy_to_user(&arg->entries[arg->count], &entry, sizeof entry)) {
+		// Undo the queueing, so that the walk stays consistent if
+		// the caller retries.
+		if (type == DT_DIR) {
+			unsigned int i;
+			for (i = arg->walk->head + 1; i < arg->walk->num_dirs; i++) {
+				if (arg->walk->dirs[i].index ==
+						(uint32_t) arg->walk->next_index)
+					break;
+			}
+			memmove(&arg->walk->dirs[i], &arg->walk->dirs[i + 1],
+					(arg->walk->num_dirs - i - 1) *
+					sizeof (struct opera_tree_dir));
+			arg->walk->num_dirs--;
+		}
+		arg->error = -EFAULT;
+		return -1;
+	}
+
+	arg->count++;
+	arg->walk->next_index++;
+	return 0;
+}
+
+static long
+opera_tree_snapshot(struct file *file, struct opera_tree_snapshot __user *usnap)
+{
+	struct inode *inode = file_inode(file);
+	struct opera_tree_snapshot snap;
+	struct opera_dir_file *df;
+	struct opera_tree_walk *walk;
+	struct opera_tree_arg arg;
+	const struct opera_tree_dir *dir;
+	int res = 0;
+
+	if (copy_from_user(&snap, usnap, sizeof snap))
+		return -EFAULT;
+
+	inode_lock(inode);
+			// Protects file->private_data.
+
+	df = opera_dir_file(file);
+	if (df == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	walk = df->walk;
+	if (snap.cookie == 0) {
+		if (walk != NULL)
+			opera_tree_walk_free(walk);
+		walk = opera_tree_walk_new(inode);
+		df->walk = walk;
+		if (walk == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+	} else if (walk == NULL || snap.cookie != walk->next_index + 1) {
+		// Not from this file descriptor, or stale.
+		res = -EINVAL;
+		goto out;
+	}
+
+	arg.sb = inode->i_sb;
+	arg.walk = walk;
+	arg.entries = (struct opera_tree_entry __user *)
+			(uintptr_t) snap.entries;
+	arg.max_entries = snap.max_entries;
+	arg.count = 0;
+	arg.error = 0;
+
+	while (walk->head < walk->num_dirs) {
+		dir = &walk->dirs[walk->head];
+		arg.parent = dir->index;
+		res = opera_for_all_entries_at(inode->i_sb, dir->start_block,
+				dir->num_blocks, &walk->pos, opera_tree_callback, &arg);
+		if (res < 0)
+			goto out;
+		if (arg.error != 0)
+			break;
+		walk->head++;
+		walk->pos = 0;
+	}
+
+	if (arg.error != 0 && arg.error != -ENOSPC) {
+		res = arg.error;
+		goto out;
+	}
+	if (arg.error == -ENOSPC && arg.count == 0) {
+		// Not even room for one entry.
+		res = -EINVAL;
+		goto out;
+	}
+
+	snap.count = arg.count;
+	snap.flags = walk->head == walk->num_dirs ? OPERA_TREE_DONE : 0;
+	snap.cookie = walk->next_index + 1;
+			// + 1, because 0 means 'start'.
+	res = 0;
+	if (copy_to_user(usnap, &snap, sizeof snap))
+		res = -EFAULT;
+
+out:
+	inode_unlock(inode);
+	return res;
+}
+
+long
+opera_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+		case OPERA_IOC_TREE_SNAPSHOT:
+			return opera_tree_snapshot(file,
+					(struct opera_tree_snapshot __user *) arg);
+		default:
+			return -ENOTTY;
+	}
+}
+
@@ -0,0 +1,147 @@
+/*
+ * xattr.c
+ * Copyright 2004-2010  Serge van den Boom (svdb@stack.nl)
+ *
+ * This file is part of the Opera file system driver for Linux.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Read-only extended attributes exposing the Opera directory entry
+// metadata. Everything is served from what operafs_iget() stored in
+// the inode; no blocks are read here.
+//
+//   opera.type       file type, as on the disk ("*dir", "*zap", ...)
+//   opera.id         unique identifier of the entry (hex)
+//   opera.flags      directory entry flags (hex)
+//   opera.last_copy  number of copies - 1
+//   opera.copies     locations of all copies, in blocks, space separated
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/xattr.h>
+
+#include "operafs.h"
+
+
+//============================================================================
+
+
+static int opera_xattr_get(const struct xattr_handler *handler,
+		struct dentry *dentry, struct inode *inode, const char *name,
+		void *buffer, size_t size);
+
+
+//============================================================================
+
+
+#define OPERA_XATTR_PREFIX "opera."
+
+static const struct xattr_handler opera_xattr_handler = {
+	.prefix = OPERA_XATTR_PREFIX,
+	.get = opera_xattr_get,
+};
+
+const struct xattr_handler *opera_xattr_handlers[] = {
+	&opera_xattr_handler,
+	NULL
+};
+
+// Attribute names, as returned by listxattr(), '\0'-separated.
+static const char opera_xattr_names[] =
+		OPERA_XATTR_PREFIX "type\0"
+		OPERA_XATTR_PREFIX "id\0"
+		OPERA_XATTR_PREFIX "flags\0"
+		OPERA_XATTR_PREFIX "last_copy\0"
+		OPERA_XATTR_PREFIX "copies";
+
+
+//============================================================================
+
+
+// Copy a value to the user buffer, following the getxattr() rules:
+// with size 0 only the length is returned.
+static int
+opera_xattr_copy(void *buffer, size_t size, const void *value, size_t len)
+{
+	if (size == 0)
+		return len;
+	if (len > size)
+		return -ERANGE;
+	memcpy(buffer, value, len);
+	return len;
+}
+
+static int
+opera_xattr_get_copies(struct opera_inode_info *info, void *buffer,
+		size_t size)
+{
+	char *str;
+	size_t len = 0;
+	size_t max_len;
+	uint32_t i;
+	int res;
+
+	max_len = (info->last_copy + 1) * 11;
+			// At most 10 digits plus a separator per copy.
+	str = kmalloc(max_len, GFP_KERNEL);
+	if (str == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i <= info->last_copy; i++) {
+		len += scnprintf(str + len, max_len - len, i == 0 ? "%u" : " %u",
+				info->copies[i]);
+	}
+
+	res = opera_xattr_copy(buffer, size, str, len);
+	kfree(str);
+	return res;
+}
+
+static int
+opera_xattr_get(const struct xattr_handler *handler, struct dentry *dentry,
+		struct inode *inode, const char *name, void *buffer, size_t size)
+{
+	struct opera_inode_info *info = OPERA_I(inode);
+	char str[16];
+	size_t len;
+
+	if (strcmp(name, "type") == 0) {
+		// Strip the '\0' padding of short types, if any.
+		len = strnlen(info->type, sizeof info->type);
+		return opera_xattr_copy(buffer, size, info->type, len);
+	}
+
+	if (strcmp(name, "id") == 0) {
+		len = scnprintf(str, sizeof str, "%08X", info->id);
+	} else if (strcmp(name, "flags") == 0) {
+		len = scnprintf(str, sizeof str, "%08X", info->flags);
+	} else if (strcmp(name, "last_copy") == 0) {
+		len = scnprintf(str, sizeof str, "%u", info->last_copy);
+	} else if (strcmp(name, "copies") == 0) {
+		return opera_xattr_get_copies(info, buffer, size);
+	} else
+		return -ENODATA;
+
+	(void) handler;  /* Unused variable - satisfy compiler */
+	(void) dentry;  /* Unused variable - satisfy compiler */
+	return opera_xattr_copy(buffer, size, str, len);
+}
+
+ssize_t
+opera_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	(void) dentry;  /* Unused variable - satisfy compiler */
+	return opera_xattr_copy(buffer, size, opera_xattr_names,
+			sizeof opera_xattr_names);
+}
+